@@ -40,6 +40,7 @@
 #include "tapdisk.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-server.h"
 
 #define MAX_AIO_REQS         TAPDISK_DATA_REQUESTS
 
@@ -155,6 +156,9 @@ int tdaio_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
         prv->fd = fd;
 
+	/* optional: lets the I/O driver skip per-request fd lookups */
+	tapdisk_server_register_fd(fd);
+
 done:
 	return ret;	
 }
@@ -228,6 +232,7 @@ int tdaio_close(td_driver_t *driver)
 {
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
 	
+	tapdisk_server_unregister_fd(prv->fd);
 	close(prv->fd);
 
 	return 0;
@@ -35,6 +35,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "blk.h"
 #include "tapdisk.h"
@@ -47,6 +48,9 @@ long int   disksize;
 long int   diskinfo;
 static int connections = 0;
 
+/* VBDs on different worker loops may share the image */
+static pthread_mutex_t ram_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct tdram_state {
         int fd;
 };
@@ -115,6 +119,8 @@ int tdram_open (td_driver_t *driver, const char *name, td_flag_t flags)
 	int i, fd, ret = 0, count = 0, o_flags;
 	struct tdram_state *prv = (struct tdram_state *)driver->data;
 
+	pthread_mutex_lock(&ram_lock);
+
 	connections++;
 
 	if (connections > 1) {
@@ -162,7 +168,8 @@ int tdram_open (td_driver_t *driver, const char *name, td_flag_t flags)
 	if (driver->info.size > size) {
 		DPRINTF("Disk exceeds limit, must be less than [%d]MB",
 			(MAX_RAMDISK_SIZE<<SECTOR_SHIFT)>>20);
-		return -ENOMEM;
+		ret = -ENOMEM;
+		goto done;
 	}
 
 	/*Read the image into memory*/
@@ -170,7 +177,8 @@ int tdram_open (td_driver_t *driver, const char *name, td_flag_t flags)
 			   DEFAULT_SECTOR_SIZE,
 			   driver->info.size << SECTOR_SHIFT)) {
 		DPRINTF("Mem malloc failed\n");
-		return -errno;
+		ret = -errno;
+		goto done;
 	}
 	p = img;
 	DPRINTF("Reading %llu bytes.......",
@@ -195,6 +203,7 @@ int tdram_open (td_driver_t *driver, const char *name, td_flag_t flags)
 	}
 
 done:
+	pthread_mutex_unlock(&ram_lock);
 	return ret;
 }
 
@@ -226,7 +235,9 @@ int tdram_close(td_driver_t *driver)
 {
 	struct tdram_state *prv = (struct tdram_state *)driver->data;
 	
+	pthread_mutex_lock(&ram_lock);
 	connections--;
+	pthread_mutex_unlock(&ram_lock);
 	
 	return 0;
 }
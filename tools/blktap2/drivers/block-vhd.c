@@ -259,9 +259,13 @@ struct vhd_state {
 static void vhd_complete(void *, struct tiocb *, int);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
 
-static struct vhd_state  *_vhd_master;
-static unsigned long      _vhd_zsize;
-static char              *_vhd_zeros;
+/*
+ * the zero buffer is per thread: with worker loops, each loop's first
+ * vhd maps it for the images that loop runs.
+ */
+static __thread struct vhd_state  *_vhd_master;
+static __thread unsigned long      _vhd_zsize;
+static __thread char              *_vhd_zeros;
 
 static int
 vhd_initialize(struct vhd_state *s)
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * tapdisk-bench: drive the tapdisk I/O queue at a fixed depth against an
+ * image file and report throughput and CPU cost for each queue driver.
+ *
+ * Each request gets its own buffer, spaced apart like blkif ring slots,
+ * so io_merge cannot coalesce them and any merging of sequential
+ * requests is down to the driver.  e.g.:
+ *
+ *   tapdisk-bench -d 64 -S /dev/shm/bench.img
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "tapdisk-server.h"
+#include "tapdisk-queue.h"
+
+struct bench_req {
+	struct tiocb            tiocb;
+	char                   *buf;
+};
+
+static int                      image_fd = -1;
+static unsigned long long       image_size = 256ULL << 20;
+static size_t                   block_size = 4096;
+static int                      depth = 32;
+static int                      seconds = 5;
+static int                      write_pct;
+static int                      sequential;
+
+static unsigned long long       next_offset;
+static unsigned long long       end_ns;
+static unsigned long long       ios, bytes, errors;
+static int                      inflight;
+
+extern tapdisk_server_t         server;
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double
+cpu_secs(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void bench_complete(void *, struct tiocb *, int);
+
+static void
+bench_issue(struct bench_req *req)
+{
+	unsigned long long blocks = image_size / block_size;
+	unsigned long long offset;
+	int rw;
+
+	if (sequential) {
+		offset      = next_offset;
+		next_offset = (next_offset + block_size) % (blocks * block_size);
+	} else
+		offset = (random() % blocks) * block_size;
+
+	rw = (random() % 100) < write_pct;
+
+	tapdisk_prep_tiocb(&req->tiocb, image_fd, rw, req->buf, block_size,
+			   offset, bench_complete, req);
+	tapdisk_queue_tiocb(&server.aio_queue, &req->tiocb);
+}
+
+static void
+bench_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct bench_req *req = arg;
+
+	if (err)
+		errors++;
+	else {
+		ios++;
+		bytes += block_size;
+	}
+
+	if (now_ns() < end_ns)
+		bench_issue(req);
+	else
+		inflight--;
+}
+
+static int
+bench_run(int drv, struct bench_req *reqs, char *pool, size_t pool_size)
+{
+	unsigned long long start;
+	double secs, cpu;
+	int i, err;
+
+	tapdisk_server_init();
+
+	err = tapdisk_init_queue(&server.aio_queue, depth, drv, NULL);
+	if (err) {
+		fprintf(stderr, "failed to set up queue: %d\n", err);
+		return err;
+	}
+
+	tapdisk_server_register_fd(image_fd);
+	tapdisk_server_register_buffer(pool, pool_size);
+
+	ios = bytes = errors = 0;
+	next_offset = 0;
+	srandom(1);
+
+	start  = now_ns();
+	end_ns = start + seconds * 1000000000ULL;
+	cpu    = cpu_secs();
+
+	for (i = 0; i < depth; i++)
+		bench_issue(&reqs[i]);
+	inflight = depth;
+
+	while (inflight) {
+		tapdisk_submit_all_tiocbs(&server.aio_queue);
+		if (server.aio_queue.tiocbs_pending)
+			scheduler_wait_for_events(&server.scheduler);
+	}
+
+	secs = (now_ns() - start) / 1e9;
+	cpu  = cpu_secs() - cpu;
+
+	printf("%-6s %10.0f %10.1f %12.2f %8llu\n",
+	       server.aio_queue.tio->name, ios / secs,
+	       bytes / secs / (1 << 20), ios ? cpu * 1e6 / ios : 0.0,
+	       errors);
+
+	tapdisk_server_unregister_buffer(pool);
+	tapdisk_server_unregister_fd(image_fd);
+	tapdisk_free_queue(&server.aio_queue);
+
+	return errors ? -EIO : 0;
+}
+
+static void
+usage(const char *prog, int code)
+{
+	fprintf(stderr, "usage: %s [-d depth] [-b block size] [-s seconds] "
+		"[-w write%%] [-z image MB] [-S] [-D] [-q rwio|lio|uring] "
+		"<image>\n", prog);
+	exit(code);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct { const char *name; int drv; } drivers[] = {
+		{ "rwio",  TIO_DRV_RWIO  },
+		{ "lio",   TIO_DRV_LIO   },
+		{ "uring", TIO_DRV_URING },
+	};
+	const char *image, *only = NULL;
+	struct bench_req *reqs;
+	size_t stride, pool_size;
+	char *pool;
+	int c, i, flags, err = 0;
+
+	flags = O_RDWR | O_CREAT | O_LARGEFILE;
+
+	while ((c = getopt(argc, argv, "d:b:s:w:z:SDq:h")) != -1) {
+		switch (c) {
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'w':
+			write_pct = atoi(optarg);
+			break;
+		case 'z':
+			image_size = strtoull(optarg, NULL, 0) << 20;
+			break;
+		case 'S':
+			sequential = 1;
+			break;
+		case 'D':
+			flags |= O_DIRECT;
+			break;
+		case 'q':
+			only = optarg;
+			break;
+		case 'h':
+			usage(argv[0], 0);
+		default:
+			usage(argv[0], EINVAL);
+		}
+	}
+
+	if (optind != argc - 1 || depth <= 0 || !block_size ||
+	    block_size % 512 || image_size < block_size || seconds <= 0)
+		usage(argv[0], EINVAL);
+
+	image = argv[optind];
+
+	image_fd = open(image, flags, 0644);
+	if (image_fd == -1) {
+		perror(image);
+		return errno;
+	}
+
+	if (ftruncate(image_fd, image_size)) {
+		perror("ftruncate");
+		return errno;
+	}
+
+	/* one page between buffers keeps io_merge from joining them */
+	stride    = block_size + getpagesize();
+	pool_size = stride * depth;
+	pool      = mmap(NULL, pool_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	reqs      = calloc(depth, sizeof(struct bench_req));
+	if (pool == MAP_FAILED || !reqs) {
+		perror("allocating buffers");
+		return ENOMEM;
+	}
+
+	for (i = 0; i < depth; i++) {
+		reqs[i].buf = pool + i * stride;
+		memset(reqs[i].buf, i, block_size);
+	}
+
+	printf("%s: %s %zu byte requests, %d%% writes, depth %d, %ds\n\n",
+	       image, sequential ? "sequential" : "random", block_size,
+	       write_pct, depth, seconds);
+	printf("%-6s %10s %10s %12s %8s\n",
+	       "queue", "iops", "MB/s", "cpu us/io", "errors");
+
+	for (i = 0; i < sizeof(drivers) / sizeof(drivers[0]); i++) {
+		if (only && strcmp(only, drivers[i].name))
+			continue;
+
+		if (bench_run(drivers[i].drv, reqs, pool, pool_size))
+			err = EIO;
+	}
+
+	munmap(pool, pool_size);
+	free(reqs);
+	close(image_fd);
+
+	return err;
+}
@@ -214,80 +214,122 @@ tapdisk_control_validate_request(tapdisk_message_t *request)
 	return 0;
 }
 
+struct tapdisk_control_list {
+	struct tapdisk_control_connection *connection;
+	tapdisk_message_t                  response;
+	int                                count;
+	int                                full;
+};
+
 static void
-tapdisk_control_list_minors(struct tapdisk_control_connection *connection,
-			    tapdisk_message_t *request)
+tapdisk_control_list_loop_minors(void *private)
 {
-	int i;
+	struct tapdisk_control_list *list = private;
 	td_vbd_t *vbd;
-	struct list_head *head;
-	tapdisk_message_t response;
-
-	i = 0;
-	memset(&response, 0, sizeof(response));
-
-	response.type = TAPDISK_MESSAGE_LIST_MINORS_RSP;
-	response.cookie = request->cookie;
 
-	head = tapdisk_server_get_all_vbds();
+	if (list->full)
+		return;
 
-	list_for_each_entry(vbd, head, next) {
-		response.u.minors.list[i++] = vbd->minor;
-		if (i >= TAPDISK_MESSAGE_MAX_MINORS) {
-			response.type = TAPDISK_MESSAGE_ERROR;
-			response.u.response.error = ERANGE;
+	list_for_each_entry(vbd, tapdisk_server_get_all_vbds(), next) {
+		list->response.u.minors.list[list->count++] = vbd->minor;
+		if (list->count >= TAPDISK_MESSAGE_MAX_MINORS) {
+			list->response.type = TAPDISK_MESSAGE_ERROR;
+			list->response.u.response.error = ERANGE;
+			list->full = 1;
 			break;
 		}
 	}
+}
 
-	response.u.minors.count = i;
-	tapdisk_control_write_message(connection->socket, &response, 2);
+static void
+tapdisk_control_list_minors(struct tapdisk_control_connection *connection,
+			    tapdisk_message_t *request)
+{
+	struct tapdisk_control_list list;
+	int err;
+
+	memset(&list, 0, sizeof(list));
+
+	list.response.type = TAPDISK_MESSAGE_LIST_MINORS_RSP;
+	list.response.cookie = request->cookie;
+
+	err = tapdisk_server_call_all(tapdisk_control_list_loop_minors, &list);
+	if (err) {
+		list.response.type = TAPDISK_MESSAGE_ERROR;
+		list.response.u.response.error = -err;
+	}
+
+	list.response.u.minors.count = list.count;
+	tapdisk_control_write_message(connection->socket, &list.response, 2);
 	tapdisk_control_close_connection(connection);
 }
 
 static void
-tapdisk_control_list(struct tapdisk_control_connection *connection,
-		     tapdisk_message_t *request)
+tapdisk_control_count_loop_vbds(void *private)
 {
+	struct tapdisk_control_list *list = private;
 	td_vbd_t *vbd;
-	struct list_head *head;
-	tapdisk_message_t response;
-	int count, i;
-
-	memset(&response, 0, sizeof(response));
-	response.type = TAPDISK_MESSAGE_LIST_RSP;
-	response.cookie = request->cookie;
 
-	head = tapdisk_server_get_all_vbds();
+	list_for_each_entry(vbd, tapdisk_server_get_all_vbds(), next)
+		list->count++;
+}
 
-	count = 0;
-	list_for_each_entry(vbd, head, next)
-		count++;
+static void
+tapdisk_control_list_loop_vbds(void *private)
+{
+	struct tapdisk_control_list *list = private;
+	tapdisk_message_t *response = &list->response;
+	td_vbd_t *vbd;
 
-	list_for_each_entry(vbd, head, next) {
-		response.u.list.count   = count--;
-		response.u.list.minor   = vbd->minor;
-		response.u.list.state   = vbd->state;
-		response.u.list.path[0] = 0;
+	list_for_each_entry(vbd, tapdisk_server_get_all_vbds(), next) {
+		response->u.list.count   = list->count--;
+		response->u.list.minor   = vbd->minor;
+		response->u.list.state   = vbd->state;
+		response->u.list.path[0] = 0;
 
 		if (!list_empty(&vbd->images)) {
 			td_image_t *image = list_entry(vbd->images.next,
 						       td_image_t, next);
-			snprintf(response.u.list.path,
-				 sizeof(response.u.list.path),
+			snprintf(response->u.list.path,
+				 sizeof(response->u.list.path),
 				 "%s:%s",
 				 tapdisk_disk_types[image->type]->name,
 				 image->name);
 		}
 
-		tapdisk_control_write_message(connection->socket, &response, 2);
+		tapdisk_control_write_message(list->connection->socket,
+					      response, 2);
 	}
+}
 
-	response.u.list.count   = count;
-	response.u.list.minor   = -1;
-	response.u.list.path[0] = 0;
+static void
+tapdisk_control_list(struct tapdisk_control_connection *connection,
+		     tapdisk_message_t *request)
+{
+	struct tapdisk_control_list list;
+	int err;
 
-	tapdisk_control_write_message(connection->socket, &response, 2);
+	memset(&list, 0, sizeof(list));
+	list.connection = connection;
+	list.response.type = TAPDISK_MESSAGE_LIST_RSP;
+	list.response.cookie = request->cookie;
+
+	/* VBDs are listed by the loops that run them */
+	err = tapdisk_server_call_all(tapdisk_control_count_loop_vbds, &list);
+	if (!err)
+		err = tapdisk_server_call_all(tapdisk_control_list_loop_vbds,
+					      &list);
+
+	if (err) {
+		list.response.type = TAPDISK_MESSAGE_ERROR;
+		list.response.u.response.error = -err;
+	} else {
+		list.response.u.list.count   = list.count;
+		list.response.u.list.minor   = -1;
+		list.response.u.list.path[0] = 0;
+	}
+
+	tapdisk_control_write_message(connection->socket, &list.response, 2);
 	tapdisk_control_close_connection(connection);
 }
 
@@ -627,6 +669,57 @@ out:
 	tapdisk_control_close_connection(connection);
 }
 
+typedef void (*tapdisk_control_handler_t)(struct tapdisk_control_connection *,
+					  tapdisk_message_t *);
+
+struct tapdisk_control_call {
+	tapdisk_control_handler_t          handler;
+	struct tapdisk_control_connection *connection;
+	tapdisk_message_t                 *request;
+};
+
+static void
+__tapdisk_control_call(void *private)
+{
+	struct tapdisk_control_call *call = private;
+
+	call->handler(call->connection, call->request);
+}
+
+/*
+ * requests naming a VBD are handled on the loop which runs it (or will
+ * run it, for attach).  the connection is finished with this loop once
+ * the request is read, so drop its event here; the handler still
+ * writes the response and closes the socket.
+ */
+static void
+tapdisk_control_call(tapdisk_control_handler_t handler,
+		     struct tapdisk_control_connection *connection,
+		     tapdisk_message_t *request)
+{
+	struct tapdisk_control_call call = { handler, connection, request };
+	tapdisk_message_t response;
+	int err;
+
+	tapdisk_server_unregister_event(connection->event_id);
+	connection->event_id = 0;
+
+	err = tapdisk_server_call_vbd(request->cookie,
+				      __tapdisk_control_call, &call);
+	if (!err)
+		return;
+
+	EPRINTF("failed to run '%s' on its loop: %d\n",
+		tapdisk_message_name(request->type), err);
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_ERROR;
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
 static void
 tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 {
@@ -653,17 +746,23 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 	case TAPDISK_MESSAGE_LIST:
 		return tapdisk_control_list(connection, &message);
 	case TAPDISK_MESSAGE_ATTACH:
-		return tapdisk_control_attach_vbd(connection, &message);
+		return tapdisk_control_call(tapdisk_control_attach_vbd,
+					    connection, &message);
 	case TAPDISK_MESSAGE_DETACH:
-		return tapdisk_control_detach_vbd(connection, &message);
+		return tapdisk_control_call(tapdisk_control_detach_vbd,
+					    connection, &message);
 	case TAPDISK_MESSAGE_OPEN:
-		return tapdisk_control_open_image(connection, &message);
+		return tapdisk_control_call(tapdisk_control_open_image,
+					    connection, &message);
 	case TAPDISK_MESSAGE_PAUSE:
-		return tapdisk_control_pause_vbd(connection, &message);
+		return tapdisk_control_call(tapdisk_control_pause_vbd,
+					    connection, &message);
 	case TAPDISK_MESSAGE_RESUME:
-		return tapdisk_control_resume_vbd(connection, &message);
+		return tapdisk_control_call(tapdisk_control_resume_vbd,
+					    connection, &message);
 	case TAPDISK_MESSAGE_CLOSE:
-		return tapdisk_control_close_image(connection, &message);
+		return tapdisk_control_call(tapdisk_control_close_image,
+					    connection, &message);
 	default: {
 		tapdisk_message_t response;
 	fail:
@@ -28,8 +28,11 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <libaio.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
@@ -42,6 +45,7 @@
 #include "tapdisk-utils.h"
 
 #include "libaio-compat.h"
+#include "uring-compat.h"
 #include "atomicio.h"
 
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
@@ -262,9 +266,9 @@ tapdisk_rwio_submit(struct tqueue *queue)
 
 static const struct tio td_tio_rwio = {
 	.name        = "rwio",
-	.data_size   = 0,
-	.tio_setup   = NULL,
-	.tio_destroy = NULL,
+	.data_size   = sizeof(struct rwio),
+	.tio_setup   = tapdisk_rwio_setup,
+	.tio_destroy = tapdisk_rwio_destroy,
 	.tio_submit  = tapdisk_rwio_submit
 };
 
@@ -547,6 +551,593 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+#ifdef TD_HAVE_URING
+
+/*
+ * io_uring
+ *
+ * requests are passed to the kernel through a shared submission ring
+ * and come back through a completion ring, so a whole batch costs a
+ * single io_uring_enter and reaping completions costs no syscall.
+ *
+ * io_merge can only coalesce requests whose buffers are contiguous.
+ * requests for adjacent sectors from different ring slots (or from
+ * different VBDs sharing an image) are gathered into one vectored
+ * read or write instead.  a lone request inside a registered buffer
+ * goes out as a fixed-buffer read or write, and registered files save
+ * the kernel a file table lookup per request.
+ */
+
+#define URING_MAX_IOV           8
+#define URING_MAX_FILES         64
+#define URING_MAX_BUFS          16
+
+#define uring_mb()              __sync_synchronize()
+
+struct uring_req {
+	int                   nr;
+	struct iocb          *iocbs[URING_MAX_IOV];
+	struct iovec          iov[URING_MAX_IOV];
+};
+
+struct uring {
+	int                   ring_fd;
+	int                   event_fd;
+	int                   event_id;
+
+	void                 *sq_ring;
+	size_t                sq_ring_size;
+	void                 *cq_ring;
+	size_t                cq_ring_size;
+	struct td_uring_sqe  *sqes;
+	size_t                sqes_size;
+
+	volatile unsigned    *sq_head;
+	volatile unsigned    *sq_tail;
+	unsigned              sq_mask;
+	unsigned             *sq_array;
+
+	volatile unsigned    *cq_head;
+	volatile unsigned    *cq_tail;
+	unsigned              cq_mask;
+	struct td_uring_cqe  *cqes;
+
+	/* one slot per sqe in flight, named by its user_data */
+	struct uring_req     *reqs;
+	int                  *free_reqs;
+	int                   n_free_reqs;
+
+	struct io_event      *aio_events;
+
+	/* registered file table, -1 marks an empty slot */
+	int                   files[URING_MAX_FILES];
+	int                   flags;
+
+	struct iovec          bufs[URING_MAX_BUFS];
+	int                   n_bufs;
+};
+
+#define URING_FLAG_FILES        (1<<0)
+#define URING_FLAG_BUFS         (1<<1)
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+
+	if (!ur)
+		return;
+
+	if (ur->event_id >= 0) {
+		tapdisk_server_unregister_event(ur->event_id);
+		ur->event_id = -1;
+	}
+
+	if (ur->event_fd >= 0) {
+		close(ur->event_fd);
+		ur->event_fd = -1;
+	}
+
+	if (ur->sqes) {
+		munmap(ur->sqes, ur->sqes_size);
+		ur->sqes = NULL;
+	}
+
+	if (ur->cq_ring) {
+		munmap(ur->cq_ring, ur->cq_ring_size);
+		ur->cq_ring = NULL;
+	}
+
+	if (ur->sq_ring) {
+		munmap(ur->sq_ring, ur->sq_ring_size);
+		ur->sq_ring = NULL;
+	}
+
+	if (ur->ring_fd >= 0) {
+		close(ur->ring_fd);
+		ur->ring_fd = -1;
+	}
+
+	free(ur->reqs);
+	ur->reqs = NULL;
+	free(ur->free_reqs);
+	ur->free_reqs = NULL;
+	free(ur->aio_events);
+	ur->aio_events = NULL;
+}
+
+static void *
+tapdisk_uring_map(struct uring *ur, size_t size, off_t offset)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+		 MAP_SHARED|MAP_POPULATE, ur->ring_fd, offset);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static int
+tapdisk_uring_setup_ring(struct tqueue *queue, int qlen)
+{
+	struct uring *ur = queue->tio_data;
+	struct td_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+
+	ur->ring_fd = td_uring_setup(qlen, &p);
+	if (ur->ring_fd < 0)
+		return -errno;
+
+	ur->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->sq_ring = tapdisk_uring_map(ur, ur->sq_ring_size,
+					TD_IORING_OFF_SQ_RING);
+	if (!ur->sq_ring)
+		return -errno;
+
+	ur->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct td_uring_cqe);
+	ur->cq_ring = tapdisk_uring_map(ur, ur->cq_ring_size,
+					TD_IORING_OFF_CQ_RING);
+	if (!ur->cq_ring)
+		return -errno;
+
+	ur->sqes_size = p.sq_entries * sizeof(struct td_uring_sqe);
+	ur->sqes = tapdisk_uring_map(ur, ur->sqes_size, TD_IORING_OFF_SQES);
+	if (!ur->sqes)
+		return -errno;
+
+	sq = ur->sq_ring;
+	ur->sq_head  = (unsigned *)(sq + p.sq_off.head);
+	ur->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+	ur->sq_mask  = *(unsigned *)(sq + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+	cq = ur->cq_ring;
+	ur->cq_head  = (unsigned *)(cq + p.cq_off.head);
+	ur->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+	ur->cq_mask  = *(unsigned *)(cq + p.cq_off.ring_mask);
+	ur->cqes     = (struct td_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+}
+
+static void tapdisk_uring_event(event_id_t, char, void *);
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *ur = queue->tio_data;
+	int i, err;
+
+	ur->ring_fd  = -1;
+	ur->event_fd = -1;
+	ur->event_id = -1;
+	for (i = 0; i < URING_MAX_FILES; i++)
+		ur->files[i] = -1;
+
+	err = tapdisk_uring_setup_ring(queue, qlen);
+	if (err)
+		goto fail;
+
+	ur->reqs       = calloc(qlen, sizeof(struct uring_req));
+	ur->free_reqs  = calloc(qlen, sizeof(int));
+	ur->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!ur->reqs || !ur->free_reqs || !ur->aio_events) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < qlen; i++)
+		ur->free_reqs[i] = qlen - 1 - i;
+	ur->n_free_reqs = qlen;
+
+	ur->event_fd = tapdisk_sys_eventfd(0);
+	if (ur->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = td_uring_register(ur->ring_fd, TD_IORING_REGISTER_EVENTFD,
+				&ur->event_fd, 1);
+	if (err) {
+		err = -errno;
+		goto fail;
+	}
+
+	/* sparse file tables need 5.5, do without them on older kernels */
+	if (!td_uring_register(ur->ring_fd, TD_IORING_REGISTER_FILES,
+			       ur->files, URING_MAX_FILES))
+		ur->flags |= URING_FLAG_FILES;
+
+	ur->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      ur->event_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = ur->event_id;
+	if (err < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static int
+tapdisk_uring_find_file(struct uring *ur, int fd)
+{
+	int i;
+
+	if (!(ur->flags & URING_FLAG_FILES))
+		return -1;
+
+	for (i = 0; i < URING_MAX_FILES; i++)
+		if (ur->files[i] == fd)
+			return i;
+
+	return -1;
+}
+
+static int
+tapdisk_uring_find_buffer(struct uring *ur, const char *buf, size_t size)
+{
+	int i;
+
+	if (!(ur->flags & URING_FLAG_BUFS))
+		return -1;
+
+	for (i = 0; i < ur->n_bufs; i++) {
+		const char *base = ur->bufs[i].iov_base;
+
+		if (buf >= base && buf + size <= base + ur->bufs[i].iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * fill in an sqe for iocbs[0] and as many of the following iocbs as
+ * continue it on disk.  returns the number of iocbs consumed.
+ */
+static int
+tapdisk_uring_prep(struct uring *ur, struct uring_req *req,
+		   struct td_uring_sqe *sqe, struct iocb **iocbs, int n)
+{
+	struct iocb *io = iocbs[0];
+	int write = (io->aio_lio_opcode == IO_CMD_PWRITE);
+	long long end = io->u.c.offset + io->u.c.nbytes;
+	int i, idx;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	idx = tapdisk_uring_find_file(ur, io->aio_fildes);
+	if (idx >= 0) {
+		sqe->fd     = idx;
+		sqe->flags |= TD_IOSQE_FIXED_FILE;
+	} else
+		sqe->fd     = io->aio_fildes;
+	sqe->off = io->u.c.offset;
+
+	req->nr       = 1;
+	req->iocbs[0] = io;
+
+	while (req->nr < n && req->nr < URING_MAX_IOV) {
+		struct iocb *next = iocbs[req->nr];
+
+		if (next->aio_fildes     != io->aio_fildes     ||
+		    next->aio_lio_opcode != io->aio_lio_opcode ||
+		    next->u.c.offset     != end)
+			break;
+
+		end += next->u.c.nbytes;
+		req->iocbs[req->nr++] = next;
+	}
+
+	if (req->nr == 1) {
+		idx = tapdisk_uring_find_buffer(ur, io->u.c.buf,
+						io->u.c.nbytes);
+		if (idx >= 0) {
+			sqe->opcode    = write ?
+				TD_IORING_OP_WRITE_FIXED :
+				TD_IORING_OP_READ_FIXED;
+			sqe->addr      = (unsigned long)io->u.c.buf;
+			sqe->len       = io->u.c.nbytes;
+			sqe->buf_index = idx;
+			return 1;
+		}
+	}
+
+	for (i = 0; i < req->nr; i++) {
+		req->iov[i].iov_base = req->iocbs[i]->u.c.buf;
+		req->iov[i].iov_len  = req->iocbs[i]->u.c.nbytes;
+	}
+
+	sqe->opcode = write ? TD_IORING_OP_WRITEV : TD_IORING_OP_READV;
+	sqe->addr   = (unsigned long)req->iov;
+	sqe->len    = req->nr;
+
+	return req->nr;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *ur = queue->tio_data;
+	unsigned head, tail;
+	int i, ret, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+	uint64_t val;
+
+	read_exact(ur->event_fd, &val, sizeof(val));
+
+	ret  = 0;
+	head = *ur->cq_head;
+	tail = *ur->cq_tail;
+	uring_mb();
+
+	for (; head != tail; head++) {
+		struct td_uring_cqe *cqe = &ur->cqes[head & ur->cq_mask];
+		struct uring_req *req = &ur->reqs[cqe->user_data];
+		long res = cqe->res;
+
+		/* a short vectored transfer completes its iocbs in order */
+		for (i = 0; i < req->nr; i++) {
+			long nbytes = req->iocbs[i]->u.c.nbytes;
+
+			ep      = &ur->aio_events[ret++];
+			ep->obj = req->iocbs[i];
+			if (res < 0)
+				ep->res = res;
+			else {
+				ep->res = res < nbytes ? res : nbytes;
+				res    -= ep->res;
+			}
+			ep->res2 = 0;
+		}
+
+		ur->free_reqs[ur->n_free_reqs++] = cqe->user_data;
+	}
+
+	uring_mb();
+	*ur->cq_head = head;
+
+	split = io_split(&queue->opioctx, ur->aio_events, ret);
+	tapdisk_filter_events(queue->filter, ur->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", ret, split);
+
+	queue->iocbs_pending  -= ret;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = ur->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *ur = queue->tio_data;
+	int i, n, merged, entered, submitted, err = 0;
+	unsigned tail, start;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	start = tail = *ur->sq_tail;
+
+	for (i = 0; i < merged; tail++) {
+		unsigned idx = tail & ur->sq_mask;
+		int slot = ur->free_reqs[--ur->n_free_reqs];
+
+		i += tapdisk_uring_prep(ur, &ur->reqs[slot], &ur->sqes[idx],
+					queue->iocbs + i, merged - i);
+		ur->sqes[idx].user_data = slot;
+		ur->sq_array[idx] = idx;
+	}
+
+	n = tail - start;
+
+	uring_mb();
+	*ur->sq_tail = tail;
+
+	do {
+		entered = td_uring_enter(ur->ring_fd, n, 0, 0);
+	} while (entered < 0 && errno == EINTR);
+
+	if (entered < 0) {
+		err = -errno;
+		entered = 0;
+	} else if (entered < n)
+		err = -EIO;
+
+	/* requests the kernel did not take go back to the free list */
+	for (i = 0, submitted = 0; i < n; i++) {
+		int slot = ur->sqes[(start + i) & ur->sq_mask].user_data;
+
+		if (i < entered)
+			submitted += ur->reqs[slot].nr;
+		else
+			ur->free_reqs[ur->n_free_reqs++] = slot;
+	}
+
+	if (entered < n)
+		*ur->sq_tail = start + entered;
+
+	DBG("queued: %d, merged: %d, sqes: %d, submitted: %d\n",
+	    queue->queued, merged, n, entered);
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	return submitted;
+}
+
+static int
+tapdisk_uring_register_fd(struct tqueue *queue, int fd)
+{
+	struct uring *ur = queue->tio_data;
+	struct td_uring_files_update up;
+	int i;
+
+	if (!(ur->flags & URING_FLAG_FILES))
+		return -EOPNOTSUPP;
+
+	i = tapdisk_uring_find_file(ur, -1);
+	if (i < 0)
+		return -ENOSPC;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = i;
+	up.fds    = (unsigned long)&fd;
+
+	if (td_uring_register(ur->ring_fd, TD_IORING_REGISTER_FILES_UPDATE,
+			      &up, 1) != 1)
+		return -errno;
+
+	ur->files[i] = fd;
+
+	return 0;
+}
+
+static void
+tapdisk_uring_unregister_fd(struct tqueue *queue, int fd)
+{
+	struct uring *ur = queue->tio_data;
+	struct td_uring_files_update up;
+	int i, none = -1;
+
+	i = tapdisk_uring_find_file(ur, fd);
+	if (i < 0)
+		return;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = i;
+	up.fds    = (unsigned long)&none;
+
+	td_uring_register(ur->ring_fd, TD_IORING_REGISTER_FILES_UPDATE,
+			  &up, 1);
+	ur->files[i] = -1;
+}
+
+/*
+ * the kernel only takes the whole buffer table at once, so every
+ * change unregisters it and registers the new set.
+ */
+static int
+tapdisk_uring_update_buffers(struct uring *ur)
+{
+	if (ur->flags & URING_FLAG_BUFS) {
+		td_uring_register(ur->ring_fd, TD_IORING_UNREGISTER_BUFFERS,
+				  NULL, 0);
+		ur->flags &= ~URING_FLAG_BUFS;
+	}
+
+	if (!ur->n_bufs)
+		return 0;
+
+	if (td_uring_register(ur->ring_fd, TD_IORING_REGISTER_BUFFERS,
+			      ur->bufs, ur->n_bufs))
+		return -errno;
+
+	ur->flags |= URING_FLAG_BUFS;
+
+	return 0;
+}
+
+static int
+tapdisk_uring_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	struct uring *ur = queue->tio_data;
+	int err;
+
+	if (ur->n_bufs == URING_MAX_BUFS)
+		return -ENOSPC;
+
+	ur->bufs[ur->n_bufs].iov_base = buf;
+	ur->bufs[ur->n_bufs].iov_len  = size;
+	ur->n_bufs++;
+
+	err = tapdisk_uring_update_buffers(ur);
+	if (err) {
+		ur->n_bufs--;
+		tapdisk_uring_update_buffers(ur);
+	}
+
+	return err;
+}
+
+static void
+tapdisk_uring_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	struct uring *ur = queue->tio_data;
+	int i;
+
+	for (i = 0; i < ur->n_bufs; i++)
+		if (ur->bufs[i].iov_base == buf)
+			break;
+
+	if (i == ur->n_bufs)
+		return;
+
+	ur->bufs[i] = ur->bufs[--ur->n_bufs];
+	tapdisk_uring_update_buffers(ur);
+}
+
+static const struct tio td_tio_uring = {
+	.name                  = "uring",
+	.data_size             = sizeof(struct uring),
+	.tio_setup             = tapdisk_uring_setup,
+	.tio_destroy           = tapdisk_uring_destroy,
+	.tio_submit            = tapdisk_uring_submit,
+	.tio_register_fd       = tapdisk_uring_register_fd,
+	.tio_unregister_fd     = tapdisk_uring_unregister_fd,
+	.tio_register_buffer   = tapdisk_uring_register_buffer,
+	.tio_unregister_buffer = tapdisk_uring_unregister_buffer,
+};
+
+#endif /* TD_HAVE_URING */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -569,6 +1160,13 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	int err;
 
 	switch (drv) {
+#ifdef TD_HAVE_URING
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+#else
+	case TIO_DRV_URING:
+#endif
 	case TIO_DRV_LIO:
 		tio = &td_tio_lio;
 		break;
@@ -601,6 +1199,13 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 
 fail:
 	tapdisk_queue_free_io(queue);
+
+	if (drv == TIO_DRV_URING) {
+		DPRINTF("io_uring unavailable (%d), falling back to libaio\n",
+			err);
+		return tapdisk_queue_init_io(queue, TIO_DRV_LIO);
+	}
+
 	return err;
 }
 
@@ -721,6 +1326,43 @@ tapdisk_submit_all_tiocbs(struct tqueue *queue)
 	return submitted;
 }
 
+/*
+ * let the I/O driver set up fd or buffer for repeated use.  this is
+ * only an optimization: drivers without the hooks, or which fail to
+ * register, keep handling requests on unregistered resources.
+ */
+int
+tapdisk_queue_register_fd(struct tqueue *queue, int fd)
+{
+	if (!queue->tio || !queue->tio->tio_register_fd)
+		return -EOPNOTSUPP;
+
+	return queue->tio->tio_register_fd(queue, fd);
+}
+
+void
+tapdisk_queue_unregister_fd(struct tqueue *queue, int fd)
+{
+	if (queue->tio && queue->tio->tio_unregister_fd)
+		queue->tio->tio_unregister_fd(queue, fd);
+}
+
+int
+tapdisk_queue_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	if (!queue->tio || !queue->tio->tio_register_buffer)
+		return -EOPNOTSUPP;
+
+	return queue->tio->tio_register_buffer(queue, buf, size);
+}
+
+void
+tapdisk_queue_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	if (queue->tio && queue->tio->tio_unregister_buffer)
+		queue->tio->tio_unregister_buffer(queue, buf);
+}
+
 /*
  * cancel_tiocbs may queue more tiocbs
  */
@@ -27,8 +27,10 @@
  */
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/signal.h>
 
@@ -40,10 +42,49 @@
 #define DBG(_level, _f, _a...)       tlog_write(_level, _f, ##_a)
 #define ERR(_err, _f, _a...)         tlog_error(_err, _f, ##_a)
 
+/*
+ * every event loop is a tapdisk_server_t.  the main thread runs
+ * 'server', which owns the control socket and, unless worker threads
+ * were requested, all VBDs.  with workers, each VBD is attached to the
+ * least loaded worker and lives there until it is freed: its ring, its
+ * images' events and their tiocbs all go through that worker's
+ * scheduler and aio queue, so no VBD state is shared between threads.
+ *
+ * the main thread still receives all control requests, and runs each
+ * one on the owning loop with tapdisk_server_call(), waiting for it to
+ * finish.  control operations are therefore serialized process-wide,
+ * as before, and loop lists only change on their own thread.
+ */
+
  tapdisk_server_t server;
 
+static tapdisk_server_t             *workers;
+static int                           nr_workers;
+static int                           nr_started;
+static int                           workers_wanted;
+static int                           aio_driver = TIO_DRV_LIO;
+
+/* the loop the calling thread runs */
+static __thread tapdisk_server_t   *td_server = &server;
+
+/* protects the vbd lists against lookups from other threads */
+static pthread_mutex_t               vbds_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t               call_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t                call_cond = PTHREAD_COND_INITIALIZER;
+
+struct tapdisk_server_call {
+	void                       (*fn)(void *);
+	void                        *arg;
+	int                          done;
+};
+
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
-	list_for_each_entry_safe(vbd, tmp, &server.vbds, next)
+	list_for_each_entry_safe(vbd, tmp, &td_server->vbds, next)
+
+#define tapdisk_server_for_each_loop(s, i)				\
+	for ((i) = -1, (s) = &server; (i) < nr_workers;			\
+	     (s) = &workers[++(i)])
 
 td_image_t *
 tapdisk_server_get_shared_image(td_image_t *image)
@@ -54,6 +95,7 @@ tapdisk_server_get_shared_image(td_image_t *image)
 	if (!td_flag_test(image->flags, TD_OPEN_SHAREABLE))
 		return NULL;
 
+	/* images are only shared between VBDs on the same loop */
 	tapdisk_server_for_each_vbd(vbd, tmpv)
 		tapdisk_vbd_for_each_image(vbd, img, tmpi)
 			if (img->type == image->type &&
@@ -66,39 +108,93 @@ tapdisk_server_get_shared_image(td_image_t *image)
 struct list_head *
 tapdisk_server_get_all_vbds(void)
 {
-	return &server.vbds;
+	return &td_server->vbds;
+}
+
+static tapdisk_server_t *
+tapdisk_server_find_loop(td_uuid_t uuid, td_vbd_t **_vbd)
+{
+	tapdisk_server_t *s;
+	td_vbd_t *vbd;
+	int i;
+
+	pthread_mutex_lock(&vbds_lock);
+
+	tapdisk_server_for_each_loop(s, i)
+		list_for_each_entry(vbd, &s->vbds, next)
+			if (vbd->uuid == uuid) {
+				pthread_mutex_unlock(&vbds_lock);
+				if (_vbd)
+					*_vbd = vbd;
+				return s;
+			}
+
+	pthread_mutex_unlock(&vbds_lock);
+	return NULL;
 }
 
 td_vbd_t *
 tapdisk_server_get_vbd(uint16_t uuid)
 {
-	td_vbd_t *vbd, *tmp;
+	td_vbd_t *vbd;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
-		if (vbd->uuid == uuid)
-			return vbd;
+	if (!tapdisk_server_find_loop(uuid, &vbd))
+		return NULL;
 
-	return NULL;
+	return vbd;
 }
 
 void
 tapdisk_server_add_vbd(td_vbd_t *vbd)
 {
-	list_add_tail(&vbd->next, &server.vbds);
+	pthread_mutex_lock(&vbds_lock);
+	list_add_tail(&vbd->next, &td_server->vbds);
+	td_server->nr_vbds++;
+	pthread_mutex_unlock(&vbds_lock);
 }
 
 void
 tapdisk_server_remove_vbd(td_vbd_t *vbd)
 {
+	pthread_mutex_lock(&vbds_lock);
+	if (!list_empty(&vbd->next))
+		td_server->nr_vbds--;
 	list_del(&vbd->next);
 	INIT_LIST_HEAD(&vbd->next);
+	pthread_mutex_unlock(&vbds_lock);
+
 	tapdisk_server_check_state();
 }
 
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
-	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
+	tapdisk_queue_tiocb(&td_server->aio_queue, tiocb);
+}
+
+int
+tapdisk_server_register_fd(int fd)
+{
+	return tapdisk_queue_register_fd(&td_server->aio_queue, fd);
+}
+
+void
+tapdisk_server_unregister_fd(int fd)
+{
+	tapdisk_queue_unregister_fd(&td_server->aio_queue, fd);
+}
+
+int
+tapdisk_server_register_buffer(void *buf, size_t size)
+{
+	return tapdisk_queue_register_buffer(&td_server->aio_queue,
+					     buf, size);
+}
+
+void
+tapdisk_server_unregister_buffer(void *buf)
+{
+	tapdisk_queue_unregister_buffer(&td_server->aio_queue, buf);
 }
 
 void
@@ -106,7 +202,10 @@ tapdisk_server_debug(void)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_debug_queue(&server.aio_queue);
+	DBG(TLOG_WARN, "loop %d: %d vbds\n",
+	    td_server->id, td_server->nr_vbds);
+
+	tapdisk_debug_queue(&td_server->aio_queue);
 
 	tapdisk_server_for_each_vbd(vbd, tmp)
 		tapdisk_vbd_debug(vbd);
@@ -114,31 +213,159 @@ tapdisk_server_debug(void)
 	tlog_flush();
 }
 
+static void
+tapdisk_server_wake(tapdisk_server_t *s)
+{
+	char c = 0;
+
+	if (s->wake[1] != -1)
+		write(s->wake[1], &c, 1);
+}
+
+static void
+tapdisk_server_stop_loops(void)
+{
+	tapdisk_server_t *s;
+	int i;
+
+	tapdisk_server_for_each_loop(s, i) {
+		s->run = 0;
+		tapdisk_server_wake(s);
+	}
+}
+
 void
 tapdisk_server_check_state(void)
 {
-	if (list_empty(&server.vbds))
-		server.run = 0;
+	tapdisk_server_t *s;
+	int i, vbds = 0;
+
+	pthread_mutex_lock(&vbds_lock);
+	tapdisk_server_for_each_loop(s, i)
+		vbds += s->nr_vbds;
+	pthread_mutex_unlock(&vbds_lock);
+
+	if (!vbds)
+		tapdisk_server_stop_loops();
+}
+
+/*
+ * run fn(arg) on loop s and wait for it to return.  a loop which has
+ * stopped (i.e. the process is going down) fails the call; running fn
+ * here instead would put its events on the wrong scheduler.  s->calls
+ * keeps tapdisk_server_stop_workers() from freeing s meanwhile.
+ */
+static int
+tapdisk_server_call(tapdisk_server_t *s, void (*fn)(void *), void *arg)
+{
+	struct tapdisk_server_call call = { fn, arg, 0 };
+	int err = 0;
+
+	if (s == td_server) {
+		fn(arg);
+		return 0;
+	}
+
+	pthread_mutex_lock(&call_lock);
+
+	if (!s->running) {
+		err = -ESRCH;
+		goto out;
+	}
+
+	s->calls++;
+	s->call = &call;
+	tapdisk_server_wake(s);
+
+	while (!call.done && s->running)
+		pthread_cond_wait(&call_cond, &call_lock);
+
+	if (!call.done) {
+		s->call = NULL;
+		err = -ESRCH;
+	}
+
+	if (!--s->calls)
+		pthread_cond_broadcast(&call_cond);
+
+out:
+	pthread_mutex_unlock(&call_lock);
+	return err;
+}
+
+static void
+tapdisk_server_run_call(void)
+{
+	struct tapdisk_server_call *call;
+
+	pthread_mutex_lock(&call_lock);
+	call = td_server->call;
+	td_server->call = NULL;
+	pthread_mutex_unlock(&call_lock);
+
+	if (!call)
+		return;
+
+	call->fn(call->arg);
+
+	pthread_mutex_lock(&call_lock);
+	call->done = 1;
+	pthread_cond_broadcast(&call_cond);
+	pthread_mutex_unlock(&call_lock);
+}
+
+int
+tapdisk_server_call_vbd(td_uuid_t uuid, void (*fn)(void *), void *arg)
+{
+	tapdisk_server_t *s, *min;
+	int i;
+
+	s = tapdisk_server_find_loop(uuid, NULL);
+	if (!s && nr_workers) {
+		pthread_mutex_lock(&vbds_lock);
+		for (i = 0, min = workers; i < nr_workers; i++)
+			if (workers[i].nr_vbds < min->nr_vbds)
+				min = &workers[i];
+		pthread_mutex_unlock(&vbds_lock);
+		s = min;
+	}
+
+	return tapdisk_server_call(s ? : td_server, fn, arg);
+}
+
+int
+tapdisk_server_call_all(void (*fn)(void *), void *arg)
+{
+	tapdisk_server_t *s;
+	int i, err, ret = 0;
+
+	tapdisk_server_for_each_loop(s, i) {
+		err = tapdisk_server_call(s, fn, arg);
+		if (err)
+			ret = err;
+	}
+
+	return ret;
 }
 
 event_id_t
 tapdisk_server_register_event(char mode, int fd,
 			      int timeout, event_cb_t cb, void *data)
 {
-	return scheduler_register_event(&server.scheduler,
+	return scheduler_register_event(&td_server->scheduler,
 					mode, fd, timeout, cb, data);
 }
 
 void
 tapdisk_server_unregister_event(event_id_t event)
 {
-	return scheduler_unregister_event(&server.scheduler, event);
+	return scheduler_unregister_event(&td_server->scheduler, event);
 }
 
 void
 tapdisk_server_set_max_timeout(int seconds)
 {
-	scheduler_set_max_timeout(&server.scheduler, seconds);
+	scheduler_set_max_timeout(&td_server->scheduler, seconds);
 }
 
 static void
@@ -174,7 +401,7 @@ tapdisk_server_check_progress(void)
 static void
 tapdisk_server_submit_tiocbs(void)
 {
-	tapdisk_submit_all_tiocbs(&server.aio_queue);
+	tapdisk_submit_all_tiocbs(&td_server->aio_queue);
 }
 
 static void
@@ -205,22 +432,113 @@ tapdisk_server_stop_vbds(void)
 		tapdisk_vbd_kill_queue(vbd);
 }
 
+static void
+tapdisk_server_close_vbds(void)
+{
+	td_vbd_t *vbd, *tmp;
+
+	tapdisk_server_for_each_vbd(vbd, tmp)
+		tapdisk_vbd_close(vbd);
+}
+
+/*
+ * signals may arrive on any thread, so the handler only flags them on
+ * every loop.  each loop then acts on its own VBDs.
+ */
+static void
+tapdisk_server_check_signals(void)
+{
+	if (td_server->signals[TD_SERVER_SIG_CLOSE]) {
+		td_server->signals[TD_SERVER_SIG_CLOSE] = 0;
+		tapdisk_server_close_vbds();
+	}
+
+	if (td_server->signals[TD_SERVER_SIG_STOP]) {
+		td_server->signals[TD_SERVER_SIG_STOP] = 0;
+		ERR(EFBIG, "received SIGXFSZ");
+		tapdisk_server_stop_vbds();
+	}
+
+	if (td_server->signals[TD_SERVER_SIG_DEBUG]) {
+		td_server->signals[TD_SERVER_SIG_DEBUG] = 0;
+		tapdisk_server_debug();
+	}
+}
+
+static void
+tapdisk_server_wake_event(event_id_t id, char mode, void *private)
+{
+	char buf[64];
+
+	while (read(td_server->wake[0], buf, sizeof(buf)) > 0)
+		;
+
+	tapdisk_server_run_call();
+}
+
 static int
 tapdisk_server_init_aio(void)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+	return tapdisk_init_queue(&td_server->aio_queue, TAPDISK_TIOCBS,
+				  aio_driver, NULL);
 }
 
 static void
 tapdisk_server_close_aio(void)
 {
-	tapdisk_free_queue(&server.aio_queue);
+	tapdisk_free_queue(&td_server->aio_queue);
+}
+
+static int
+tapdisk_server_init_wake(void)
+{
+	tapdisk_server_t *s = td_server;
+	int i, err;
+
+	if (pipe(s->wake))
+		goto fail;
+
+	for (i = 0; i < 2; i++)
+		if (fcntl(s->wake[i], F_SETFL, O_NONBLOCK) ||
+		    fcntl(s->wake[i], F_SETFD, FD_CLOEXEC))
+			goto fail;
+
+	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					    s->wake[0], 0,
+					    tapdisk_server_wake_event, s);
+	if (err < 0)
+		return err;
+
+	s->wake_event = err;
+	return 0;
+
+fail:
+	err = -errno;
+	return err;
+}
+
+static void
+tapdisk_server_close_wake(void)
+{
+	tapdisk_server_t *s = td_server;
+	int i;
+
+	if (s->wake_event) {
+		tapdisk_server_unregister_event(s->wake_event);
+		s->wake_event = 0;
+	}
+
+	for (i = 0; i < 2; i++)
+		if (s->wake[i] != -1) {
+			close(s->wake[i]);
+			s->wake[i] = -1;
+		}
 }
 
 static void
 tapdisk_server_close(void)
 {
+	tapdisk_server_close_wake();
 	tapdisk_server_close_aio();
 }
 
@@ -233,10 +551,11 @@ tapdisk_server_iterate(void)
 	tapdisk_server_set_retry_timeout();
 	tapdisk_server_check_progress();
 
-	ret = scheduler_wait_for_events(&server.scheduler);
-	if (ret < 0)
+	ret = scheduler_wait_for_events(&td_server->scheduler);
+	if (ret < 0 && errno != EINTR)
 		DBG(TLOG_WARN, "server wait returned %d\n", ret);
 
+	tapdisk_server_check_signals();
 	tapdisk_server_check_vbds();
 	tapdisk_server_submit_tiocbs();
 	tapdisk_server_kick_responses();
@@ -245,45 +564,199 @@ tapdisk_server_iterate(void)
 static void
 __tapdisk_server_run(void)
 {
-	while (server.run)
+	while (td_server->run)
 		tapdisk_server_iterate();
+
+	/* fail calls still waiting on this loop */
+	pthread_mutex_lock(&call_lock);
+	td_server->running = 0;
+	pthread_cond_broadcast(&call_cond);
+	pthread_mutex_unlock(&call_lock);
 }
 
 static void
 tapdisk_server_signal_handler(int signal)
 {
-	td_vbd_t *vbd, *tmp;
-	static int xfsz_error_sent = 0;
+	tapdisk_server_t *s;
+	int i, sig;
 
 	switch (signal) {
 	case SIGBUS:
 	case SIGINT:
-		tapdisk_server_for_each_vbd(vbd, tmp)
-			tapdisk_vbd_close(vbd);
+		sig = TD_SERVER_SIG_CLOSE;
 		break;
-
 	case SIGXFSZ:
-		ERR(EFBIG, "received SIGXFSZ");
-		tapdisk_server_stop_vbds();
-		if (xfsz_error_sent)
-			break;
-
-		xfsz_error_sent = 1;
+		sig = TD_SERVER_SIG_STOP;
 		break;
-
 	case SIGUSR1:
-		tapdisk_server_debug();
+		sig = TD_SERVER_SIG_DEBUG;
 		break;
+	default:
+		return;
+	}
+
+	tapdisk_server_for_each_loop(s, i) {
+		s->signals[sig] = 1;
+		tapdisk_server_wake(s);
 	}
 }
 
+static void
+tapdisk_server_init_loop(tapdisk_server_t *s, int id)
+{
+	memset(s, 0, sizeof(*s));
+	INIT_LIST_HEAD(&s->vbds);
+
+	s->id      = id;
+	s->wake[0] = -1;
+	s->wake[1] = -1;
+
+	scheduler_initialize(&s->scheduler);
+}
+
+static void *
+tapdisk_server_worker(void *arg)
+{
+	tapdisk_server_t *s = arg;
+
+	td_server = s;
+
+	__tapdisk_server_run();
+
+	return NULL;
+}
+
+/*
+ * set up each worker's queue and wake pipe on the main thread, so
+ * that failures are reported early; the events move with the loop.
+ */
+static int
+tapdisk_server_start_workers(void)
+{
+	tapdisk_server_t *s;
+	sigset_t set, old;
+	int i, err;
+
+	if (!workers_wanted)
+		return 0;
+
+	workers = calloc(workers_wanted, sizeof(tapdisk_server_t));
+	if (!workers)
+		return -ENOMEM;
+
+	/* the signal handler walks the loops once nr_workers is set */
+	for (i = 0; i < workers_wanted; i++)
+		tapdisk_server_init_loop(&workers[i], i + 1);
+	nr_workers = workers_wanted;
+
+	for (i = 0; i < nr_workers; i++) {
+		s = &workers[i];
+
+		td_server = s;
+		err = tapdisk_server_init_aio();
+		if (!err)
+			err = tapdisk_server_init_wake();
+		td_server = &server;
+		if (err)
+			return err;
+
+		s->run = 1;
+	}
+
+	/* asynchronous signals are left to the main thread */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (err = 0; nr_started < nr_workers; nr_started++) {
+		s = &workers[nr_started];
+		s->running = 1;
+		err = -pthread_create(&s->thread, NULL,
+				      tapdisk_server_worker, s);
+		if (err) {
+			s->running = 0;
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err)
+		EPRINTF("failed to start worker thread: %d\n", err);
+	else
+		DPRINTF("running %d worker loops\n", nr_workers);
+
+	return err;
+}
+
+static void
+tapdisk_server_stop_workers(void)
+{
+	tapdisk_server_t *w;
+	sigset_t set, old;
+	int i;
+
+	if (!workers)
+		return;
+
+	tapdisk_server_stop_loops();
+
+	for (i = 0; i < nr_started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	/* let any caller still on a stopped loop back out */
+	pthread_mutex_lock(&call_lock);
+	for (i = 0; i < nr_workers; i++)
+		while (workers[i].calls)
+			pthread_cond_wait(&call_cond, &call_lock);
+	pthread_mutex_unlock(&call_lock);
+
+	/*
+	 * the signal handler wakes every loop.  keep it off this thread
+	 * while the wake pipes close and the array goes away; the other
+	 * threads are gone by now.
+	 */
+	sigemptyset(&set);
+	sigaddset(&set, SIGBUS);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGXFSZ);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	/* only now that no loop can wake another */
+	for (i = 0; i < nr_workers; i++) {
+		td_server = &workers[i];
+		tapdisk_server_close();
+	}
+	td_server = &server;
+
+	w          = workers;
+	workers    = NULL;
+	nr_workers = 0;
+	nr_started = 0;
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	free(w);
+}
+
+void
+tapdisk_server_set_workers(int n)
+{
+	workers_wanted = n > 0 ? n : 0;
+}
+
+void
+tapdisk_server_set_uring(int on)
+{
+	aio_driver = on ? TIO_DRV_URING : TIO_DRV_LIO;
+}
+
 int
 tapdisk_server_init(void)
 {
-	memset(&server, 0, sizeof(server));
-	INIT_LIST_HEAD(&server.vbds);
-
-	scheduler_initialize(&server.scheduler);
+	tapdisk_server_init_loop(&server, 0);
 
 	return 0;
 }
@@ -297,12 +770,22 @@ tapdisk_server_complete(void)
 	if (err)
 		goto fail;
 
-	server.run = 1;
+	err = tapdisk_server_init_wake();
+	if (err)
+		goto fail;
+
+	err = tapdisk_server_start_workers();
+	if (err)
+		goto fail;
+
+	server.run     = 1;
+	server.running = 1;
 
 	return 0;
 
 fail:
-	tapdisk_server_close_aio();
+	tapdisk_server_stop_workers();
+	tapdisk_server_close();
 	return err;
 }
 
@@ -331,7 +814,7 @@ tapdisk_server_run()
 
 	err = tapdisk_set_resource_limits();
 	if (err)
-		return err;
+		goto out;
 
 	signal(SIGBUS, tapdisk_server_signal_handler);
 	signal(SIGINT, tapdisk_server_signal_handler);
@@ -339,7 +822,10 @@ tapdisk_server_run()
 	signal(SIGXFSZ, tapdisk_server_signal_handler);
 
 	__tapdisk_server_run();
+
+out:
+	tapdisk_server_stop_workers();
 	tapdisk_server_close();
 
-	return 0;
+	return err;
 }
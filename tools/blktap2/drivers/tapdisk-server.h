@@ -28,6 +28,9 @@
 #ifndef _TAPDISK_SERVER_H_
 #define _TAPDISK_SERVER_H_
 
+#include <pthread.h>
+#include <signal.h>
+
 #include "list.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-queue.h"
@@ -41,7 +44,14 @@ td_vbd_t *tapdisk_server_get_vbd(td_uuid_t);
 void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
 
+int tapdisk_server_call_vbd(td_uuid_t, void (*)(void *), void *);
+int tapdisk_server_call_all(void (*)(void *), void *);
+
 void tapdisk_server_queue_tiocb(struct tiocb *);
+int tapdisk_server_register_fd(int);
+void tapdisk_server_unregister_fd(int);
+int tapdisk_server_register_buffer(void *, size_t);
+void tapdisk_server_unregister_buffer(void *);
 
 void tapdisk_server_check_state(void);
 
@@ -49,6 +59,8 @@ event_id_t tapdisk_server_register_event(char, int, int, event_cb_t, void *);
 void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_set_max_timeout(int);
 
+void tapdisk_server_set_workers(int);
+void tapdisk_server_set_uring(int);
 int tapdisk_server_init(void);
 int tapdisk_server_initialize(void);
 int tapdisk_server_complete(void);
@@ -57,11 +69,30 @@ void tapdisk_server_iterate(void);
 
 #define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
 
+#define TD_SERVER_SIG_CLOSE         0
+#define TD_SERVER_SIG_STOP          1
+#define TD_SERVER_SIG_DEBUG         2
+#define TD_SERVER_NR_SIGNALS        3
+
+struct tapdisk_server_call;
+
+/* one event loop: the main thread's, or a worker's */
 typedef struct tapdisk_server {
-	int                          run;
+	volatile int                 run;
 	struct list_head             vbds;
 	scheduler_t                  scheduler;
 	struct tqueue                aio_queue;
+
+	int                          id;
+	int                          nr_vbds;
+	pthread_t                    thread;
+	int                          running;
+
+	int                          wake[2];
+	event_id_t                   wake_event;
+	struct tapdisk_server_call  *call;
+	int                          calls;
+	volatile sig_atomic_t        signals[TD_SERVER_NR_SIGNALS];
 } tapdisk_server_t;
 
 #endif
@@ -824,6 +824,14 @@ tapdisk_vbd_debug(td_vbd_t *vbd)
 	    vbd->errors, vbd->retries,
 	    vbd->received, vbd->returned, vbd->kicked);
 
+	DBG(TLOG_WARN, "%s: queue depth: avg %"PRIu64", max %d, "
+	    "service time: avg %"PRIu64"us, max %"PRIu64"us\n",
+	    vbd->name,
+	    vbd->received ? vbd->depth_total / vbd->received : 0,
+	    vbd->depth_max,
+	    vbd->returned ? vbd->service_usecs / vbd->returned : 0,
+	    vbd->service_max_usecs);
+
 	tapdisk_vbd_for_each_image(vbd, image, tmp)
 		td_debug(image);
 }
@@ -1065,6 +1073,19 @@ tapdisk_vbd_make_response(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	rsp->operation = tmp.operation;
 	rsp->status = vreq->status;
 
+	if (timerisset(&vreq->ts)) {
+		struct timeval now;
+		uint64_t usecs;
+
+		gettimeofday(&now, NULL);
+		timersub(&now, &vreq->ts, &now);
+		usecs = now.tv_sec * 1000000ULL + now.tv_usec;
+
+		vbd->service_usecs += usecs;
+		if (usecs > vbd->service_max_usecs)
+			vbd->service_max_usecs = usecs;
+	}
+
 	DBG(TLOG_DBG, "writing req %d, sec 0x%08"PRIx64", res %d to ring\n",
 	    (int)tmp.id, tmp.sector_number, vreq->status);
 
@@ -1552,11 +1573,12 @@ tapdisk_vbd_issue_requests(td_vbd_t *vbd)
 static void
 tapdisk_vbd_pull_ring_requests(td_vbd_t *vbd)
 {
-	int idx;
+	int idx, depth;
 	RING_IDX rp, rc;
 	td_ring_t *ring;
 	blkif_request_t *req;
 	td_vbd_request_t *vreq;
+	struct timeval now;
 
 	ring = &vbd->ring;
 	if (!ring->sring)
@@ -1565,6 +1587,8 @@ tapdisk_vbd_pull_ring_requests(td_vbd_t *vbd)
 	rp   = ring->fe_ring.sring->req_prod;
 	xen_rmb();
 
+	gettimeofday(&now, NULL);
+
 	for (rc = ring->fe_ring.req_cons; rc != rp; rc++) {
 		req = RING_GET_REQUEST(&ring->fe_ring, rc);
 		++ring->fe_ring.req_cons;
@@ -1578,6 +1602,12 @@ tapdisk_vbd_pull_ring_requests(td_vbd_t *vbd)
 		memcpy(&vreq->req, req, sizeof(blkif_request_t));
 		vbd->received++;
 		vreq->vbd = vbd;
+		vreq->ts  = now;
+
+		depth = vbd->received - vbd->returned;
+		vbd->depth_total += depth;
+		if (depth > vbd->depth_max)
+			vbd->depth_max = depth;
 
 		tapdisk_vbd_move_request(vreq, &vbd->new_requests);
 
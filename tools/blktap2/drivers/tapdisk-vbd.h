@@ -74,6 +74,7 @@ struct td_vbd_request {
 	int                         secs_pending;
 	int                         num_retries;
 	struct timeval              last_try;
+	struct timeval              ts;          /* taken off the ring */
 
 	td_vbd_t                   *vbd;
 	struct list_head            next;
@@ -125,6 +126,13 @@ struct td_vbd_handle {
 	uint64_t                    secs_pending;
 	uint64_t                    retries;
 	uint64_t                    errors;
+
+	/* ring statistics: requests in flight, sampled on arrival, and
+	 * time from arrival to response */
+	uint64_t                    depth_total;
+	int                         depth_max;
+	uint64_t                    service_usecs;
+	uint64_t                    service_max_usecs;
 };
 
 #define tapdisk_vbd_for_each_request(vreq, tmp, list)	                \
@@ -42,7 +42,7 @@
 static void
 usage(const char *app, int err)
 {
-	fprintf(stderr, "usage: %s [-D] <-u uuid> <-c control socket>\n", app);
+	fprintf(stderr, "usage: %s [-D] [-U] [-w workers]\n", app);
 	exit(err);
 }
 
@@ -55,11 +55,14 @@ main(int argc, char *argv[])
 	control  = NULL;
 	nodaemon = 0;
 
-	while ((c = getopt(argc, argv, "s:Dh")) != -1) {
+	while ((c = getopt(argc, argv, "s:w:DUh")) != -1) {
 		switch (c) {
 		case 'D':
 			nodaemon = 1;
 			break;
+		case 'U':
+			tapdisk_server_set_uring(1);
+			break;
 		case 'h':
 			usage(argv[0], 0);
 			break;
@@ -71,6 +74,9 @@ main(int argc, char *argv[])
 			exit(EXIT_FAILURE);
 #endif
 			break;
+		case 'w':
+			tapdisk_server_set_workers(atoi(optarg));
+			break;
 		default:
 			usage(argv[0], EINVAL);
 		}
@@ -0,0 +1,148 @@
+/*
+ * This  library is  free  software; you  can  redistribute it  and/or
+ * modify it under the terms  of the GNU Lesser General Public License
+ * as published by  the Free Software Foundation; either  version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT  ANY  WARRANTY;  without   even  the  implied  warranty  of
+ * MERCHANTABILITY or  FITNESS FOR A PARTICULAR PURPOSE.   See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should  have received a copy  of the GNU  Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/*
+ * kernel 5.1 added io_uring(7). few build hosts have liburing, or even
+ * linux/io_uring.h, so define the part of the kernel ABI tapdisk uses
+ * and call the syscalls directly. everything here is optional at run
+ * time: tapdisk falls back to libaio if io_uring_setup fails.
+ */
+
+#ifndef __URING_COMPAT
+#define __URING_COMPAT
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && (defined(__i386__) || defined(__x86_64__) || \
+			   defined(__arm__) || defined(__aarch64__))
+#define TD_HAVE_URING 1
+#endif
+
+#ifdef TD_HAVE_URING
+
+/* same numbers on every architecture above */
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup		425
+#define __NR_io_uring_enter		426
+#define __NR_io_uring_register		427
+#endif
+
+struct td_uring_sqe {
+	uint8_t		opcode;
+	uint8_t		flags;
+	uint16_t	ioprio;
+	int32_t		fd;
+	uint64_t	off;
+	uint64_t	addr;
+	uint32_t	len;
+	uint32_t	rw_flags;
+	uint64_t	user_data;
+	uint16_t	buf_index;
+	uint16_t	personality;
+	int32_t		splice_fd_in;
+	uint64_t	__pad2[2];
+};
+
+struct td_uring_cqe {
+	uint64_t	user_data;
+	int32_t		res;
+	uint32_t	flags;
+};
+
+struct td_uring_sqring_offsets {
+	uint32_t	head;
+	uint32_t	tail;
+	uint32_t	ring_mask;
+	uint32_t	ring_entries;
+	uint32_t	flags;
+	uint32_t	dropped;
+	uint32_t	array;
+	uint32_t	resv1;
+	uint64_t	resv2;
+};
+
+struct td_uring_cqring_offsets {
+	uint32_t	head;
+	uint32_t	tail;
+	uint32_t	ring_mask;
+	uint32_t	ring_entries;
+	uint32_t	overflow;
+	uint32_t	cqes;
+	uint32_t	flags;
+	uint32_t	resv1;
+	uint64_t	resv2;
+};
+
+struct td_uring_params {
+	uint32_t	sq_entries;
+	uint32_t	cq_entries;
+	uint32_t	flags;
+	uint32_t	sq_thread_cpu;
+	uint32_t	sq_thread_idle;
+	uint32_t	features;
+	uint32_t	wq_fd;
+	uint32_t	resv[3];
+	struct td_uring_sqring_offsets sq_off;
+	struct td_uring_cqring_offsets cq_off;
+};
+
+struct td_uring_files_update {
+	uint32_t	offset;
+	uint32_t	resv;
+	uint64_t	fds;
+};
+
+#define TD_IORING_OP_READV		1
+#define TD_IORING_OP_WRITEV		2
+#define TD_IORING_OP_READ_FIXED		4
+#define TD_IORING_OP_WRITE_FIXED	5
+
+#define TD_IOSQE_FIXED_FILE		(1U << 0)
+
+#define TD_IORING_OFF_SQ_RING		0ULL
+#define TD_IORING_OFF_CQ_RING		0x8000000ULL
+#define TD_IORING_OFF_SQES		0x10000000ULL
+
+#define TD_IORING_REGISTER_BUFFERS	0
+#define TD_IORING_UNREGISTER_BUFFERS	1
+#define TD_IORING_REGISTER_FILES	2
+#define TD_IORING_REGISTER_EVENTFD	4
+#define TD_IORING_REGISTER_FILES_UPDATE	6
+
+static inline int td_uring_setup(unsigned entries, struct td_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int td_uring_enter(int fd, unsigned to_submit,
+				 unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int td_uring_register(int fd, unsigned opcode,
+				    const void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+#endif /* TD_HAVE_URING */
+
+#endif /* __URING_COMPAT */
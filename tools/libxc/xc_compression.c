@@ -75,6 +75,9 @@ struct compression_ctx
     struct cache_page *page_list_head;
     struct cache_page *page_list_tail;
     unsigned long dom_pfnlist_size;
+
+    /* Diff kernel used by compress_page() */
+    void (*diff_page)(const char *new, const char *old, uint64_t *diff);
 };
 
 #define RUNFLAG 0
@@ -131,16 +134,128 @@ static int add_full_page(comp_ctx *ctx, char *srcpage, char *cache_page)
     return FULL_PAGE_SIZE;
 }
 
-static int compress_page(comp_ctx *ctx, char *srcpage, char *cache_page)
+/*
+ * The delta is computed in two steps: a diff kernel builds a bitmap with
+ * one bit per 32-bit word of the page, set if the word changed, and the
+ * encoder then turns that bitmap into runs.  Only the diff kernel touches
+ * every byte of the page, so that is the part with vectorised variants,
+ * picked at runtime.  They all produce the same bitmap.
+ */
+#define DIFF_BITMAP_WORDS (MAX_DELTAS / 64)
+
+typedef void (*diff_fn_t)(const char *new, const char *old, uint64_t *diff);
+
+static void diff_page_generic(const char *new, const char *old,
+                              uint64_t *diff)
 {
-    char *dest = (ctx->compbuf + ctx->compbuf_pos);
-    uint32_t *new, *old;
+    const uint32_t *n = (const uint32_t *)new, *o = (const uint32_t *)old;
+    unsigned int i, j;
+    uint64_t bits;
+
+    for (i = 0; i < DIFF_BITMAP_WORDS; i++, n += 64, o += 64)
+    {
+        bits = 0;
+        for (j = 0; j < 64; j++)
+            bits |= (uint64_t)(n[j] != o[j]) << j;
+        diff[i] = bits;
+    }
+}
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+
+/* SSE2 is part of the x86-64 baseline. */
+static void diff_page_sse2(const char *new, const char *old, uint64_t *diff)
+{
+    const __m128i *n = (const __m128i *)new, *o = (const __m128i *)old;
+    unsigned int i, j;
+    uint64_t bits;
+    __m128i eq;
+
+    for (i = 0; i < DIFF_BITMAP_WORDS; i++, n += 16, o += 16)
+    {
+        bits = 0;
+        for (j = 0; j < 16; j++)
+        {
+            eq = _mm_cmpeq_epi32(_mm_load_si128(n + j), _mm_load_si128(o + j));
+            bits |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(eq)) << (j * 4);
+        }
+        diff[i] = ~bits;
+    }
+}
 
-    int off, runptr = 0;
-    int wascopying = 0, copying = 0, bytes_skipped = 0;
-    int complen = 0, pageoff = 0, runbytes = 0;
+#if defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_DIFF_AVX2
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static void diff_page_avx2(const char *new, const char *old, uint64_t *diff)
+{
+    const __m256i *n = (const __m256i *)new, *o = (const __m256i *)old;
+    unsigned int i, j;
+    uint64_t bits;
+    __m256i eq;
 
-    char runlen = 0;
+    for (i = 0; i < DIFF_BITMAP_WORDS; i++, n += 8, o += 8)
+    {
+        bits = 0;
+        for (j = 0; j < 8; j++)
+        {
+            eq = _mm256_cmpeq_epi32(_mm256_load_si256(n + j),
+                                    _mm256_load_si256(o + j));
+            bits |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(eq))
+                    << (j * 8);
+        }
+        diff[i] = ~bits;
+    }
+}
+#endif
+#endif
+
+static diff_fn_t select_diff_page(void)
+{
+    diff_fn_t fn = diff_page_generic;
+
+#if defined(__x86_64__)
+    fn = diff_page_sse2;
+#endif
+#ifdef HAVE_DIFF_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        fn = diff_page_avx2;
+#endif
+
+    return fn;
+}
+
+/*
+ * Find the first word at or after @off whose changed bit is not @copying,
+ * i.e. the end of the run starting at @off.
+ */
+static unsigned int diff_run_end(const uint64_t *diff, unsigned int off,
+                                 int copying)
+{
+    unsigned int i = off / 64;
+    uint64_t bits = (copying ? ~diff[i] : diff[i]) & (~0ULL << (off % 64));
+
+    while (!bits)
+    {
+        if (++i == DIFF_BITMAP_WORDS)
+            return MAX_DELTAS;
+        bits = copying ? ~diff[i] : diff[i];
+    }
+
+    return i * 64 + __builtin_ctzll(bits);
+}
+
+static int compress_page(comp_ctx *ctx, char *srcpage, char *cache_page)
+{
+    char *dest = (ctx->compbuf + ctx->compbuf_pos);
+    uint64_t diff[DIFF_BITMAP_WORDS], any = 0;
+    unsigned int off, end, runbytes, pageoff;
+    int copying, complen = 0;
+    char runlen;
 
     if ( (ctx->compbuf_pos + WORST_COMP_PAGE_SIZE) > ctx->compbuf_size)
         return -1;
@@ -150,55 +265,46 @@ static int compress_page(comp_ctx *ctx, char *srcpage, char *cache_page)
      * domU's page passed from xc_domain_save and cache_page is
      * a ptr to cache page (cache is page aligned).
      */
-    new = (uint32_t*)srcpage;
-    old = (uint32_t*)cache_page;
+    ctx->diff_page(srcpage, cache_page, diff);
 
-    for (off = 0; off <= MAX_DELTAS; off++)
-    {
-        /*
-         * At (off == MAX_DELTAS), we are processing the last run
-         * in the page. Since there is no XORing, make wascopying != copying
-         * to satisfy the if-block below.
-         */
-        copying = ((off < MAX_DELTAS) ? (old[off] != new[off]) : !wascopying);
-
-        if (runlen)
-        {
-            /* switching between run types or current run is full */
-            if ( (wascopying != copying) || (runlen == LENMASK) )
-            {
-                runbytes = runlen * sizeof(uint32_t);
-                runlen |= (wascopying ? RUNFLAG : SKIPFLAG);
-                dest[complen++] = runlen;
-
-                if (wascopying) /* RUNFLAG */
-                {
-                    pageoff = runptr * sizeof(uint32_t);
-                    memcpy(dest + complen, srcpage + pageoff, runbytes);
-                    memcpy(cache_page + pageoff, srcpage + pageoff, runbytes);
-                    complen += runbytes;
-                }
-                else /* SKIPFLAG */
-                {
-                    bytes_skipped += runbytes;
-                }
-
-                runlen = 0;
-                runptr = off;
-            }
-        }
-        runlen++;
-        wascopying = copying;
-    }
+    for (off = 0; off < DIFF_BITMAP_WORDS; off++)
+        any |= diff[off];
 
     /*
      * Check for empty page.
      */
-    if (bytes_skipped == XC_PAGE_SIZE)
+    if (!any)
     {
-        complen = 1;
         dest[0] = EMPTY_PAGE;
+        ctx->compbuf_pos++;
+        return 1;
+    }
+
+    /*
+     * Each maximal run of changed or unchanged words is emitted as one or
+     * more runs of at most LENMASK words.
+     */
+    for (off = 0; off < MAX_DELTAS; off = end)
+    {
+        copying = (diff[off / 64] >> (off % 64)) & 1;
+        end = diff_run_end(diff, off, copying);
+
+        for (; off < end; off += runlen)
+        {
+            runlen = (end - off > LENMASK) ? LENMASK : end - off;
+            runbytes = runlen * sizeof(uint32_t);
+            dest[complen++] = runlen | (copying ? RUNFLAG : SKIPFLAG);
+
+            if (copying) /* RUNFLAG */
+            {
+                pageoff = off * sizeof(uint32_t);
+                memcpy(dest + complen, srcpage + pageoff, runbytes);
+                memcpy(cache_page + pageoff, srcpage + pageoff, runbytes);
+                complen += runbytes;
+            }
+        }
     }
+
     ctx->compbuf_pos += complen;
 
     return complen;
@@ -528,6 +634,7 @@ comp_ctx *xc_compression_create_context(xc_interface *xch,
     ctx->page_list_head = &(ctx->cache[0]);
     ctx->page_list_tail = &(ctx->cache[num_cache_pages -1]);
     ctx->dom_pfnlist_size = p2m_size;
+    ctx->diff_page = select_diff_page();
 
     return ctx;
 error:
@@ -1341,7 +1341,9 @@ int xc_hvm_create_ioreq_server(xc_interface *xch,
     hypercall.arg[1] = HYPERCALL_BUFFER_AS_ARG(arg);
 
     arg->domid = domid;
-    arg->handle_bufioreq = !!handle_bufioreq;
+    /* Any other non-zero value has always meant "yes". */
+    arg->handle_bufioreq = (handle_bufioreq == HVM_IOREQSRV_BUFIOREQ_POLLED) ?
+                           HVM_IOREQSRV_BUFIOREQ_POLLED : !!handle_bufioreq;
 
     rc = do_xen_hypercall(xch, &hypercall);
 
@@ -1106,7 +1106,7 @@ static int pagebuf_get(xc_interface *xch, struct restore_ctx *ctx,
 static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
                        xen_pfn_t* region_mfn, unsigned long* pfn_type, int pae_extended_cr3,
                        struct xc_mmu* mmu,
-                       pagebuf_t* pagebuf, int curbatch)
+                       pagebuf_t* pagebuf, int curbatch, int *curdata)
 {
     int i, j, curpage, nr_mfns;
     int k, scount;
@@ -1344,7 +1344,8 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
             }
         }
         else
-            memcpy(page, pagebuf->pages + (curpage + curbatch) * PAGE_SIZE,
+            /* XTAB, XALLOC and BROKEN entries have no data in pagebuf. */
+            memcpy(page, pagebuf->pages + (*curdata + curpage) * PAGE_SIZE,
                    PAGE_SIZE);
 
         pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
@@ -1417,6 +1418,7 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
         }
     } /* end of 'batch' for loop */
 
+    *curdata += curpage + 1;
     rc = nraces;
 
   err_mapped:
@@ -1621,7 +1623,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
  loadpages:
     for ( ; ; )
     {
-        int j, curbatch;
+        int j, curbatch, curdata;
 
         xc_report_progress_step(xch, n, dinfo->p2m_size);
 
@@ -1664,12 +1666,13 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         }
 
         /* break pagebuf into batches */
-        curbatch = 0;
+        curbatch = curdata = 0;
         while ( curbatch < j ) {
             int brc;
 
             brc = apply_batch(xch, dom, ctx, region_mfn, pfn_type,
-                              pae_extended_cr3, mmu, &pagebuf, curbatch);
+                              pae_extended_cr3, mmu, &pagebuf, curbatch,
+                              &curdata);
             if ( brc < 0 )
                 goto out;
 
@@ -324,6 +324,175 @@ static int print_stats(xc_interface *xch, uint32_t domid, int pages_sent,
     return 0;
 }
 
+/*
+ * Pre-copy convergence control (XCFLAGS_DOWNTIME).
+ *
+ * At the end of each live iteration the pages dirtied while it ran are
+ * counted, without clearing the log, and the iteration itself gives the
+ * rate at which pages can be sent.  Suspending now would leave those pages
+ * to be sent with the guest stopped, so the predicted downtime is their
+ * number over the send rate.  The last iteration starts as soon as the
+ * prediction is within the limit, or once the dirty count stops shrinking
+ * and further iterations would only add traffic.
+ *
+ * With XCFLAGS_THROTTLE a guest which does not converge has its credit
+ * scheduler cap lowered instead, aiming for a dirty rate of half what can
+ * be sent, until PRECOPY_MIN_CAP is reached.  The cap is put back once the
+ * guest is suspended, or if the save fails.  max_iters and max_factor still
+ * bound the number of iterations.
+ */
+#define PRECOPY_MIN_CAP     10  /* percent of each vCPU */
+#define PRECOPY_NO_PROGRESS 90  /* percent of the previous dirty count */
+
+struct precopy_ctl {
+    unsigned int downtime_ms;   /* 0: max_iters and max_factor only */
+    int throttle;               /* may change the scheduler cap */
+    int capped;                 /* the cap differs from orig */
+    unsigned int cap;           /* current effective cap */
+    unsigned int max_cap;       /* 100 per vCPU */
+    struct xen_domctl_sched_credit orig;
+    unsigned long last_dirty;
+    struct timeval start;       /* of the current iteration */
+};
+
+static void precopy_init(xc_interface *xch, struct precopy_ctl *ctl,
+                         uint32_t dom, uint32_t flags, unsigned int nr_vcpus)
+{
+    int sched_id;
+
+    memset(ctl, 0, sizeof(*ctl));
+    ctl->downtime_ms = (flags & XCFLAGS_DOWNTIME_MASK) >> XCFLAGS_DOWNTIME_SHIFT;
+    ctl->max_cap = nr_vcpus * 100 > 0xffff ? 0xffff : nr_vcpus * 100;
+    ctl->last_dirty = ULONG_MAX;
+
+    if ( !ctl->downtime_ms || !(flags & XCFLAGS_THROTTLE) )
+        return;
+
+    if ( xc_sched_id(xch, &sched_id) || sched_id != XEN_SCHEDULER_CREDIT ||
+         xc_sched_credit_domain_get(xch, dom, &ctl->orig) )
+    {
+        DPRINTF("Throttling needs the credit scheduler, not throttling\n");
+        return;
+    }
+
+    ctl->throttle = 1;
+    ctl->cap = ctl->orig.cap && ctl->orig.cap < ctl->max_cap ?
+               ctl->orig.cap : ctl->max_cap;
+}
+
+/*
+ * Scale the cap by the ratio of the send rate to twice the dirty rate.
+ * Both counts cover the same iteration, so the rates need not be known.
+ * Returns 0 if the cap could not be lowered any further.
+ */
+static int precopy_throttle(xc_interface *xch, struct precopy_ctl *ctl,
+                            uint32_t dom, unsigned long dirty,
+                            unsigned long sent)
+{
+    struct xen_domctl_sched_credit sdom = ctl->orig;
+    unsigned int min_cap = ctl->max_cap * PRECOPY_MIN_CAP / 100;
+    uint64_t cap;
+
+    if ( !ctl->throttle || ctl->cap <= min_cap )
+        return 0;
+
+    cap = (uint64_t)ctl->cap * sent / (2 * dirty);
+    if ( cap >= ctl->cap )
+        cap = ctl->cap / 2;
+    if ( cap < min_cap )
+        cap = min_cap;
+
+    sdom.cap = cap;
+    if ( xc_sched_credit_domain_set(xch, dom, &sdom) )
+    {
+        PERROR("Failed to throttle domain, not throttling");
+        ctl->throttle = 0;
+        return 0;
+    }
+
+    DPRINTF("Throttling domain to %u%% of a CPU\n", sdom.cap);
+    ctl->cap = sdom.cap;
+    ctl->capped = 1;
+
+    return 1;
+}
+
+static void precopy_unthrottle(xc_interface *xch, struct precopy_ctl *ctl,
+                               uint32_t dom)
+{
+    if ( !ctl->capped )
+        return;
+
+    if ( xc_sched_credit_domain_set(xch, dom, &ctl->orig) )
+        PERROR("Failed to restore the scheduler cap of the domain");
+    else
+        ctl->capped = 0;
+}
+
+/*
+ * Called at the end of each live iteration but the last, which sent
+ * @sent pages.  Reports the iteration through the precopy_stats callback
+ * and returns 1 if the last iteration should follow.
+ */
+static int precopy_check(xc_interface *xch, struct precopy_ctl *ctl,
+                         uint32_t dom, int iter, unsigned long sent,
+                         struct save_callbacks *callbacks)
+{
+    xc_shadow_op_stats_t stats;
+    struct timeval now;
+    unsigned long dirty;
+    uint64_t elapsed_ms, downtime_ms;
+    int last = 0;
+
+    if ( !ctl->downtime_ms && !callbacks->precopy_stats )
+        return 0;
+
+    /* Without a bitmap, a peek only returns the counts. */
+    if ( xc_shadow_control(xch, dom, XEN_DOMCTL_SHADOW_OP_PEEK,
+                           NULL, 0, NULL, 0, &stats) < 0 )
+    {
+        PERROR("Error reading log-dirty statistics");
+        return 0;
+    }
+
+    gettimeofday(&now, NULL);
+    elapsed_ms = tv_delta(&now, &ctl->start) / 1000 ? : 1;
+    dirty = stats.dirty_count;
+
+    if ( sent )
+        downtime_ms = dirty * elapsed_ms / sent;
+    else
+        downtime_ms = dirty ? UINT32_MAX : 0;
+    if ( downtime_ms > UINT32_MAX )
+        downtime_ms = UINT32_MAX;
+
+    DPRINTF("Iteration %d: sent %lu, dirtied %lu pages in %"PRIu64"ms, "
+            "predicted downtime %"PRIu64"ms\n",
+            iter, sent, dirty, elapsed_ms, downtime_ms);
+
+    if ( callbacks->precopy_stats )
+        callbacks->precopy_stats(iter, sent, dirty, elapsed_ms, downtime_ms,
+                                 ctl->capped ? ctl->cap : 0,
+                                 callbacks->data);
+
+    if ( !ctl->downtime_ms )
+        return 0;
+
+    if ( downtime_ms <= ctl->downtime_ms )
+        last = 1;
+    else if ( (uint64_t)dirty * 100 >=
+              (uint64_t)ctl->last_dirty * PRECOPY_NO_PROGRESS &&
+              !precopy_throttle(xch, ctl, dom, dirty, sent) )
+    {
+        DPRINTF("Not converging on %ums downtime\n", ctl->downtime_ms);
+        last = 1;
+    }
+
+    ctl->last_dirty = dirty;
+
+    return last;
+}
+
 
 static int analysis_phase(xc_interface *xch, uint32_t domid, struct save_ctx *ctx,
                           xc_hypercall_buffer_t *arr, int runs)
@@ -894,6 +1063,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     int completed = 0;
 
+    /* When to stop pre-copy. */
+    struct precopy_ctl precopy;
+
     DPRINTF("%s: starting save of domid %u", __func__, dom);
 
     if ( hvm && !callbacks->switch_qemu_logdirty )
@@ -926,6 +1098,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     shared_info_frame = info.shared_info_frame;
 
+    precopy_init(xch, &precopy, dom, flags, info.max_vcpu_id + 1);
+
     /* Map the shared info frame */
     if ( !hvm )
     {
@@ -1133,6 +1307,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         sent_this_iter = 0;
         skip_this_iter = 0;
         N = 0;
+        gettimeofday(&precopy.start, NULL);
 
         while ( N < dinfo->p2m_size )
         {
@@ -1536,7 +1711,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
         if ( live )
         {
-            if ( (iter >= max_iters) ||
+            if ( precopy_check(xch, &precopy, dom, iter, sent_this_iter,
+                               callbacks) ||
+                 (iter >= max_iters) ||
                  (sent_this_iter+skip_this_iter < 50) ||
                  (total_sent > dinfo->p2m_size*max_factor) )
             {
@@ -1584,6 +1761,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     DPRINTF("All memory is saved\n");
 
+    /* The guest is suspended: it no longer needs holding back. */
+    precopy_unthrottle(xch, &precopy, dom);
+
     /* After last_iter, buffer the rest of pagebuf & tailbuf data into a
      * separate output buffer and flush it after the compressed page chunks.
      */
@@ -2152,6 +2332,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             DPRINTF("Warning - couldn't disable qemu log-dirty mode");
     }
 
+    precopy_unthrottle(xch, &precopy, dom);
+
     if (compress_ctx)
         xc_compression_free_context(xch, compress_ctx);
 
@@ -1876,6 +1876,8 @@ int xc_get_hvm_param(xc_interface *handle, domid_t dom, int param, unsigned long
  * @parm xch a handle to an open hypervisor interface.
  * @parm domid the domain id to be serviced
  * @parm handle_bufioreq should the IOREQ Server handle buffered requests?
+ *                       HVM_IOREQSRV_BUFIOREQ_POLLED selects polled mode;
+ *                       any other non-zero value means LEGACY.
  * @parm id pointer to an ioservid_t to receive the IOREQ Server id.
  * @return 0 on success, -1 on failure.
  */
@@ -28,6 +28,19 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+/* Lower the guest's credit scheduler cap while pre-copy fails to converge
+ * on the XCFLAGS_DOWNTIME limit. */
+#define XCFLAGS_THROTTLE               (1 << 5)
+
+/*
+ * Target downtime of a live save in milliseconds, in bits 16-31 of the
+ * flags.  Pre-copy ends as soon as the remaining dirty pages are predicted
+ * to be sent within it.  0 only applies the max_iters and max_factor limits.
+ */
+#define XCFLAGS_DOWNTIME_SHIFT 16
+#define XCFLAGS_DOWNTIME_MASK  (0xffffU << XCFLAGS_DOWNTIME_SHIFT)
+#define XCFLAGS_DOWNTIME(ms)   (((uint32_t)(ms) << XCFLAGS_DOWNTIME_SHIFT) & \
+                                XCFLAGS_DOWNTIME_MASK)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -72,6 +85,16 @@ struct save_callbacks {
      */
     int (*toolstack_save)(uint32_t domid, uint8_t **buf, uint32_t *len, void *data);
 
+    /* Called after each live iteration but the last (optional).
+     * @param sent pages sent during the iteration
+     * @param dirty pages dirtied while it ran
+     * @param downtime_ms predicted downtime if the guest were suspended now
+     * @param cap current credit scheduler cap, 0 if not throttled
+     */
+    void (*precopy_stats)(uint32_t iteration, unsigned long sent,
+                          unsigned long dirty, uint32_t elapsed_ms,
+                          uint32_t downtime_ms, uint32_t cap, void *data);
+
     /* to be provided as the last argument to each callback function */
     void* data;
 };
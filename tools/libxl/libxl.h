@@ -413,6 +413,16 @@ typedef struct libxl__ctx libxl_ctx;
  */
 #define LIBXL_HAVE_BUILDINFO_USBVERSION 1
 
+/*
+ * LIBXL_HAVE_BUILDINFO_HVM_VPT_COALESCE
+ *
+ * If this is defined, then the libxl_domain_build_info structure will
+ * contain hvm.vpt_coalesce, a libxl_defbool which asks for the guest's
+ * periodic timer ticks to be batched when timer_mode is
+ * no_missed_ticks_pending.
+ */
+#define LIBXL_HAVE_BUILDINFO_HVM_VPT_COALESCE 1
+
 /*
  * LIBXL_HAVE_DEVICE_BACKEND_DOMNAME
  *
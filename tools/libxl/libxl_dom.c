@@ -223,6 +223,8 @@ static void hvm_set_conf_params(xc_interface *handle, uint32_t domid,
     xc_hvm_param_set(handle, domid, HVM_PARAM_TIMER_MODE, timer_mode(info));
     xc_hvm_param_set(handle, domid, HVM_PARAM_VPT_ALIGN,
                     libxl_defbool_val(info->u.hvm.vpt_align));
+    xc_hvm_param_set(handle, domid, HVM_PARAM_VPT_COALESCE,
+                    libxl_defbool_val(info->u.hvm.vpt_coalesce));
     xc_hvm_param_set(handle, domid, HVM_PARAM_NESTEDHVM,
                     libxl_defbool_val(info->u.hvm.nested_hvm));
 }
@@ -1460,6 +1462,27 @@ static void domain_suspend_callback_common_done(libxl__egc *egc,
     libxl__xc_domain_saverestore_async_callback_done(egc, &dss->shs, ok);
 }
 
+/* Reported as progress: pages sent out of those sent and still dirty. */
+static void libxl__domain_suspend_precopy_stats(uint32_t iteration,
+                    unsigned long sent, unsigned long dirty,
+                    uint32_t elapsed_ms, uint32_t downtime_ms,
+                    uint32_t cap, void *user)
+{
+    libxl__save_helper_state *shs = user;
+    libxl__domain_suspend_state *dss = CONTAINER_OF(shs, *dss, shs);
+    STATE_AO_GC(dss->ao);
+    const char *doing_what;
+
+    doing_what = GCSPRINTF("pre-copy iteration %"PRIu32": sent %lu pages, "
+                           "%lu dirtied in %"PRIu32"ms, predicted downtime "
+                           "%"PRIu32"ms%s", iteration, sent, dirty,
+                           elapsed_ms, downtime_ms,
+                           cap ? GCSPRINTF(", capped at %"PRIu32"%%", cap)
+                               : "");
+    LOG(DEBUG, "domain %"PRIu32" %s", dss->domid, doing_what);
+    xtl_progress(CTX->lg, "precopy", doing_what, sent, sent + dirty);
+}
+
 /*----- remus callbacks -----*/
 
 static void libxl__remus_domain_suspend_callback(void *data)
@@ -1600,6 +1623,8 @@ void libxl__domain_suspend(libxl__egc *egc, libxl__domain_suspend_state *dss)
         callbacks->suspend = libxl__domain_suspend_callback;
 
     callbacks->switch_qemu_logdirty = libxl__domain_suspend_common_switch_qemu_logdirty;
+    if (live)
+        callbacks->precopy_stats = libxl__domain_suspend_precopy_stats;
     dss->shs.callbacks.save.toolstack_save = libxl__toolstack_save;
 
     libxl__xc_domain_save(egc, dss);
@@ -35,6 +35,12 @@ our @msgs = (
                                               'unsigned long', 'console_mfn'] ],
     [  9, 'srW',    "complete",              [qw(int retval
                                                  int errnoval)] ],
+    [ 10, 'scx',    "precopy_stats",         [qw(uint32_t iteration),
+                                              'unsigned long', 'sent',
+                                              'unsigned long', 'dirty',
+                                              qw(uint32_t elapsed_ms
+                                                 uint32_t downtime_ms
+                                                 uint32_t cap)] ],
 );
 
 #----------------------------------------
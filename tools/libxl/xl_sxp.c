@@ -103,6 +103,8 @@ void printf_info_sexp(int domid, libxl_domain_config *d_config)
                libxl_defbool_to_string(b_info->u.hvm.hpet));
         printf("\t\t\t(vpt_align %s)\n",
                libxl_defbool_to_string(b_info->u.hvm.vpt_align));
+        printf("\t\t\t(vpt_coalesce %s)\n",
+               libxl_defbool_to_string(b_info->u.hvm.vpt_coalesce));
         printf("\t\t\t(timer_mode %s)\n",
                libxl_timer_mode_to_string(b_info->u.hvm.timer_mode));
         printf("\t\t\t(nestedhvm %s)\n",
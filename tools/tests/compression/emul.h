@@ -0,0 +1,37 @@
+/*
+ * Just enough of libxc for xc_compression.c to build on its own.
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef void xc_interface;
+typedef unsigned long xen_pfn_t;
+typedef struct compression_ctx comp_ctx;
+
+#define PRIpfn            "lx"
+#define XC_PAGE_SIZE      4096
+#define INVALID_P2M_ENTRY (~0UL)
+#define NRPAGES(x)        ((x) / XC_PAGE_SIZE)
+
+#define ERROR(fmt, args...) fprintf(stderr, fmt "\n", ## args)
+
+static inline void *xc_memalign(xc_interface *xch, size_t alignment,
+                                size_t size)
+{
+    void *ptr;
+
+    return posix_memalign(&ptr, alignment, size) ? NULL : ptr;
+}
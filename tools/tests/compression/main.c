@@ -0,0 +1,242 @@
+/*
+ * Remus checkpoint compression throughput: a set of cached guest pages is
+ * dirtied in one of several synthetic patterns each epoch, and the dirty
+ * pages are delta compressed against the cache, once with each diff
+ * kernel the host supports.  The compressed stream of every kernel is
+ * checked against the generic one, and is decompressed into a receiver
+ * copy of the pages which must match the sender's.
+ *
+ * Only xc_compression_compress_pages() is timed.
+ *
+ * Usage:
+ *
+ *   make -C tools/tests/compression run
+ *
+ * or ./test_compression [epochs]
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+#include "compression.c"
+
+#define NR_PAGES 2048
+#define WORDS    (XC_PAGE_SIZE / sizeof(uint32_t))
+
+static const struct kernel {
+    const char *name;
+    diff_fn_t fn;
+} kernels[] = {
+    { "generic", diff_page_generic },
+#if defined(__x86_64__)
+    { "sse2",    diff_page_sse2 },
+#endif
+#ifdef HAVE_DIFF_AVX2
+    { "avx2",    diff_page_avx2 },
+#endif
+};
+
+/* A page dirtied by the guest, as a function of the epoch's random state. */
+static void dirty_clean(uint32_t *p)
+{
+}
+
+static void dirty_counters(uint32_t *p)
+{
+    unsigned int i;
+
+    for (i = 0; i < 4; i++)
+        p[rand() % WORDS]++;
+}
+
+static void dirty_block(uint32_t *p)
+{
+    unsigned int i, start = rand() % (WORDS - 64);
+
+    for (i = start; i < start + 64; i++)
+        p[i] = rand();
+}
+
+static void dirty_scattered(uint32_t *p)
+{
+    unsigned int i;
+
+    for (i = 0; i < WORDS; i++)
+        if (!(rand() & 3))
+            p[i] = rand();
+}
+
+static void dirty_full(uint32_t *p)
+{
+    unsigned int i;
+
+    for (i = 0; i < WORDS; i++)
+        p[i] = rand();
+}
+
+static const struct workload {
+    const char *name;
+    void (*dirty)(uint32_t *p);
+} workloads[] = {
+    { "clean",     dirty_clean },
+    { "counters",  dirty_counters },
+    { "block",     dirty_block },
+    { "scattered", dirty_scattered },
+    { "full",      dirty_full },
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int supported(const struct kernel *k)
+{
+#ifdef HAVE_DIFF_AVX2
+    if (k->fn == diff_page_avx2)
+    {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return 1;
+}
+
+/*
+ * Run @epochs epochs of @w with kernel @k.  Returns the seconds spent
+ * compressing and the total compressed size, or a negative time if the
+ * stream is wrong.  @ref holds the stream of the first kernel run, and
+ * is checked against (or filled in from) this one.
+ */
+static double run(const struct kernel *k, const struct workload *w,
+                  unsigned int epochs, char *ref, unsigned long *ref_len,
+                  unsigned long *total)
+{
+    unsigned long compbuf_size = NR_PAGES * WORST_COMP_PAGE_SIZE;
+    unsigned long len, pos, reflen = 0;
+    char *sender, *receiver, *compbuf;
+    unsigned int e, i;
+    double t, elapsed = 0;
+    comp_ctx *ctx;
+
+    ctx = xc_compression_create_context(NULL, NR_PAGES);
+    sender = xc_memalign(NULL, XC_PAGE_SIZE, NR_PAGES * XC_PAGE_SIZE);
+    receiver = xc_memalign(NULL, XC_PAGE_SIZE, NR_PAGES * XC_PAGE_SIZE);
+    compbuf = malloc(compbuf_size);
+    if (!ctx || !sender || !receiver || !compbuf)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    ctx->diff_page = k->fn;
+
+    srand(1);
+    for (i = 0; i < NR_PAGES * WORDS; i++)
+        ((uint32_t *)sender)[i] = rand();
+    *total = 0;
+
+    /* Epoch 0 sends every page in full and fills the cache. */
+    for (e = 0; e <= epochs; e++)
+    {
+        for (i = 0; e && i < NR_PAGES; i++)
+            w->dirty((uint32_t *)(sender + i * XC_PAGE_SIZE));
+        for (i = 0; i < NR_PAGES; i++)
+            xc_compression_add_page(NULL, ctx, sender + i * XC_PAGE_SIZE,
+                                    i, 0);
+
+        t = now();
+        if (xc_compression_compress_pages(NULL, ctx, compbuf, compbuf_size,
+                                          &len) != 1)
+            return -1;
+        if (e)
+            elapsed += now() - t;
+        ctx->pfns_index = ctx->pfns_len = 0;
+
+        for (i = 0, pos = 0; i < NR_PAGES; i++)
+            if (xc_compression_uncompress_page(NULL, compbuf, len, &pos,
+                                               receiver + i * XC_PAGE_SIZE))
+                return -1;
+        if (pos != len || memcmp(sender, receiver, NR_PAGES * XC_PAGE_SIZE))
+            return -1;
+
+        if (!e)
+            continue;
+        *total += len;
+
+        /* Compare the stream of the last epoch with the first kernel's. */
+        if (e == epochs)
+        {
+            reflen = len;
+            if (!*ref_len)
+            {
+                memcpy(ref, compbuf, len);
+                *ref_len = len;
+            }
+            else if (*ref_len != len || memcmp(ref, compbuf, len))
+                return -1;
+        }
+    }
+
+    xc_compression_free_context(NULL, ctx);
+    free(sender);
+    free(receiver);
+    free(compbuf);
+
+    return reflen ? elapsed : -1;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int epochs = argc > 1 ? atoi(argv[1]) : 20;
+    unsigned int i, j;
+    unsigned long ref_len, total;
+    double t, pages;
+    char *ref;
+    int rc = 0;
+
+    ref = malloc(NR_PAGES * WORST_COMP_PAGE_SIZE);
+    if (!ref || !epochs)
+        return 1;
+    pages = (double)NR_PAGES * epochs;
+
+    printf("%u dirty pages per epoch, %u epochs\n\n", NR_PAGES, epochs);
+    printf("%-10s %-8s %10s %10s %10s\n",
+           "workload", "kernel", "ns/page", "MB/s", "bytes/page");
+
+    for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        ref_len = 0;
+        for (j = 0; j < sizeof(kernels) / sizeof(kernels[0]); j++)
+        {
+            if (!supported(&kernels[j]))
+                continue;
+
+            t = run(&kernels[j], &workloads[i], epochs, ref, &ref_len, &total);
+            if (t < 0)
+            {
+                printf("%-10s %-8s FAILED\n",
+                       workloads[i].name, kernels[j].name);
+                rc = 1;
+                continue;
+            }
+
+            printf("%-10s %-8s %10.1f %10.0f %10.1f\n",
+                   workloads[i].name, kernels[j].name, t * 1e9 / pages,
+                   pages * XC_PAGE_SIZE / t / (1 << 20), total / pages);
+        }
+    }
+
+    free(ref);
+
+    return rc;
+}
@@ -0,0 +1,127 @@
+/*
+ * Xen emulation for the event channel port ops: domains and VCPUs with
+ * shared info and FIFO control blocks in ordinary memory, and counters in
+ * place of upcalls and lock contention.
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int bool_t;
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef int spinlock_t;
+
+#define PAGE_SIZE     4096
+#define BITS_PER_LONG (sizeof(long) * 8)
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define ASSERT(x)   assert(x)
+#define BUILD_BUG_ON(cond) ((void)sizeof(char[1 - 2 * !!(cond)]))
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define printk printf
+#define XENLOG_WARNING
+#define gdprintk(lvl, fmt, args...) printf(fmt, ## args)
+
+/* Bit operations on 32-bit words, locked as on x86. */
+#define BITOP_WORD(nr, addr) (((uint32_t *)(addr)) + ((nr) / 32))
+#define BITOP_MASK(nr)       (1u << ((nr) % 32))
+
+#define test_bit(nr, addr) \
+    (!!(*(volatile uint32_t *)BITOP_WORD(nr, addr) & BITOP_MASK(nr)))
+#define test_and_set_bit(nr, addr) \
+    (!!(__atomic_fetch_or(BITOP_WORD(nr, addr), BITOP_MASK(nr), \
+                          __ATOMIC_SEQ_CST) & BITOP_MASK(nr)))
+#define test_and_clear_bit(nr, addr) \
+    (!!(__atomic_fetch_and(BITOP_WORD(nr, addr), ~BITOP_MASK(nr), \
+                           __ATOMIC_SEQ_CST) & BITOP_MASK(nr)))
+#define set_bit(nr, addr) \
+    ((void)__atomic_fetch_or(BITOP_WORD(nr, addr), BITOP_MASK(nr), \
+                             __ATOMIC_SEQ_CST))
+#define clear_bit(nr, addr) \
+    ((void)__atomic_fetch_and(BITOP_WORD(nr, addr), ~BITOP_MASK(nr), \
+                              __ATOMIC_SEQ_CST))
+#define __set_bit(nr, addr) (*BITOP_WORD(nr, addr) |= BITOP_MASK(nr))
+
+#define cmpxchg(p, o, n)   __sync_val_compare_and_swap(p, o, n)
+#define read_atomic(p)     (*(volatile typeof(*(p)) *)(p))
+#define write_atomic(p, v) (*(volatile typeof(*(p)) *)(p) = (v))
+
+/* Queue locks are real (uncontended) locks, and are counted. */
+extern unsigned long lock_count;
+#define spin_lock_init(l) (*(l) = 0)
+#define spin_lock_irqsave(l, f)                                   \
+    do {                                                          \
+        (f) = 0;                                                  \
+        lock_count++;                                             \
+        while ( __atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE) )     \
+            continue;                                             \
+    } while ( 0 )
+#define spin_unlock_irqrestore(l, f) \
+    ((void)(f), __atomic_store_n(l, 0, __ATOMIC_RELEASE))
+
+struct vcpu_info {
+    uint8_t evtchn_upcall_pending;
+    unsigned long evtchn_pending_sel;
+};
+
+struct shared_info {
+    unsigned long evtchn_pending[BITS_PER_LONG];
+    unsigned long evtchn_mask[BITS_PER_LONG];
+};
+
+struct domain;
+
+struct vcpu {
+    int vcpu_id;
+    struct domain *domain;
+    struct vcpu_info *vcpu_info;
+    struct evtchn_fifo_vcpu *evtchn_fifo;
+};
+
+struct domain {
+    int domain_id;
+    struct vcpu **vcpu;
+    struct shared_info *shared_info;
+    const struct evtchn_port_ops *evtchn_port_ops;
+    unsigned int max_evtchns;
+    struct evtchn_fifo_domain *evtchn_fifo;
+};
+
+struct evtchn {
+    unsigned int port;
+    u16 notify_vcpu_id;
+    u8 pending;
+    u8 priority;
+    u8 last_priority;
+    u16 last_vcpu_id;
+};
+
+#define BITS_PER_EVTCHN_WORD(d) BITS_PER_LONG
+#define shared_info(d, field)   ((d)->shared_info->field)
+#define vcpu_info(v, field)     ((v)->vcpu_info->field)
+
+void vcpu_mark_events_pending(struct vcpu *v);
+
+#include "event.h"
+
+void evtchn_check_pollers(struct domain *d, unsigned int port);
+void evtchn_2l_init(struct domain *d);
@@ -0,0 +1,151 @@
+/*
+ * Xen emulation for the timer subsystem: a single CPU whose system time is
+ * advanced by the test harness.
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int64_t s_time_t;
+typedef int bool_t;
+typedef int spinlock_t;
+typedef uint16_t u16;
+
+#define STIME_MAX ((s_time_t)((uint64_t)~0ull>>1))
+
+#define __init
+#define __read_mostly
+#define __cacheline_aligned
+#define integer_param(n, v)
+#define boolean_param(n, v)
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define ASSERT(x)   assert(x)
+#define BUG()       abort()
+#define BUG_ON(x)   do { if ( x ) abort(); } while ( 0 )
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define min(x, y) ({ typeof(x) _x = (x), _y = (y); _x < _y ? _x : _y; })
+#define max(x, y) ({ typeof(x) _x = (x), _y = (y); _x > _y ? _x : _y; })
+#define min_t(type, x, y) min((type)(x), (type)(y))
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define printk printf
+
+#define xmalloc_array(type, n) ((type *)malloc(sizeof(type) * (n)))
+#define xzalloc(type)          ((type *)calloc(1, sizeof(type)))
+#define xfree(p)               free(p)
+
+#define find_first_set_bit(x) __builtin_ctzll(x)
+#define fls(x)                ((x) ? 32 - __builtin_clz(x) : 0)
+
+/* Per-CPU data and locking, for a single CPU with interrupts never raised. */
+#define DEFINE_PER_CPU(type, name)  __typeof__(type) per_cpu__##name
+#define DECLARE_PER_CPU(type, name) extern __typeof__(type) per_cpu__##name
+#define per_cpu(name, cpu)          (*((void)(cpu), &per_cpu__##name))
+#define this_cpu(name)              per_cpu__##name
+#define smp_processor_id()          0
+#define cpu_online(cpu)             ((cpu) == 0)
+#define cpumask_any(mask)           0
+#define for_each_online_cpu(cpu)    for ( (cpu) = 0; (cpu) < 1; (cpu)++ )
+#define cpu_relax()                 ((void)0)
+
+#define DEFINE_RCU_READ_LOCK(l)     int l
+#define rcu_read_lock(l)            ((void)(l))
+#define rcu_read_unlock(l)          ((void)(l))
+
+#define spin_lock_init(l)            (*(l) = 0)
+#define spin_lock(l)                 ((void)(l))
+#define spin_unlock(l)               ((void)(l))
+#define spin_lock_irq(l)             ((void)(l))
+#define spin_unlock_irq(l)           ((void)(l))
+#define spin_lock_irqsave(l, f)      ((void)(l), (f) = 0)
+#define spin_unlock_irqrestore(l, f) ((void)(l), (void)(f))
+#define local_irq_save(f)            ((f) = 0)
+#define local_irq_restore(f)         ((void)(f))
+
+#define read_atomic(p)     (*(p))
+#define write_atomic(p, v) (*(p) = (v))
+
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new, struct list_head *prev,
+                              struct list_head *next)
+{
+    next->prev = new;
+    new->next = next;
+    new->prev = prev;
+    prev->next = new;
+}
+
+#define list_add(new, head)      __list_add(new, head, (head)->next)
+#define list_add_tail(new, head) __list_add(new, (head)->prev, head)
+#define list_empty(head)         ((head)->next == (head))
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_for_each_entry(pos, head, member)                          \
+    for ( pos = list_entry((head)->next, typeof(*pos), member);         \
+          &pos->member != (head);                                       \
+          pos = list_entry(pos->member.next, typeof(*pos), member) )
+
+static inline void list_del(struct list_head *entry)
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+}
+
+/* Softirqs, CPU notifiers and key handlers. */
+#define TIMER_SOFTIRQ 0
+extern void (*timer_softirq)(void);
+extern bool_t softirq_pending;
+#define open_softirq(nr, fn)        (timer_softirq = (fn))
+#define raise_softirq(nr)           (softirq_pending = 1)
+#define cpu_raise_softirq(cpu, nr)  ((void)(cpu), softirq_pending = 1)
+
+#define NOTIFY_DONE     0
+#define CPU_UP_PREPARE  1
+#define CPU_UP_CANCELED 2
+#define CPU_DEAD        3
+struct notifier_block {
+    int (*notifier_call)(struct notifier_block *, unsigned long, void *);
+    int priority;
+};
+#define register_cpu_notifier(nb) ((void)(nb))
+
+struct keyhandler {
+    bool_t diagnostic;
+    union {
+        void (*fn)(unsigned char key);
+    } u;
+    const char *desc;
+};
+#define register_keyhandler(key, h) ((void)(h))
+
+/* System time is driven by the test harness. */
+extern s_time_t now_ns;
+#define NOW() now_ns
+
+#include "timer.h"
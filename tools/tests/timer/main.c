@@ -0,0 +1,198 @@
+/*
+ * Synthetic load for the timer subsystem: a number of periodic timers on one
+ * CPU, re-armed from their own handlers (as vpt.c does for guest ticks) plus
+ * random re-programming, first with no slack (timer heap) and then with
+ * vpt's default slack (timer wheel).  A last run has fewer timers, all with
+ * the slack vpt gives guests asking for coalesced ticks and no
+ * re-programming, to show how many softirqs it takes to serve timers which
+ * can share ticks.
+ *
+ * Usage:
+ *
+ *   make -C tools/tests/timer run
+ *
+ * or ./test_timer [timers] [simulated-ms]
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+#include "emul.h"
+
+#define MS_TO_NS 1000000LL
+
+/* Re-programmed timers per softirq, besides the expired ones. */
+#define CHURN    4
+
+/* Timers in the last run. */
+#define WIDE_NR  256
+
+/* Hardware is programmed up to timer_slop late, and interrupts are late. */
+#define SLOP     (50000 + 100)
+
+s_time_t now_ns;
+void (*timer_softirq)(void);
+bool_t softirq_pending;
+
+static s_time_t programmed;
+static unsigned long expiries, rearms, early, late;
+static s_time_t max_late;
+
+struct bench_timer {
+    struct timer timer;
+    s_time_t period;
+    s_time_t due;
+};
+
+int reprogram_timer(s_time_t timeout)
+{
+    programmed = timeout;
+    return 1;
+}
+
+static uint32_t rnd(void)
+{
+    static uint32_t x = 2463534242u;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+static void tick(void *data)
+{
+    struct bench_timer *bt = data;
+
+    if ( now_ns < bt->due )
+        early++;
+    else if ( now_ns - bt->due > bt->timer.slack + SLOP )
+        late++;
+    if ( now_ns - bt->due > max_late )
+        max_late = now_ns - bt->due;
+
+    expiries++;
+    bt->due += bt->period;
+    set_timer(&bt->timer, bt->due);
+}
+
+static double wall(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void simulate(struct bench_timer *bt, unsigned int nr, s_time_t end,
+                     unsigned int churn, unsigned long *softirqs)
+{
+    struct bench_timer *t;
+    unsigned int i;
+
+    while ( now_ns < end )
+    {
+        if ( !softirq_pending )
+        {
+            if ( programmed == 0 )
+                break;
+            /* The timer interrupt arrives shortly after the deadline. */
+            now_ns = MAX(now_ns, programmed + 100);
+        }
+
+        softirq_pending = 0;
+        timer_softirq();
+        ++*softirqs;
+
+        for ( i = 0; i < churn; i++ )
+        {
+            t = &bt[rnd() % nr];
+            t->due = now_ns + t->period;
+            set_timer(&t->timer, t->due);
+            rearms++;
+        }
+    }
+}
+
+/*
+ * Timers get periods[] in turn, and a slack of their period >> @shift capped
+ * at @cap (no slack if @shift is 0).
+ */
+static int run(const char *name, unsigned int nr, s_time_t duration,
+               const s_time_t *periods, unsigned int nr_periods,
+               unsigned int shift, s_time_t cap, unsigned int churn)
+{
+    struct bench_timer *bt = calloc(nr, sizeof(*bt));
+    unsigned long softirqs = 0;
+    unsigned int i;
+    double start;
+
+    if ( bt == NULL )
+        return 1;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        bt[i].period = periods[i % nr_periods] * MS_TO_NS;
+        bt[i].due = now_ns + rnd() % bt[i].period;
+        init_timer(&bt[i].timer, tick, &bt[i], 0);
+        if ( shift )
+            set_timer_slack(&bt[i].timer, min(bt[i].period >> shift, cap));
+        set_timer(&bt[i].timer, bt[i].due);
+    }
+
+    /* Warm up: lets the heap grow to size, or the wheel get allocated. */
+    simulate(bt, nr, now_ns + 20 * MS_TO_NS, churn, &softirqs);
+
+    softirqs = expiries = rearms = early = late = 0;
+    max_late = 0;
+    start = wall();
+    simulate(bt, nr, now_ns + duration, churn, &softirqs);
+    start = wall() - start;
+
+    printf("%-6s %8u %10lu %10lu %10lu %10.1f %10.1f\n", name, nr,
+           expiries, rearms, softirqs,
+           start * 1e9 / (expiries + rearms), max_late / 1000.0);
+
+    for ( i = 0; i < nr; i++ )
+        kill_timer(&bt[i].timer);
+    free(bt);
+
+    if ( early || late )
+    {
+        printf("%s: %lu timers fired early, %lu beyond their slack\n",
+               name, early, late);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const s_time_t mixed[] = { 1, 4, 10 }, wide[] = { 10 };
+    unsigned int nr = argc > 1 ? strtoul(argv[1], NULL, 0) : 10000;
+    s_time_t duration = (argc > 2 ? strtoul(argv[2], NULL, 0) : 1000) *
+                        MS_TO_NS;
+
+    now_ns = MS_TO_NS;
+    timer_init();
+
+    printf("%-6s %8s %10s %10s %10s %10s %10s\n", "queue", "timers",
+           "expiries", "rearms", "softirqs", "ns/op", "late(us)");
+
+    if ( run("heap", nr, duration, mixed, ARRAY_SIZE(mixed), 0, 0, CHURN) ||
+         run("wheel", nr, duration, mixed, ARRAY_SIZE(mixed),
+             4, MS_TO_NS / 10, CHURN) ||
+         run("wide", nr < WIDE_NR ? nr : WIDE_NR, duration,
+             wide, ARRAY_SIZE(wide), 2, 4 * MS_TO_NS, 0) )
+        return 1;
+
+    return 0;
+}
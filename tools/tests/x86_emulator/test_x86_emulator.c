@@ -529,6 +529,114 @@ int main(int argc, char **argv)
         goto fail;
     printf("okay\n");
 
+    printf("%-40s", "Testing pre-decoded movs...");
+    {
+        static const struct {
+            uint8_t len, rip; /* @rip: offset of RIP-relative disp32 */
+            uint8_t insn[11];
+        } movs[] = {
+            /* mov %ecx,(%eax) */
+            { 2, 0, { 0x89, 0x08 } },
+            /* mov (%eax),%ecx */
+            { 2, 0, { 0x8b, 0x08 } },
+            /* mov %ch,(%eax) */
+            { 2, 0, { 0x88, 0x28 } },
+            /* mov (%eax),%dh */
+            { 2, 0, { 0x8a, 0x30 } },
+            /* mov %cx,(%eax) */
+            { 3, 0, { 0x66, 0x89, 0x08 } },
+            /* mov 4(%eax),%ecx */
+            { 3, 0, { 0x8b, 0x48, 0x04 } },
+            /* mov %ecx,8(%eax,%ebx,4) */
+            { 4, 0, { 0x89, 0x4c, 0x98, 0x08 } },
+            /* mov 16(%eax,%ebx),%ecx */
+            { 7, 0, { 0x8b, 0x8c, 0x18, 0x10, 0, 0, 0 } },
+            /* movb $0xa5,(%eax) */
+            { 3, 0, { 0xc6, 0x00, 0xa5 } },
+            /* movl $0x12345678,12(%eax) */
+            { 7, 0, { 0xc7, 0x40, 0x0c, 0x78, 0x56, 0x34, 0x12 } },
+            /* movw $0x9234,(%eax) */
+            { 5, 0, { 0x66, 0xc7, 0x00, 0x34, 0x92 } },
+            /* mov %ecx,%ds:(%eax) */
+            { 3, 0, { 0x3e, 0x89, 0x08 } },
+#ifdef __x86_64__
+            /* mov %rcx,(%rax) */
+            { 3, 0, { 0x48, 0x89, 0x08 } },
+            /* mov (%rax),%r8 */
+            { 3, 0, { 0x4c, 0x8b, 0x00 } },
+            /* mov %sil,(%rax) */
+            { 3, 0, { 0x40, 0x88, 0x30 } },
+            /* mov 8(%rax,%rbx,4),%r8d */
+            { 5, 0, { 0x44, 0x8b, 0x44, 0x98, 0x08 } },
+            /* movq $0xffffffff80000000,(%rax) */
+            { 7, 0, { 0x48, 0xc7, 0x00, 0x00, 0x00, 0x00, 0x80 } },
+            /* mov 0(%rip),%ecx */
+            { 6, 2, { 0x8b, 0x0d, 0, 0, 0, 0 } },
+            /* movl $0x44332211,0(%rip) */
+            { 10, 2, { 0xc7, 0x05, 0, 0, 0, 0, 0x11, 0x22, 0x33, 0x44 } },
+#endif
+        };
+        struct x86_emulate_mov mov;
+        struct cpu_user_regs regs2;
+        unsigned long *mem = (unsigned long *)res + 0x40;
+        unsigned long mem2[8];
+
+        for ( j = 0; j < sizeof(movs) / sizeof(*movs); j++ )
+        {
+            memcpy(instr, movs[j].insn, movs[j].len);
+            memset(&regs, 0, sizeof(regs));
+            regs.eflags = 0x200;
+            regs.eip    = (unsigned long)&instr[0];
+            regs.eax    = (unsigned long)mem;
+            regs.ebx    = 1;
+            regs.ecx    = ~0UL / 0xff * 0x21;
+            regs.edx    = 0x12345678;
+#ifdef __x86_64__
+            regs.esi    = 0x5a;
+            regs.r8     = ~0UL;
+#endif
+            if ( movs[j].rip )
+                /* Point the RIP-relative operand at @mem. */
+                *(int32_t *)&instr[movs[j].rip] = (char *)mem -
+                                                  &instr[movs[j].len];
+            for ( i = 0; i < 8; i++ )
+                mem[i] = 0x0123456789abcdefULL * (i + 1);
+            regs2 = regs;
+
+            rc = x86_emulate(&ctxt, &emulops);
+            if ( rc != X86EMUL_OKAY )
+                goto fail;
+
+            ctxt.regs = &regs2;
+            memcpy(mem2, mem, sizeof(mem2));
+            for ( i = 0; i < 8; i++ )
+                mem[i] = 0x0123456789abcdefULL * (i + 1);
+            rc = x86_decode_mov(&mov, (uint8_t *)instr, 15, &ctxt);
+            if ( rc == X86EMUL_OKAY )
+                rc = x86_emulate_mov(&mov, &ctxt, &emulops);
+            ctxt.regs = &regs;
+            if ( (rc != X86EMUL_OKAY) || (mov.len != movs[j].len) ||
+                 memcmp(&regs, &regs2, sizeof(regs)) ||
+                 memcmp(mem, mem2, sizeof(mem2)) )
+                goto fail;
+        }
+
+        /* Things left to the full emulator. */
+        instr[0] = 0x67; instr[1] = 0x89; instr[2] = 0x08;
+        if ( x86_decode_mov(&mov, (uint8_t *)instr, 15, &ctxt) !=
+             X86EMUL_UNHANDLEABLE )
+            goto fail;
+        instr[0] = 0x89; instr[1] = 0xc8;
+        if ( x86_decode_mov(&mov, (uint8_t *)instr, 15, &ctxt) !=
+             X86EMUL_UNHANDLEABLE )
+            goto fail;
+        instr[0] = 0x8b; instr[1] = 0x48; instr[2] = 0x04;
+        if ( x86_decode_mov(&mov, (uint8_t *)instr, 2, &ctxt) !=
+             X86EMUL_UNHANDLEABLE )
+            goto fail;
+    }
+    printf("okay\n");
+
     printf("%-40s", "Testing daa/das (all inputs)...");
 #ifndef __x86_64__
     /* Bits 0-7: AL; Bit 8: EFLG_AF; Bit 9: EFLG_CF; Bit 10: DAA vs. DAS. */
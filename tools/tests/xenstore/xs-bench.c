@@ -0,0 +1,397 @@
+/*
+ * xenstored load generator: populates the store with a tree of simulated
+ * domains, then has a number of client threads issue a random mix of
+ * reads, writes and watch/unwatch pairs against it for a fixed time.
+ * A separate client watches all domains, as a backend would, and counts
+ * the events it gets; with -p it has one watch per domain instead of
+ * one on /local/domain.  Throughput and latency percentiles are reported
+ * per operation.
+ *
+ * Talks to xenstored through libxenstore, so XENSTORED_PATH can point
+ * it at a daemon started by hand, e.g.
+ *
+ *   xenstored -N -D --internal-db
+ *   XENSTORED_PATH=/var/run/xenstored/socket ./xs-bench -d 1000
+ *
+ * Usage: xs-bench [-d domains] [-t threads] [-s seconds]
+ *                 [-r read%] [-w write%] [-p]
+ *
+ * Operations that are neither reads nor writes are watch/unwatch pairs.
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License Version 2 (GPLv2)
+ * as published by the Free Software Foundation.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details. <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <xenstore.h>
+
+enum { OP_READ, OP_WRITE, OP_WATCH, NR_OPS };
+
+static const char *op_name[NR_OPS] = { "read", "write", "watch" };
+
+/* Keys every simulated domain gets, loosely modelled on a PV guest. */
+static const char *dom_keys[] = {
+    "name", "memory/target", "control/shutdown",
+    "device/vif/0/state", "device/vbd/51712/state", "console/ring-ref",
+};
+#define NR_DOM_KEYS (sizeof(dom_keys) / sizeof(dom_keys[0]))
+
+struct samples {
+    uint64_t *ns;
+    unsigned long nr, size;
+};
+
+struct worker {
+    pthread_t thread;
+    struct xs_handle *xsh;
+    unsigned int seed;
+    unsigned long errors;
+    struct samples op[NR_OPS];
+};
+
+static unsigned int nr_domains = 1000;
+static unsigned int nr_threads = 8;
+static unsigned int seconds = 5;
+static unsigned int read_pct = 70, write_pct = 25;
+static bool per_domain_watches;
+
+static volatile bool stop;
+static unsigned long nr_events;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void add_sample(struct samples *s, uint64_t ns)
+{
+    if ( s->nr == s->size )
+    {
+        s->size = s->size ? s->size * 2 : 4096;
+        s->ns = realloc(s->ns, s->size * sizeof(*s->ns));
+        if ( !s->ns )
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->ns[s->nr++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void dom_path(char *buf, size_t len, unsigned int dom, const char *key)
+{
+    snprintf(buf, len, "/local/domain/%u/%s", dom + 1, key);
+}
+
+static void populate(struct xs_handle *xsh)
+{
+    char path[80], val[32];
+    unsigned int d, k;
+    xs_transaction_t t;
+
+    for ( d = 0; d < nr_domains; d++ )
+    {
+ again:
+        t = xs_transaction_start(xsh);
+        for ( k = 0; k < NR_DOM_KEYS; k++ )
+        {
+            dom_path(path, sizeof(path), d, dom_keys[k]);
+            snprintf(val, sizeof(val), "%u", d * (unsigned int)NR_DOM_KEYS + k);
+            if ( !xs_write(xsh, t, path, val, strlen(val)) )
+            {
+                perror("xs_write");
+                exit(1);
+            }
+        }
+        if ( !xs_transaction_end(xsh, t, false) )
+        {
+            if ( errno == EAGAIN )
+                goto again;
+            perror("xs_transaction_end");
+            exit(1);
+        }
+    }
+}
+
+static void cleanup(struct xs_handle *xsh)
+{
+    char path[80];
+    unsigned int d;
+
+    for ( d = 0; d < nr_domains; d++ )
+    {
+        snprintf(path, sizeof(path), "/local/domain/%u", d + 1);
+        xs_rm(xsh, XBT_NULL, path);
+    }
+}
+
+/* Set up the backend's watches, returns how many events they fired. */
+static unsigned int watch_domains(struct xs_handle *xsh, bool add)
+{
+    char path[80];
+    unsigned int d;
+
+    if ( !per_domain_watches )
+    {
+        if ( add ? !xs_watch(xsh, "/local/domain", "backend")
+                 : !xs_unwatch(xsh, "/local/domain", "backend") )
+            return 0;
+        return 1;
+    }
+
+    for ( d = 0; d < nr_domains; d++ )
+    {
+        snprintf(path, sizeof(path), "/local/domain/%u", d + 1);
+        if ( add ? !xs_watch(xsh, path, "backend")
+                 : !xs_unwatch(xsh, path, "backend") )
+            return 0;
+    }
+    return nr_domains;
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    char path[80], val[32], token[32];
+    unsigned int dom, pick, len;
+    uint64_t start;
+    char **ev;
+    void *p;
+    bool ok;
+    int op;
+
+    snprintf(token, sizeof(token), "bench-%p", (void *)w);
+
+    while ( !stop )
+    {
+        dom = rand_r(&w->seed) % nr_domains;
+        pick = rand_r(&w->seed) % 100;
+        op = pick < read_pct ? OP_READ :
+             pick < read_pct + write_pct ? OP_WRITE : OP_WATCH;
+
+        start = now_ns();
+        switch ( op )
+        {
+        case OP_READ:
+            dom_path(path, sizeof(path), dom,
+                     dom_keys[rand_r(&w->seed) % NR_DOM_KEYS]);
+            p = xs_read(w->xsh, XBT_NULL, path, &len);
+            ok = p != NULL;
+            free(p);
+            break;
+
+        case OP_WRITE:
+            dom_path(path, sizeof(path), dom, "memory/target");
+            len = snprintf(val, sizeof(val), "%u", rand_r(&w->seed));
+            ok = xs_write(w->xsh, XBT_NULL, path, val, len);
+            break;
+
+        default:
+            /* A backend attaching to and detaching from a device. */
+            dom_path(path, sizeof(path), dom, "device");
+            ok = xs_watch(w->xsh, path, token) &&
+                 xs_unwatch(w->xsh, path, token);
+            break;
+        }
+        add_sample(&w->op[op], now_ns() - start);
+
+        if ( !ok )
+            w->errors++;
+
+        /* Discard the events our own watches fired. */
+        while ( (ev = xs_check_watch(w->xsh)) != NULL )
+            free(ev);
+    }
+
+    return NULL;
+}
+
+static void *watcher_fn(void *arg)
+{
+    struct xs_handle *xsh = arg;
+    unsigned int num;
+    char **ev;
+
+    while ( (ev = xs_read_watch(xsh, &num)) != NULL )
+    {
+        if ( !strcmp(ev[XS_WATCH_TOKEN], "stop") )
+        {
+            free(ev);
+            break;
+        }
+        nr_events++;
+        free(ev);
+    }
+
+    return NULL;
+}
+
+static void report(const char *name, struct samples *s, double secs)
+{
+    if ( !s->nr )
+    {
+        printf("%-8s %10lu\n", name, 0UL);
+        return;
+    }
+
+    qsort(s->ns, s->nr, sizeof(*s->ns), cmp_u64);
+    printf("%-8s %10lu %10.0f %9.1f %9.1f %9.1f\n", name, s->nr,
+           s->nr / secs,
+           s->ns[s->nr / 2] / 1000.0,
+           s->ns[s->nr * 99 / 100] / 1000.0,
+           s->ns[s->nr - 1] / 1000.0);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-d domains] [-t threads] [-s seconds] "
+            "[-r read%%] [-w write%%] [-p]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    struct xs_handle *xsh, *watch_xsh;
+    struct worker *workers;
+    struct samples all = { 0 };
+    pthread_t watcher;
+    unsigned long errors = 0;
+    uint64_t start;
+    double secs;
+    unsigned int i, num, nr_watches;
+    int c, op;
+
+    while ( (c = getopt(argc, argv, "d:t:s:r:w:p")) != -1 )
+    {
+        switch ( c )
+        {
+        case 'd': nr_domains = strtoul(optarg, NULL, 0); break;
+        case 't': nr_threads = strtoul(optarg, NULL, 0); break;
+        case 's': seconds = strtoul(optarg, NULL, 0); break;
+        case 'r': read_pct = strtoul(optarg, NULL, 0); break;
+        case 'w': write_pct = strtoul(optarg, NULL, 0); break;
+        case 'p': per_domain_watches = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if ( !nr_domains || !nr_threads || read_pct + write_pct > 100 )
+        usage(argv[0]);
+
+    xsh = xs_open(0);
+    watch_xsh = xs_open(0);
+    if ( !xsh || !watch_xsh )
+    {
+        perror("xs_open");
+        return 1;
+    }
+
+    printf("Populating %u domains...\n", nr_domains);
+    populate(xsh);
+
+    nr_watches = watch_domains(watch_xsh, true);
+    if ( !nr_watches || !xs_watch(watch_xsh, "/tool/xs-bench", "stop") )
+    {
+        perror("xs_watch");
+        return 1;
+    }
+    /* Swallow the events fired on registration. */
+    for ( i = 0; i <= nr_watches; i++ )
+        free(xs_read_watch(watch_xsh, &num));
+    pthread_create(&watcher, NULL, watcher_fn, watch_xsh);
+
+    workers = calloc(nr_threads, sizeof(*workers));
+    if ( !workers )
+        return 1;
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        workers[i].xsh = xs_open(0);
+        workers[i].seed = i + 1;
+        if ( !workers[i].xsh )
+        {
+            perror("xs_open");
+            return 1;
+        }
+    }
+
+    printf("Running %u threads for %us (%u%% read, %u%% write, "
+           "%u%% watch)\n", nr_threads, seconds, read_pct, write_pct,
+           100 - read_pct - write_pct);
+
+    start = now_ns();
+    for ( i = 0; i < nr_threads; i++ )
+        pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]);
+    sleep(seconds);
+    stop = true;
+    for ( i = 0; i < nr_threads; i++ )
+        pthread_join(workers[i].thread, NULL);
+    secs = (now_ns() - start) / 1e9;
+
+    xs_write(xsh, XBT_NULL, "/tool/xs-bench", "", 0);
+    pthread_join(watcher, NULL);
+
+    printf("\n%-8s %10s %10s %9s %9s %9s\n",
+           "op", "count", "ops/s", "p50(us)", "p99(us)", "max(us)");
+    for ( op = 0; op < NR_OPS; op++ )
+    {
+        struct samples merged = { 0 };
+
+        for ( i = 0; i < nr_threads; i++ )
+        {
+            struct samples *s = &workers[i].op[op];
+            unsigned long j;
+
+            for ( j = 0; j < s->nr; j++ )
+            {
+                add_sample(&merged, s->ns[j]);
+                add_sample(&all, s->ns[j]);
+            }
+        }
+        report(op_name[op], &merged, secs);
+        free(merged.ns);
+    }
+    report("total", &all, secs);
+    printf("\nwatch events delivered: %lu (%.0f/s)\n",
+           nr_events, nr_events / secs);
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        errors += workers[i].errors;
+        xs_close(workers[i].xsh);
+    }
+    if ( errors )
+        printf("%lu operations failed\n", errors);
+
+    xs_unwatch(watch_xsh, "/tool/xs-bench", "stop");
+    watch_domains(watch_xsh, false);
+    xs_rm(xsh, XBT_NULL, "/tool/xs-bench");
+    cleanup(xsh);
+    xs_close(watch_xsh);
+    xs_close(xsh);
+
+    return errors ? 1 : 0;
+}
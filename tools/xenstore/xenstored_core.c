@@ -50,6 +50,7 @@
 #include "xenstored_watch.h"
 #include "xenstored_transaction.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
 #include "xenctrl.h"
 #include "tdb.h"
 
@@ -81,41 +82,20 @@ static bool remove_local = true;
 static int reopen_log_pipe[2];
 static int reopen_log_pipe0_pollfd_idx = -1;
 static char *tracefile = NULL;
-static TDB_CONTEXT *tdb_ctx = NULL;
+uint64_t generation;
 
-static void corrupt(struct connection *conn, const char *fmt, ...);
 static void check_store(void);
 
-#define log(...)							\
-	do {								\
-		char *s = talloc_asprintf(NULL, __VA_ARGS__);		\
-		trace("%s\n", s);					\
-		syslog(LOG_ERR, "%s",  s);				\
-		talloc_free(s);						\
-	} while (0)
-
 
 int quota_nb_entry_per_domain = 1000;
 int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
-{
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
-}
-
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
+void set_tdb_key(const char *name, TDB_DATA *key)
 {
-	if (!(tdb_ctx->flags & TDB_INTERNAL))
-		if (rename(newname, xs_daemon_tdb()) != 0)
-			return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
-	return true;
+	key->dptr = (void *)name;
+	key->dsize = strlen(name);
 }
 
 static char *sockmsg_string(enum xsd_sockmsg_type type)
@@ -252,6 +232,8 @@ static bool write_messages(struct connection *conn)
 		return true;
 
 	if (out->inhdr) {
+		if (out->used == 0)
+			conn_event_sending(conn, out);
 		if (verbose)
 			xprintf("Writing msg %s (%.*s) out to %p\n",
 				sockmsg_string(out->hdr.msg.type),
@@ -307,6 +289,7 @@ static int destroy_conn(void *_conn)
 				break;
 		close(conn->fd);
 	}
+	conn_delete_all_events(conn);
         if (conn->target)
                 talloc_unlink(conn, conn->target);
 	list_del(&conn->list);
@@ -407,43 +390,47 @@ bool is_child(const char *child, const char *parent)
 static struct node *read_node(struct connection *conn, const char *name)
 {
 	TDB_DATA key, data;
-	uint32_t *p;
+	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
 
-	key.dptr = (void *)name;
-	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
+	node = talloc(name, struct node);
+	node->name = talloc_strdup(node, name);
+	node->parent = NULL;
+
+	transaction_prepend(conn, name, &key);
+	data = db_fetch(node, key);
 
 	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
-			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
-			errno = EIO;
+		if (errno == ENOENT) {
+			/* A transaction depends on this not existing, too. */
+			node->generation = NO_GENERATION;
+			errno = access_node(conn, node, NODE_ACCESS_READ,
+					    NULL) ? ENOMEM : ENOENT;
 		}
+		talloc_free(node);
 		return NULL;
 	}
 
-	node = talloc(name, struct node);
-	node->name = talloc_strdup(node, name);
-	node->parent = NULL;
-	node->tdb = tdb_context(conn);
-	talloc_steal(node, data.dptr);
-
-	/* Datalen, childlen, number of permissions */
-	p = (uint32_t *)data.dptr;
-	node->num_perms = p[0];
-	node->datalen = p[1];
-	node->childlen = p[2];
+	/* The record is shared with the store: never modify it in place. */
+	hdr = (void *)data.dptr;
+	node->generation = hdr->generation;
+	node->num_perms = hdr->num_perms;
+	node->datalen = hdr->datalen;
+	node->childlen = hdr->childlen;
 
 	/* Permissions are struct xs_permissions. */
-	node->perms = (void *)&p[3];
+	node->perms = hdr->perms;
 	/* Data is binary blob (usually ascii, no nul). */
 	node->data = node->perms + node->num_perms;
 	/* Children is strings, nul separated. */
 	node->children = node->data + node->datalen;
 
+	if (access_node(conn, node, NODE_ACCESS_READ, NULL)) {
+		talloc_free(node);
+		errno = ENOMEM;
+		return NULL;
+	}
+
 	return node;
 }
 
@@ -451,27 +438,36 @@ static bool write_node(struct connection *conn, const struct node *node)
 {
 	/*
 	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
+	 * access_node copes with this.
 	 */
 
 	TDB_DATA key, data;
+	struct xs_tdb_record_hdr *hdr;
 	void *p;
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	data.dsize = 3*sizeof(uint32_t)
+	data.dsize = offsetof(struct xs_tdb_record_hdr, perms)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
 
-	if (domain_is_unprivileged(conn) && data.dsize >= quota_max_entry_size)
+	/* The generation is ours: guests keep the quota they always had. */
+	if (domain_is_unprivileged(conn) &&
+	    data.dsize - sizeof(hdr->generation) >= quota_max_entry_size)
 		goto error;
 
+	if (access_node(conn, node, NODE_ACCESS_WRITE, &key)) {
+		errno = ENOMEM;
+		return false;
+	}
+
 	data.dptr = talloc_size(node, data.dsize);
-	((uint32_t *)data.dptr)[0] = node->num_perms;
-	((uint32_t *)data.dptr)[1] = node->datalen;
-	((uint32_t *)data.dptr)[2] = node->childlen;
-	p = data.dptr + 3 * sizeof(uint32_t);
+	hdr = (void *)data.dptr;
+	/* Transactions give their nodes a generation when they commit. */
+	hdr->generation = conn && conn->transaction ?
+			  node->generation : ++generation;
+	hdr->num_perms = node->num_perms;
+	hdr->datalen = node->datalen;
+	hdr->childlen = node->childlen;
+	p = hdr->perms;
 
 	memcpy(p, node->perms, node->num_perms*sizeof(node->perms[0]));
 	p += node->num_perms*sizeof(node->perms[0]);
@@ -479,9 +475,8 @@ static bool write_node(struct connection *conn, const struct node *node)
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
-		corrupt(conn, "Write of %s failed", key.dptr);
+	if (db_store(key, data) != 0) {
+		corrupt(conn, "Write of %s failed", node->name);
 		goto error;
 	}
 	return true;
@@ -799,10 +794,13 @@ static void delete_node_single(struct connection *conn, struct node *node)
 {
 	TDB_DATA key;
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
+	if (access_node(conn, node, NODE_ACCESS_DELETE, &key)) {
+		corrupt(conn, "Could not record deletion of '%s'", node->name);
+		return;
+	}
 
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+	/* Nothing to do for a node a transaction has not written. */
+	if (key.dptr && db_delete(key) != 0) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -843,7 +841,7 @@ static struct node *construct_node(struct connection *conn, const char *name)
 
 	/* Allocate node */
 	node = talloc(name, struct node);
-	node->tdb = tdb_context(conn);
+	node->generation = NO_GENERATION;
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except unprivileged domains own what they create */
@@ -861,26 +859,12 @@ static struct node *construct_node(struct connection *conn, const char *name)
 	return node;
 }
 
-static int destroy_node(void *_node)
-{
-	struct node *node = _node;
-	TDB_DATA key;
-
-	if (streq(node->name, "/"))
-		corrupt(NULL, "Destroying root node!");
-
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	tdb_delete(node->tdb, key);
-	return 0;
-}
-
 static struct node *create_node(struct connection *conn, 
 				const char *name,
 				void *data, unsigned int datalen)
 {
-	struct node *node, *i;
+	struct node *node, *i, *j;
+	int saved_errno;
 
 	node = construct_node(conn, name);
 	if (!node)
@@ -889,19 +873,19 @@ static struct node *create_node(struct connection *conn,
 	node->data = data;
 	node->datalen = datalen;
 
-	/* We write out the nodes down, setting destructor in case
+	/* We write out the nodes down, removing the new ones again if
 	 * something goes wrong. */
 	for (i = node; i; i = i->parent) {
 		if (!write_node(conn, i)) {
+			saved_errno = errno;
 			domain_entry_dec(conn, i);
+			for (j = node; j != i; j = j->parent)
+				delete_node_single(conn, j);
+			errno = saved_errno;
 			return NULL;
 		}
-		talloc_set_destructor(i, destroy_node);
 	}
 
-	/* OK, now remove destructors so they stay around */
-	for (i = node; i; i = i->parent)
-		talloc_set_destructor(i, NULL);
 	return node;
 }
 
@@ -1013,7 +997,12 @@ static bool remove_child_entry(struct connection *conn, struct node *node,
 			       size_t offset)
 {
 	size_t childlen = strlen(node->children + offset);
-	memdel(node->children, offset, childlen + 1, node->childlen);
+	char *children = talloc_memdup(node, node->children, node->childlen);
+
+	if (!children)
+		return false;
+	memdel(children, offset, childlen + 1, node->childlen);
+	node->children = children;
 	node->childlen -= childlen + 1;
 	return write_node(conn, node);
 }
@@ -1458,8 +1447,6 @@ static void accept_connection(int sock, bool canwrite)
 }
 #endif
 
-static int tdb_flags;
-
 /* We create initial nodes manually. */
 static void manual_node(const char *name, const char *child)
 {
@@ -1481,13 +1468,7 @@ static void manual_node(const char *name, const char *child)
 
 static void setup_structure(void)
 {
-	char *tdbname;
-	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
-
-	if (!(tdb_flags & TDB_INTERNAL))
-		tdb_ctx = tdb_open(tdbname, 0, tdb_flags, O_RDWR, 0);
-
-	if (tdb_ctx) {
+	if (db_open()) {
 		/* XXX When we make xenstored able to restart, this will have
 		   to become cleverer, checking for existing domains and not
 		   removing the corresponding entries, but for now xenstored
@@ -1516,11 +1497,6 @@ static void setup_structure(void)
 		talloc_free(tlocal);
 	}
 	else {
-		tdb_ctx = tdb_open(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT,
-				   0640);
-		if (!tdb_ctx)
-			barf_perror("Could not create tdb file %s", tdbname);
-
 		manual_node("/", "tool");
 		manual_node("/tool", "xenstored");
 		manual_node("/tool/xenstored", NULL);
@@ -1530,7 +1506,7 @@ static void setup_structure(void)
 }
 
 
-static unsigned int hash_from_key_fn(void *k)
+unsigned int hash_from_key_fn(void *k)
 {
 	char *str = k;
 	unsigned int hash = 5381;
@@ -1543,7 +1519,7 @@ static unsigned int hash_from_key_fn(void *k)
 }
 
 
-static int keys_equal_fn(void *key1, void *key2)
+int keys_equal_fn(void *key1, void *key2)
 {
 	return 0 == strcmp((char *)key1, (char *)key2);
 }
@@ -1647,16 +1623,27 @@ static void check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static int clean_store_(TDB_DATA key, TDB_DATA val, void *private)
 {
 	struct hashtable *reachable = private;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
+	struct xs_tdb_record_hdr *hdr = (void *)val.dptr;
+	char * name;
+
+	/* Nodes written by open transactions are not reachable yet. */
+	if (key.dsize && key.dptr[0] != '/' && transactions_open())
+		return 0;
+
+	/* Never hand out a generation again, if we restarted on this store. */
+	if (val.dsize >= sizeof(hdr->generation) &&
+	    hdr->generation > generation)
+		generation = hdr->generation;
+
+	name = talloc_strndup(NULL, key.dptr, key.dsize);
 
 	if (!hashtable_search(reachable, name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			db_delete(key);
 		}
 	}
 
@@ -1672,7 +1659,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	db_traverse(&clean_store_, reachable);
 }
 
 
@@ -1694,7 +1681,7 @@ static void check_store(void)
 
 
 /* Something is horribly wrong: check the store. */
-static void corrupt(struct connection *conn, const char *fmt, ...)
+void corrupt(struct connection *conn, const char *fmt, ...)
 {
 	va_list arglist;
 	char *str;
@@ -1864,7 +1851,9 @@ static void usage(void)
 "  --transaction <nb>  limit the number of transaction allowed per domain,\n"
 "  --no-recovery       to request that no recovery should be attempted when\n"
 "                      the store is corrupted (debug only),\n"
-"  --internal-db       store database in memory, not on disk\n"
+"  --internal-db       store database in memory, not on disk,\n"
+"  --internal-db-log <file> keep the in-memory database in an append-only\n"
+"                      log, reloaded on start-up,\n"
 "  --preserve-local    to request that /local is preserved on start-up,\n"
 "  --verbose           to request verbose execution.\n");
 }
@@ -1886,6 +1875,7 @@ static struct option options[] = {
 	{ "no-recovery", 0, NULL, 'R' },
 	{ "preserve-local", 0, NULL, 'L' },
 	{ "internal-db", 0, NULL, 'I' },
+	{ "internal-db-log", 1, NULL, 'J' },
 	{ "verbose", 0, NULL, 'V' },
 	{ "watch-nb", 1, NULL, 'W' },
 	{ NULL, 0, NULL, 0 } };
@@ -1942,7 +1932,10 @@ int main(int argc, char *argv[])
 			tracefile = optarg;
 			break;
 		case 'I':
-			tdb_flags = TDB_INTERNAL|TDB_NOLOCK;
+			db_set_internal(NULL);
+			break;
+		case 'J':
+			db_set_internal(optarg);
 			break;
 		case 'V':
 			verbose = true;
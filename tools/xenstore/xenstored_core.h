@@ -31,6 +31,8 @@
 #include "list.h"
 #include "tdb.h"
 
+struct hashtable;
+
 struct buffered_data
 {
 	struct list_head list;
@@ -75,6 +77,9 @@ struct connection
 	/* Buffered output data */
 	struct list_head out_list;
 
+	/* Watch events in out_list not yet started (NULL if none yet). */
+	struct hashtable *events;
+
 	/* Transaction context for current request (NULL if none). */
 	struct transaction *transaction;
 
@@ -98,11 +103,14 @@ struct connection
 };
 extern struct list_head connections;
 
+/* Generation of a node which does not exist. */
+#define NO_GENERATION ~((uint64_t)0)
+
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Generation of the record I was read from, NO_GENERATION if new. */
+	uint64_t generation;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -147,14 +155,20 @@ struct node *get_node(struct connection *conn,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
+/* The store, including the nodes written by open transactions. */
 
-/* Destructor for tdbs: required for transaction code */
-int destroy_tdb(void *_tdb);
+/* Last generation given to a node or transaction. */
+extern uint64_t generation;
 
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
+/* The tdb key of a node. */
+void set_tdb_key(const char *name, TDB_DATA *key);
+
+/* Hashtable callbacks for nul-terminated string keys. */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
+
+/* Something is horribly wrong: check the store. */
+void corrupt(struct connection *conn, const char *fmt, ...);
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 
@@ -167,6 +181,14 @@ void trace_create(const void *data, const char *type);
 void trace_destroy(const void *data, const char *type);
 void trace_watch_timeout(const struct connection *conn, const char *node, const char *token);
 void trace(const char *fmt, ...);
+
+#define log(...)							\
+	do {								\
+		char *s = talloc_asprintf(NULL, __VA_ARGS__);		\
+		trace("%s\n", s);					\
+		syslog(LOG_ERR, "%s",  s);				\
+		talloc_free(s);						\
+	} while (0)
 void dtrace_io(const struct connection *conn, const struct buffered_data *data, int out);
 
 extern int event_fd;
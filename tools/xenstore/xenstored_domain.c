@@ -323,6 +323,7 @@ static void domain_conn_reset(struct domain *domain)
 
 	conn_delete_all_watches(conn);
 	conn_delete_all_transactions(conn);
+	conn_delete_all_events(conn);
 
 	while ((out = list_top(&conn->out_list, struct buffered_data, list))) {
 		list_del(&out->list);
@@ -0,0 +1,534 @@
+/*
+    Node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * Nodes are kept either in a tdb file, as xenstored always did, or in
+ * memory (--internal-db).
+ *
+ * The in-memory store is a hash trie: every level consumes TRIE_BITS of
+ * the key's hash, and a leaf is split into TRIE_FANOUT children once it
+ * holds more than TRIE_LEAF_MAX records.  Unlike a hash table it grows
+ * a leaf at a time, so no single write has to rehash the whole store.
+ * Each record's data is a talloc blob owned by the record; lookups hand
+ * out a talloc reference to it instead of a copy, and replacing or
+ * deleting the record merely drops the store's link, so readers keep
+ * whatever they were given.
+ *
+ * Optionally every change is appended to a log file, which is replayed
+ * on start-up.  When the log has grown to several times the size of
+ * the live data, it is replaced by a snapshot of the store.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <syslog.h>
+#include "talloc.h"
+#include "utils.h"
+#include "xenstore_lib.h"
+#include "xenstored_core.h"
+#include "xenstored_store.h"
+
+#define TRIE_BITS	4
+#define TRIE_FANOUT	(1 << TRIE_BITS)
+#define TRIE_LEAF_MAX	8
+#define TRIE_DEPTH_MAX	(32 / TRIE_BITS)
+
+struct db_record {
+	struct db_record *next;
+	uint32_t hash;
+	TDB_DATA key;
+	TDB_DATA data;
+};
+
+struct trie_node {
+	/* Interior nodes have children, leaves have records. */
+	struct trie_node **child;
+	struct db_record *records;
+	unsigned int nr_records;
+};
+
+#define DB_LOG_MAGIC	"XSDBLOG1"
+#define DB_LOG_DELETE	(~(uint32_t)0)
+/* Write a snapshot once the log is this many times the live data... */
+#define DB_LOG_RATIO	4
+/* ...but don't bother for small logs. */
+#define DB_LOG_SLACK	(1024 * 1024)
+
+struct db_log_hdr {
+	uint32_t keylen;
+	uint32_t datalen;	/* DB_LOG_DELETE for a deletion. */
+};
+
+static bool db_internal;
+static TDB_CONTEXT *tdb_ctx;
+static struct trie_node *db_root;
+static const char *db_logname;
+static int db_logfd = -1;
+static off_t db_logsize;
+static size_t db_livesize;
+
+static uint32_t db_hash(TDB_DATA key)
+{
+	uint32_t hash = 2166136261u;
+	unsigned int i;
+
+	for (i = 0; i < key.dsize; i++) {
+		hash ^= key.dptr[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static unsigned int trie_index(uint32_t hash, unsigned int depth)
+{
+	return (hash >> (depth * TRIE_BITS)) & (TRIE_FANOUT - 1);
+}
+
+static struct trie_node *trie_leaf(uint32_t hash, unsigned int *depth)
+{
+	struct trie_node *t = db_root;
+	unsigned int d = 0;
+
+	while (t->child)
+		t = t->child[trie_index(hash, d++)];
+
+	if (depth)
+		*depth = d;
+	return t;
+}
+
+static struct db_record **trie_find(struct trie_node *leaf, uint32_t hash,
+				    TDB_DATA key)
+{
+	struct db_record **r;
+
+	for (r = &leaf->records; *r; r = &(*r)->next)
+		if ((*r)->hash == hash && (*r)->key.dsize == key.dsize &&
+		    memcmp((*r)->key.dptr, key.dptr, key.dsize) == 0)
+			break;
+	return r;
+}
+
+static void trie_split(struct trie_node *leaf, unsigned int depth)
+{
+	struct trie_node **child;
+	struct db_record *r, *next;
+	unsigned int i;
+
+	child = talloc_array(leaf, struct trie_node *, TRIE_FANOUT);
+	if (!child)
+		return;
+	for (i = 0; i < TRIE_FANOUT; i++) {
+		child[i] = talloc_zero(child, struct trie_node);
+		if (!child[i]) {
+			talloc_free(child);
+			return;
+		}
+	}
+
+	for (r = leaf->records; r; r = next) {
+		struct trie_node *t = child[trie_index(r->hash, depth)];
+
+		next = r->next;
+		talloc_steal(t, r);
+		r->next = t->records;
+		t->records = r;
+		t->nr_records++;
+	}
+
+	leaf->records = NULL;
+	leaf->nr_records = 0;
+	leaf->child = child;
+}
+
+static int trie_store(TDB_DATA key, TDB_DATA data)
+{
+	uint32_t hash = db_hash(key);
+	unsigned int depth;
+	struct trie_node *leaf = trie_leaf(hash, &depth);
+	struct db_record *r = *trie_find(leaf, hash, key);
+	void *blob;
+
+	if (r) {
+		blob = talloc_memdup(r, data.dptr, data.dsize);
+		if (!blob)
+			goto nomem;
+		db_livesize -= r->data.dsize;
+		talloc_unlink(r, r->data.dptr);
+	} else {
+		r = talloc_size(leaf, sizeof(*r) + key.dsize);
+		if (!r)
+			goto nomem;
+		blob = talloc_memdup(r, data.dptr, data.dsize);
+		if (!blob) {
+			talloc_free(r);
+			goto nomem;
+		}
+		r->hash = hash;
+		r->key.dptr = (void *)(r + 1);
+		r->key.dsize = key.dsize;
+		memcpy(r->key.dptr, key.dptr, key.dsize);
+		r->next = leaf->records;
+		leaf->records = r;
+		db_livesize += key.dsize;
+
+		if (++leaf->nr_records > TRIE_LEAF_MAX &&
+		    depth < TRIE_DEPTH_MAX)
+			trie_split(leaf, depth);
+	}
+
+	r->data.dptr = blob;
+	r->data.dsize = data.dsize;
+	db_livesize += data.dsize;
+	return 0;
+
+ nomem:
+	errno = ENOMEM;
+	return -1;
+}
+
+static int trie_delete(TDB_DATA key)
+{
+	uint32_t hash = db_hash(key);
+	struct trie_node *leaf = trie_leaf(hash, NULL);
+	struct db_record **rp = trie_find(leaf, hash, key);
+	struct db_record *r = *rp;
+
+	if (!r) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	*rp = r->next;
+	leaf->nr_records--;
+	db_livesize -= r->key.dsize + r->data.dsize;
+	talloc_unlink(r, r->data.dptr);
+	talloc_free(r);
+	return 0;
+}
+
+static int trie_traverse(struct trie_node *t, db_traverse_fn *fn,
+			 void *private)
+{
+	struct db_record *r, *next;
+	unsigned int i;
+
+	if (t->child) {
+		for (i = 0; i < TRIE_FANOUT; i++)
+			if (trie_traverse(t->child[i], fn, private))
+				return -1;
+		return 0;
+	}
+
+	for (r = t->records; r; r = next) {
+		next = r->next;
+		if (fn(r->key, r->data, private))
+			return -1;
+	}
+	return 0;
+}
+
+static int log_write(int fd, TDB_DATA key, TDB_DATA *data)
+{
+	struct db_log_hdr hdr;
+	struct iovec iov[3];
+	ssize_t len, done;
+
+	hdr.keylen = key.dsize;
+	hdr.datalen = data ? data->dsize : DB_LOG_DELETE;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = key.dptr;
+	iov[1].iov_len = key.dsize;
+	iov[2].iov_base = data ? data->dptr : NULL;
+	iov[2].iov_len = data ? data->dsize : 0;
+	len = sizeof(hdr) + key.dsize + iov[2].iov_len;
+
+	done = writev(fd, iov, 3);
+	if (done == len)
+		return len;
+	if (done >= 0)
+		errno = ENOSPC;
+	return -1;
+}
+
+static int snapshot_record(TDB_DATA key, TDB_DATA data, void *private)
+{
+	int *fd = private;
+
+	return log_write(*fd, key, &data) < 0 ? -1 : 0;
+}
+
+/* Replace the log with a snapshot of the current store. */
+static void log_snapshot(void)
+{
+	char *tmpname = talloc_asprintf(NULL, "%s.new", db_logname);
+	int fd;
+
+	fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0640);
+	if (fd < 0)
+		goto fail;
+
+	if (write(fd, DB_LOG_MAGIC, strlen(DB_LOG_MAGIC)) !=
+	    strlen(DB_LOG_MAGIC) ||
+	    trie_traverse(db_root, snapshot_record, &fd) ||
+	    fsync(fd) || rename(tmpname, db_logname)) {
+		close(fd);
+		unlink(tmpname);
+		goto fail;
+	}
+
+	close(db_logfd);
+	db_logfd = fd;
+	db_logsize = lseek(fd, 0, SEEK_END);
+	talloc_free(tmpname);
+	return;
+
+ fail:
+	log("Could not write snapshot %s: %s", tmpname, strerror(errno));
+	talloc_free(tmpname);
+}
+
+static int log_append(TDB_DATA key, TDB_DATA *data)
+{
+	int len;
+
+	if (db_logfd < 0)
+		return 0;
+
+	len = log_write(db_logfd, key, data);
+	if (len < 0) {
+		int saved_errno = errno;
+
+		log("Write to %s failed: %s", db_logname, strerror(errno));
+		/* Don't leave half a record behind for the next one. */
+		if (ftruncate(db_logfd, db_logsize))
+			log("Could not truncate %s", db_logname);
+		errno = saved_errno;
+		return -1;
+	}
+	db_logsize += len;
+	return 0;
+}
+
+/* Called once a change is both logged and applied. */
+static void log_check_size(void)
+{
+	if (db_logfd >= 0 && db_logsize > DB_LOG_SLACK &&
+	    db_logsize > DB_LOG_RATIO * (off_t)db_livesize)
+		log_snapshot();
+}
+
+/* Replay the log into the store, returns true if it held anything. */
+static bool log_replay(void)
+{
+	size_t magiclen = strlen(DB_LOG_MAGIC);
+	struct db_log_hdr *hdr;
+	TDB_DATA key, data;
+	struct stat st;
+	char *buf;
+	size_t off, len;
+
+	db_logfd = open(db_logname, O_RDWR|O_CREAT|O_APPEND, 0640);
+	if (db_logfd < 0)
+		barf_perror("Could not open %s", db_logname);
+	if (fstat(db_logfd, &st))
+		barf_perror("Could not stat %s", db_logname);
+
+	if (st.st_size == 0) {
+		if (write(db_logfd, DB_LOG_MAGIC, magiclen) != magiclen)
+			barf_perror("Could not write %s", db_logname);
+		db_logsize = magiclen;
+		return false;
+	}
+
+	buf = talloc_size(NULL, st.st_size);
+	if (!buf)
+		barf("Out of memory reading %s", db_logname);
+	if (pread(db_logfd, buf, st.st_size, 0) != st.st_size)
+		barf_perror("Could not read %s", db_logname);
+	len = st.st_size;
+	if (len < magiclen || memcmp(buf, DB_LOG_MAGIC, magiclen))
+		barf("%s is not a xenstored log", db_logname);
+
+	for (off = magiclen; off + sizeof(*hdr) <= len; ) {
+		hdr = (void *)(buf + off);
+		key.dptr = (void *)(hdr + 1);
+		key.dsize = hdr->keylen;
+		data.dptr = key.dptr + key.dsize;
+		data.dsize = hdr->datalen == DB_LOG_DELETE ? 0 : hdr->datalen;
+		if (len - off - sizeof(*hdr) < (size_t)key.dsize + data.dsize)
+			break;
+
+		if (hdr->datalen == DB_LOG_DELETE)
+			trie_delete(key);
+		else if (trie_store(key, data))
+			barf("Out of memory reading %s", db_logname);
+		off += sizeof(*hdr) + key.dsize + data.dsize;
+	}
+
+	/* A crash may have cut the last record short: forget it. */
+	if (off != len) {
+		log("Discarding %zu trailing bytes of %s", len - off,
+		    db_logname);
+		if (ftruncate(db_logfd, off))
+			barf_perror("Could not truncate %s", db_logname);
+	}
+	db_logsize = off;
+	talloc_free(buf);
+
+	return db_root->child || db_root->nr_records;
+}
+
+void db_set_internal(const char *logfile)
+{
+	db_internal = true;
+	db_logname = logfile;
+}
+
+bool db_open(void)
+{
+	char *tdbname;
+
+	if (db_internal) {
+		db_root = talloc_zero(talloc_autofree_context(),
+				      struct trie_node);
+		if (!db_root)
+			barf("Out of memory");
+		return db_logname ? log_replay() : false;
+	}
+
+	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
+
+	tdb_ctx = tdb_open(tdbname, 0, 0, O_RDWR, 0);
+	if (tdb_ctx)
+		return true;
+
+	tdb_ctx = tdb_open(tdbname, 7919, 0, O_RDWR|O_CREAT, 0640);
+	if (!tdb_ctx)
+		barf_perror("Could not create tdb file %s", tdbname);
+	return false;
+}
+
+TDB_DATA db_fetch(const void *ctx, TDB_DATA key)
+{
+	TDB_DATA data = { NULL, 0 };
+	struct db_record *r;
+	uint32_t hash;
+
+	if (!db_internal) {
+		data = tdb_fetch(tdb_ctx, key);
+		if (data.dptr)
+			talloc_steal(ctx, data.dptr);
+		else if (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST)
+			errno = ENOENT;
+		else {
+			log("TDB error on read: %s", tdb_errorstr(tdb_ctx));
+			errno = EIO;
+		}
+		return data;
+	}
+
+	hash = db_hash(key);
+	r = *trie_find(trie_leaf(hash, NULL), hash, key);
+	if (!r) {
+		errno = ENOENT;
+		return data;
+	}
+
+	data.dptr = talloc_reference(ctx, r->data.dptr);
+	if (!data.dptr) {
+		errno = ENOMEM;
+		return data;
+	}
+	data.dsize = r->data.dsize;
+	return data;
+}
+
+int db_store(TDB_DATA key, TDB_DATA data)
+{
+	if (!db_internal) {
+		/* TDB should set errno, but doesn't even set ecode AFAICT. */
+		if (tdb_store(tdb_ctx, key, data, TDB_REPLACE) != 0) {
+			errno = ENOSPC;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (log_append(key, &data) || trie_store(key, data))
+		return -1;
+	log_check_size();
+	return 0;
+}
+
+int db_delete(TDB_DATA key)
+{
+	uint32_t hash;
+
+	if (!db_internal) {
+		if (tdb_delete(tdb_ctx, key) != 0) {
+			errno = tdb_error(tdb_ctx) == TDB_ERR_NOEXIST ?
+				ENOENT : EIO;
+			return -1;
+		}
+		return 0;
+	}
+
+	hash = db_hash(key);
+	if (!*trie_find(trie_leaf(hash, NULL), hash, key)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (log_append(key, NULL) || trie_delete(key))
+		return -1;
+	log_check_size();
+	return 0;
+}
+
+struct db_traverse_arg {
+	db_traverse_fn *fn;
+	void *private;
+};
+
+static int db_traverse_tdb(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA data,
+			   void *private)
+{
+	struct db_traverse_arg *arg = private;
+
+	return arg->fn(key, data, arg->private);
+}
+
+void db_traverse(db_traverse_fn *fn, void *private)
+{
+	struct db_traverse_arg arg = { fn, private };
+
+	if (db_internal)
+		trie_traverse(db_root, fn, private);
+	else
+		tdb_traverse(tdb_ctx, db_traverse_tdb, &arg);
+}
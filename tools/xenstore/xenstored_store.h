@@ -0,0 +1,51 @@
+/*
+    Node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef _XENSTORED_STORE_H
+#define _XENSTORED_STORE_H
+
+#include <stdbool.h>
+#include "tdb.h"
+
+/*
+ * Keep the store in memory rather than in a tdb file.  If logfile is
+ * non-NULL, every change is appended to it and the store is reloaded
+ * from it on start-up.  Must be called before db_open().
+ */
+void db_set_internal(const char *logfile);
+
+/* Open the store, returns true if it already held nodes. */
+bool db_open(void);
+
+/*
+ * Look up a record.  The data belongs to ctx and must be treated as
+ * read-only: the in-memory store hands out a reference to its own copy.
+ * If it fails, returns dptr == NULL and sets errno (ENOENT if absent).
+ */
+TDB_DATA db_fetch(const void *ctx, TDB_DATA key);
+
+/* Replace or create a record.  If it fails, returns -1 and sets errno. */
+int db_store(TDB_DATA key, TDB_DATA data);
+
+/* Remove a record.  If it fails, returns -1 and sets errno. */
+int db_delete(TDB_DATA key);
+
+/* Call fn for every record; fn may delete the record it is given. */
+typedef int db_traverse_fn(TDB_DATA key, TDB_DATA data, void *private);
+void db_traverse(db_traverse_fn *fn, void *private);
+
+#endif /* _XENSTORED_STORE_H */
@@ -28,14 +28,61 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <inttypes.h>
+#include <syslog.h>
 #include "talloc.h"
 #include "list.h"
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
 #include "xenstore_lib.h"
 #include "utils.h"
 
+/*
+ * Transactions work on the store itself, with per-node versioning.
+ *
+ * Each node record carries the generation it was last written in, from a
+ * global counter.  A transaction remembers every node it reads, writes or
+ * deletes, together with the generation the node had when first accessed
+ * (NO_GENERATION if it did not exist).  A node the transaction changes is
+ * written to a copy under its own key, "<transaction generation><name>",
+ * which cannot clash with a node name as those start with '/'.  Reads of
+ * changed nodes come from the copy, other reads from the store.
+ *
+ * Committing checks that none of the accessed nodes has a different
+ * generation now, failing with EAGAIN otherwise, then moves the copies
+ * into place with new generations and does the deletions.  Changes to
+ * nodes the transaction did not look at do not make it fail.
+ */
+
+struct accessed_node
+{
+	/* List of all nodes accessed by this transaction. */
+	struct list_head list;
+
+	/* The name of the node. */
+	char *node;
+
+	/* Key of the transaction's copy of the node. */
+	char *trans_name;
+
+	/* Generation of the node when first accessed. */
+	uint64_t generation;
+
+	/* Written or deleted by the transaction? */
+	bool modified;
+
+	/* Does the copy exist, ie. was it written and not deleted since? */
+	bool ta_node;
+
+	/* While committing: the record to store (NULL to delete)... */
+	TDB_DATA new;
+
+	/* ...and the one it replaces (NULL if none), to roll back to. */
+	TDB_DATA old;
+};
+
 struct changed_node
 {
 	/* List of all changed nodes in the context of this transaction. */
@@ -68,14 +115,16 @@ struct transaction
 	/* Connection-local identifier for this transaction. */
 	uint32_t id;
 
-	/* Generation when transaction started. */
-	unsigned int generation;
+	/* Generation when transaction started, naming its node copies. */
+	uint64_t generation;
 
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
+	/* List of accessed nodes. */
+	struct list_head accessed;
 
-	/* List of changed nodes. */
+	/* An access could not be recorded: don't commit. */
+	bool fail;
+
+	/* List of changed nodes, to fire watches on. */
 	struct list_head changes;
 
 	/* List of changed domains - to record the changed domain entry number */
@@ -83,12 +132,191 @@ struct transaction
 };
 
 extern int quota_max_transaction;
-static unsigned int generation;
+static unsigned int nr_open;
+
+unsigned int transactions_open(void)
+{
+	return nr_open;
+}
+
+static struct accessed_node *find_accessed_node(struct transaction *trans,
+						const char *name)
+{
+	struct accessed_node *i;
+
+	list_for_each_entry(i, &trans->accessed, list)
+		if (streq(i->node, name))
+			return i;
+
+	return NULL;
+}
+
+void transaction_prepend(struct connection *conn, const char *name,
+			 TDB_DATA *key)
+{
+	struct accessed_node *i = NULL;
+
+	if (conn && conn->transaction)
+		i = find_accessed_node(conn->transaction, name);
+
+	/* Once changed, the node is whatever the transaction made it. */
+	set_tdb_key(i && i->modified ? i->trans_name : name, key);
+}
+
+int access_node(struct connection *conn, const struct node *node,
+		enum node_access_type type, TDB_DATA *key)
+{
+	struct transaction *trans = conn ? conn->transaction : NULL;
+	struct accessed_node *i;
+
+	if (!trans) {
+		if (key)
+			set_tdb_key(node->name, key);
+		return 0;
+	}
+
+	i = find_accessed_node(trans, node->name);
+	if (!i) {
+		i = talloc_zero(trans, struct accessed_node);
+		if (i) {
+			i->node = talloc_strdup(i, node->name);
+			i->trans_name = talloc_asprintf(i, "%"PRIu64"%s",
+							trans->generation,
+							node->name);
+		}
+		if (!i || !i->node || !i->trans_name) {
+			talloc_free(i);
+			/* Committing could miss a conflict now. */
+			trans->fail = true;
+			return -1;
+		}
+		i->generation = node->generation;
+		list_add_tail(&i->list, &trans->accessed);
+	}
+
+	switch (type) {
+	case NODE_ACCESS_READ:
+		break;
+	case NODE_ACCESS_WRITE:
+		i->modified = true;
+		i->ta_node = true;
+		set_tdb_key(i->trans_name, key);
+		break;
+	case NODE_ACCESS_DELETE:
+		i->modified = true;
+		if (i->ta_node)
+			set_tdb_key(i->trans_name, key);
+		else
+			key->dptr = NULL;
+		i->ta_node = false;
+		break;
+	}
+
+	return 0;
+}
+
+/* Has a node the transaction accessed been changed by someone else? */
+static bool transaction_conflicts(struct transaction *trans)
+{
+	struct accessed_node *i;
+	struct xs_tdb_record_hdr *hdr;
+	TDB_DATA key, data;
+	uint64_t gen;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		set_tdb_key(i->node, &key);
+		data = db_fetch(trans, key);
+		if (data.dptr) {
+			hdr = (void *)data.dptr;
+			gen = hdr->generation;
+			talloc_unlink(trans, data.dptr);
+		} else if (errno == ENOENT)
+			gen = NO_GENERATION;
+		else
+			return true;
+
+		if (gen != i->generation)
+			return true;
+	}
+
+	return false;
+}
+
+/* Make a node hold data, or not exist if data.dptr is NULL. */
+static int commit_node(struct accessed_node *i, TDB_DATA data)
+{
+	TDB_DATA key;
+
+	set_tdb_key(i->node, &key);
+	if (data.dptr)
+		return db_store(key, data);
+	if (db_delete(key) != 0 && errno != ENOENT)
+		return -1;
+	return 0;
+}
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+/*
+ * Move the transaction's changes into the store, all or nothing.  The new
+ * records and the ones they replace are fetched first, which is all that
+ * can fail without touching the store.  Should a store or delete then fail
+ * half-way, the nodes already changed are put back.  The transaction's
+ * copies are left for destroy_transaction() to delete.
+ */
+static bool finalize_transaction(struct connection *conn,
+				 struct transaction *trans)
 {
-	return trans->tdb;
+	struct accessed_node *i, *failed;
+	struct xs_tdb_record_hdr *hdr;
+	TDB_DATA key, data;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->modified)
+			continue;
+
+		set_tdb_key(i->node, &key);
+		i->old = db_fetch(trans, key);
+		if (!i->old.dptr && errno != ENOENT)
+			goto err;
+
+		i->new.dptr = NULL;
+		if (!i->ta_node)
+			continue;
+
+		set_tdb_key(i->trans_name, &key);
+		data = db_fetch(trans, key);
+		if (!data.dptr)
+			goto err;
+		/* The fetched record is read-only. */
+		i->new.dptr = talloc_memdup(trans, data.dptr, data.dsize);
+		i->new.dsize = data.dsize;
+		talloc_unlink(trans, data.dptr);
+		if (!i->new.dptr)
+			goto err;
+		hdr = (void *)i->new.dptr;
+		hdr->generation = ++generation;
+	}
+
+	list_for_each_entry(i, &trans->accessed, list)
+		if (i->modified && commit_node(i, i->new) != 0)
+			goto undo;
+
+	return true;
+
+ undo:
+	corrupt(conn, "Could not commit '%s', rolling back", i->node);
+	failed = i;
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (i == failed)
+			break;
+		if (i->modified && commit_node(i, i->old) != 0)
+			corrupt(conn, "Could not roll back '%s'", i->node);
+	}
+	return false;
+
+ err:
+	log("transaction %u: could not stage '%s' for commit: %s",
+	    trans->id, i->node, strerror(errno));
+	return false;
 }
 
 /* Callers get a change node (which can fail) and only commit after they've
@@ -97,11 +325,9 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 {
 	struct changed_node *i;
 
-	if (!trans) {
-		/* They're changing the global database. */
-		generation++;
+	/* Outside a transaction, watches fire straight away. */
+	if (!trans)
 		return;
-	}
 
 	list_for_each_entry(i, &trans->changes, list)
 		if (streq(i->node, node))
@@ -116,11 +342,16 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 static int destroy_transaction(void *_transaction)
 {
 	struct transaction *trans = _transaction;
+	struct accessed_node *i;
+	TDB_DATA key;
 
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
+	list_for_each_entry(i, &trans->accessed, list)
+		if (i->ta_node) {
+			set_tdb_key(i->trans_name, &key);
+			db_delete(key);
+		}
+	nr_open--;
 	return 0;
 }
 
@@ -156,18 +387,15 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 
 	/* Attach transaction to input for autofree until it's complete */
 	trans = talloc(in, struct transaction);
-	INIT_LIST_HEAD(&trans->changes);
-	INIT_LIST_HEAD(&trans->changed_domains);
-	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb) {
-		send_error(conn, errno);
+	if (!trans) {
+		send_error(conn, ENOMEM);
 		return;
 	}
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
+	INIT_LIST_HEAD(&trans->accessed);
+	INIT_LIST_HEAD(&trans->changes);
+	INIT_LIST_HEAD(&trans->changed_domains);
+	trans->fail = false;
+	trans->generation = ++generation;
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -180,6 +408,7 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	talloc_steal(conn, trans);
 	talloc_set_destructor(trans, destroy_transaction);
 	conn->transaction_started++;
+	nr_open++;
 
 	snprintf(id_str, sizeof(id_str), "%u", trans->id);
 	send_reply(conn, XS_TRANSACTION_START, id_str, strlen(id_str)+1);
@@ -209,17 +438,18 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	talloc_steal(arg, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation) {
+		if (trans->fail) {
+			send_error(conn, ENOMEM);
+			return;
+		}
+		if (transaction_conflicts(trans)) {
 			send_error(conn, EAGAIN);
 			return;
 		}
-		if (!replace_tdb(trans->tdb_name, trans->tdb)) {
-			send_error(conn, errno);
+		if (!finalize_transaction(conn, trans)) {
+			send_error(conn, EIO);
 			return;
 		}
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
 
 		/* fix domain entry for each changed domain */
 		list_for_each_entry(d, &trans->changed_domains, list)
@@ -228,7 +458,6 @@ void do_transaction_end(struct connection *conn, const char *arg)
 		/* Fire off the watches for everything that changed. */
 		list_for_each_entry(i, &trans->changes, list)
 			fire_watches(conn, i->node, i->recurse);
-		generation++;
 	}
 	send_ack(conn, XS_TRANSACTION_END);
 }
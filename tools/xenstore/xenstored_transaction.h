@@ -22,6 +22,12 @@
 
 struct transaction;
 
+enum node_access_type {
+	NODE_ACCESS_READ,
+	NODE_ACCESS_WRITE,
+	NODE_ACCESS_DELETE
+};
+
 void do_transaction_start(struct connection *conn, struct buffered_data *node);
 void do_transaction_end(struct connection *conn, const char *arg);
 
@@ -35,8 +41,18 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 void add_change_node(struct transaction *trans, const char *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+/* Record an access to a node by the transaction of conn, if any.  For a
+ * write or delete, key is set to the record to change: NULL if there is
+ * nothing to delete.  Returns -1 if the access could not be recorded. */
+int access_node(struct connection *conn, const struct node *node,
+		enum node_access_type type, TDB_DATA *key);
+
+/* Set key to the record to read the named node from for conn. */
+void transaction_prepend(struct connection *conn, const char *name,
+			 TDB_DATA *key);
+
+/* Number of transactions in progress on all connections. */
+unsigned int transactions_open(void);
 
 void conn_delete_all_transactions(struct connection *conn);
 
@@ -24,8 +24,10 @@
 #include <sys/time.h>
 #include <time.h>
 #include <assert.h>
+#include <string.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
@@ -33,11 +35,41 @@
 
 extern int quota_nb_watch_per_domain;
 
+/*
+ * All watches are indexed by path, so firing only visits the watches on
+ * the changed node, its ancestors and (for rm) its descendants rather
+ * than every watch of every connection.  The index is a trie of
+ * struct watch_index, one per path that has watches or has descendants
+ * with watches, and a hashtable from path to trie node.  Special "@"
+ * paths hang off "/", which is what is_child() has always said.
+ */
+struct watch_index
+{
+	struct watch_index *parent;
+
+	/* Trie nodes directly below me. */
+	struct list_head children;
+	struct list_head sibling;
+
+	/* Watches on exactly this path. */
+	struct list_head watches;
+
+	/* Key in the hashtable, which owns (and frees) it. */
+	char *path;
+};
+
+static struct hashtable *watch_index;
+
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path, in the index. */
+	struct list_head index_list;
+	struct watch_index *index;
+	struct connection *conn;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -48,6 +80,176 @@ struct watch
 	char *node;
 };
 
+/* Strip the last element of an absolute or "@" path, in place. */
+static void parent_path(char *path)
+{
+	char *slash = strrchr(path, '/');
+
+	if (slash && slash != path)
+		*slash = '\0';
+	else
+		strcpy(path, "/");
+}
+
+static struct watch_index *index_lookup(const char *path)
+{
+	if (!watch_index)
+		return NULL;
+	return hashtable_search(watch_index, (void *)path);
+}
+
+/* Drop trie nodes which no longer lead to any watch. */
+static void index_put(struct watch_index *idx)
+{
+	struct watch_index *parent;
+
+	while (idx && list_empty(&idx->watches) &&
+	       list_empty(&idx->children)) {
+		parent = idx->parent;
+		if (parent)
+			list_del(&idx->sibling);
+		hashtable_remove(watch_index, idx->path);
+		talloc_free(idx);
+		idx = parent;
+	}
+}
+
+/* Find or create the trie node for path.  If it fails, returns NULL. */
+static struct watch_index *index_get(const char *path)
+{
+	struct watch_index *idx, *parent = NULL;
+	char *ppath;
+
+	idx = index_lookup(path);
+	if (idx)
+		return idx;
+
+	if (!watch_index) {
+		watch_index = create_hashtable(64, hash_from_key_fn,
+					       keys_equal_fn);
+		if (!watch_index)
+			return NULL;
+	}
+
+	if (!streq(path, "/")) {
+		ppath = talloc_strdup(NULL, path);
+		if (!ppath)
+			return NULL;
+		parent_path(ppath);
+		parent = index_get(ppath);
+		talloc_free(ppath);
+		if (!parent)
+			return NULL;
+	}
+
+	idx = talloc(parent, struct watch_index);
+	if (!idx)
+		goto fail;
+	idx->path = strdup(path);
+	if (!idx->path)
+		goto fail;
+	if (!hashtable_insert(watch_index, idx->path, idx)) {
+		free(idx->path);
+		goto fail;
+	}
+
+	idx->parent = parent;
+	INIT_LIST_HEAD(&idx->children);
+	INIT_LIST_HEAD(&idx->watches);
+	if (parent)
+		list_add_tail(&idx->sibling, &parent->children);
+	return idx;
+
+ fail:
+	talloc_free(idx);
+	index_put(parent);
+	return NULL;
+}
+
+/*
+ * Watch events queued on a connection which it has not started to write,
+ * keyed by their node\0token\0 payload.  Watch events only say "look
+ * again", so a burst of changes to one node produces one event per watch
+ * until the connection starts writing it.  The key points into the queued
+ * message's buffer; the entry is removed before that is written or freed.
+ */
+struct event_key {
+	unsigned int len;
+	const char *data;
+};
+
+static unsigned int event_hash(void *k)
+{
+	struct event_key *key = k;
+	unsigned int hash = 5381;
+	unsigned int i;
+
+	for (i = 0; i < key->len; i++)
+		hash = ((hash << 5) + hash) + (unsigned int)key->data[i];
+
+	return hash;
+}
+
+static int event_equal(void *k1, void *k2)
+{
+	struct event_key *key1 = k1, *key2 = k2;
+
+	return key1->len == key2->len &&
+		memcmp(key1->data, key2->data, key1->len) == 0;
+}
+
+static void queue_event(struct connection *conn, const char *data,
+			unsigned int len)
+{
+	struct event_key lookup = { len, data }, *key;
+	struct buffered_data *out;
+
+	if (conn->events && hashtable_search(conn->events, &lookup))
+		return;
+
+	send_reply(conn, XS_WATCH_EVENT, data, len);
+
+	/* send_reply() may have queued an error instead. */
+	out = list_entry(conn->out_list.prev, struct buffered_data, list);
+	if (out->hdr.msg.type != XS_WATCH_EVENT)
+		return;
+
+	if (!conn->events) {
+		conn->events = create_hashtable(16, event_hash, event_equal);
+		if (!conn->events)
+			return;
+	}
+
+	/* If we can't track it, we just don't merge later copies. */
+	key = malloc(sizeof(*key));
+	if (!key)
+		return;
+	key->len = out->hdr.msg.len;
+	key->data = out->buffer;
+	if (!hashtable_insert(conn->events, key, out))
+		free(key);
+}
+
+void conn_event_sending(struct connection *conn, struct buffered_data *out)
+{
+	struct event_key lookup;
+
+	if (!conn->events || out->hdr.msg.type != XS_WATCH_EVENT)
+		return;
+
+	lookup.len = out->hdr.msg.len;
+	lookup.data = out->buffer;
+	if (hashtable_search(conn->events, &lookup) == out)
+		hashtable_remove(conn->events, &lookup);
+}
+
+void conn_delete_all_events(struct connection *conn)
+{
+	if (conn->events)
+		hashtable_destroy(conn->events, 0);
+	conn->events = NULL;
+}
+
 static void add_event(struct connection *conn,
 		      struct watch *watch,
 		      const char *name)
@@ -82,33 +284,63 @@ static void add_event(struct connection *conn,
 	data = talloc_array(watch, char, len);
 	strcpy(data, name);
 	strcpy(data + strlen(name) + 1, watch->token);
-	send_reply(conn, XS_WATCH_EVENT, data, len);
+	queue_event(conn, data, len);
 	talloc_free(data);
 }
 
+/* Fire every watch below idx (for rm), on the watched node itself. */
+static void fire_descendants(struct watch_index *idx)
+{
+	struct watch_index *child;
+	struct watch *watch;
+
+	list_for_each_entry(child, &idx->children, sibling) {
+		list_for_each_entry(watch, &child->watches, index_list)
+			add_event(watch->conn, watch, watch->node);
+		fire_descendants(child);
+	}
+}
+
 void fire_watches(struct connection *conn, const char *name, bool recurse)
 {
-	struct connection *i;
+	struct watch_index *idx;
 	struct watch *watch;
+	char *path;
 
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, watch, watch->node);
-		}
+	if (!watch_index)
+		return;
+
+	/* Watches on the node and on each of its ancestors. */
+	path = talloc_strdup(NULL, name);
+	for (;;) {
+		idx = index_lookup(path);
+		if (idx)
+			list_for_each_entry(watch, &idx->watches, index_list)
+				add_event(watch->conn, watch, name);
+		if (streq(path, "/"))
+			break;
+		parent_path(path);
+	}
+	talloc_free(path);
+
+	if (recurse) {
+		idx = index_lookup(name);
+		if (idx)
+			fire_descendants(idx);
 	}
 }
 
 static int destroy_watch(void *_watch)
 {
+	struct watch *watch = _watch;
+
 	trace_destroy(_watch, "watch");
+	list_del(&watch->index_list);
+	index_put(watch->index);
 	return 0;
 }
 
@@ -154,6 +386,13 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 	}
 
 	watch = talloc(conn, struct watch);
+	watch->index = index_get(vec[0]);
+	if (!watch->index) {
+		talloc_free(watch);
+		send_error(conn, ENOMEM);
+		return;
+	}
+	watch->conn = conn;
 	watch->node = talloc_strdup(watch, vec[0]);
 	watch->token = talloc_strdup(watch, vec[1]);
 	if (relative)
@@ -165,6 +404,7 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->index_list, &watch->index->watches);
 	trace_create(watch, "watch");
 	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
@@ -32,4 +32,8 @@ void dump_watches(struct connection *conn);
 
 void conn_delete_all_watches(struct connection *conn);
 
+/* Called as conn starts writing out, so later events are queued again. */
+void conn_event_sending(struct connection *conn, struct buffered_data *out);
+void conn_delete_all_events(struct connection *conn);
+
 #endif /* _XENSTORED_WATCH_H */
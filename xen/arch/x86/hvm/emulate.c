@@ -1138,6 +1138,42 @@ static const struct x86_emulate_ops hvm_emulate_ops = {
     .invlpg        = hvmemul_invlpg
 };
 
+/*
+ * Emulate the instruction in @hvmemul_ctxt->insn_buf, replaying a cached
+ * decode if this site recently emulated the very same simple MOV.
+ */
+static int hvmemul_emulate_cached(
+    struct hvm_emulate_ctxt *hvmemul_ctxt, struct hvm_vcpu_io *vio)
+{
+    unsigned long eip = hvmemul_ctxt->ctxt.regs->eip;
+    struct hvm_mmio_insn_cache *ent =
+        &vio->mmio_insn_cache[(eip ^ (eip >> 4)) &
+                              (HVM_MMIO_INSN_CACHE_SIZE - 1)];
+    struct x86_emulate_mov mov;
+
+    BUILD_BUG_ON(HVM_MMIO_INSN_CACHE_SIZE & (HVM_MMIO_INSN_CACHE_SIZE - 1));
+
+    if ( ent->mov.len && ent->eip == eip &&
+         ent->addr_size == hvmemul_ctxt->ctxt.addr_size &&
+         ent->mov.len <= hvmemul_ctxt->insn_buf_bytes &&
+         !memcmp(ent->insn, hvmemul_ctxt->insn_buf, ent->mov.len) )
+        return x86_emulate_mov(&ent->mov, &hvmemul_ctxt->ctxt,
+                               &hvm_emulate_ops);
+
+    if ( x86_decode_mov(&mov, hvmemul_ctxt->insn_buf,
+                        hvmemul_ctxt->insn_buf_bytes,
+                        &hvmemul_ctxt->ctxt) != X86EMUL_OKAY )
+        return x86_emulate(&hvmemul_ctxt->ctxt, &hvm_emulate_ops);
+
+    BUILD_BUG_ON(sizeof(ent->insn) < 15);
+    ent->eip = eip;
+    ent->addr_size = hvmemul_ctxt->ctxt.addr_size;
+    memcpy(ent->insn, hvmemul_ctxt->insn_buf, mov.len);
+    ent->mov = mov;
+
+    return x86_emulate_mov(&ent->mov, &hvmemul_ctxt->ctxt, &hvm_emulate_ops);
+}
+
 int hvm_emulate_one(
     struct hvm_emulate_ctxt *hvmemul_ctxt)
 {
@@ -1191,7 +1227,7 @@ int hvm_emulate_one(
     vio->mmio_retrying = vio->mmio_retry;
     vio->mmio_retry = 0;
 
-    rc = x86_emulate(&hvmemul_ctxt->ctxt, &hvm_emulate_ops);
+    rc = hvmemul_emulate_cached(hvmemul_ctxt, vio);
 
     if ( rc == X86EMUL_OKAY && vio->mmio_retry )
         rc = X86EMUL_RETRY;
@@ -954,7 +954,7 @@ static void hvm_ioreq_server_disable(struct hvm_ioreq_server *s,
 
 static int hvm_ioreq_server_init(struct hvm_ioreq_server *s, struct domain *d,
                                  domid_t domid, bool_t is_default,
-                                 bool_t handle_bufioreq, ioservid_t id)
+                                 int bufioreq_handling, ioservid_t id)
 {
     struct vcpu *v;
     int rc;
@@ -966,12 +966,14 @@ static int hvm_ioreq_server_init(struct hvm_ioreq_server *s, struct domain *d,
     spin_lock_init(&s->lock);
     INIT_LIST_HEAD(&s->ioreq_vcpu_list);
     spin_lock_init(&s->bufioreq_lock);
+    s->bufioreq_polled = (bufioreq_handling == HVM_IOREQSRV_BUFIOREQ_POLLED);
 
     rc = hvm_ioreq_server_alloc_rangesets(s, is_default);
     if ( rc )
         goto fail1;
 
-    rc = hvm_ioreq_server_map_pages(s, is_default, handle_bufioreq);
+    rc = hvm_ioreq_server_map_pages(
+             s, is_default, bufioreq_handling != HVM_IOREQSRV_BUFIOREQ_OFF);
     if ( rc )
         goto fail2;
 
@@ -1031,12 +1033,22 @@ static ioservid_t next_ioservid(struct domain *d)
 }
 
 static int hvm_create_ioreq_server(struct domain *d, domid_t domid,
-                                   bool_t is_default, bool_t handle_bufioreq,
+                                   bool_t is_default, int bufioreq_handling,
                                    ioservid_t *id)
 {
     struct hvm_ioreq_server *s;
     int rc;
 
+    switch ( bufioreq_handling )
+    {
+    case HVM_IOREQSRV_BUFIOREQ_OFF:
+    case HVM_IOREQSRV_BUFIOREQ_LEGACY:
+    case HVM_IOREQSRV_BUFIOREQ_POLLED:
+        break;
+    default:
+        return -EINVAL;
+    }
+
     rc = -ENOMEM;
     s = xzalloc(struct hvm_ioreq_server);
     if ( !s )
@@ -1049,7 +1061,7 @@ static int hvm_create_ioreq_server(struct domain *d, domid_t domid,
     if ( is_default && d->arch.hvm_domain.default_ioreq_server != NULL )
         goto fail2;
 
-    rc = hvm_ioreq_server_init(s, d, domid, is_default, handle_bufioreq,
+    rc = hvm_ioreq_server_init(s, d, domid, is_default, bufioreq_handling,
                                next_ioservid(d));
     if ( rc )
         goto fail3;
@@ -1513,6 +1525,13 @@ int hvm_domain_initialise(struct domain *d)
     if ( rc != 0 )
         goto fail1;
 
+    rc = vlapic_domain_init(d);
+    if ( rc != 0 )
+    {
+        vioapic_deinit(d);
+        goto fail1;
+    }
+
     stdvga_init(d);
 
     rtc_init(d);
@@ -1529,6 +1548,7 @@ int hvm_domain_initialise(struct domain *d)
  fail2:
     rtc_deinit(d);
     stdvga_deinit(d);
+    vlapic_domain_destroy(d);
     vioapic_deinit(d);
  fail1:
     xfree(d->arch.hvm_domain.io_handler);
@@ -1572,6 +1592,7 @@ void hvm_domain_destroy(struct domain *d)
     hvm_funcs.domain_destroy(d);
     rtc_deinit(d);
     stdvga_deinit(d);
+    vlapic_domain_destroy(d);
     vioapic_deinit(d);
 }
 
@@ -2481,6 +2502,8 @@ int hvm_buffered_io_send(ioreq_t *p)
                        .dir = p->dir };
     /* Timeoffset sends 64b data, but no address. Use two consecutive slots. */
     int qw = 0;
+    long step;
+    unsigned int i, n, wp;
 
     /* Ensure buffered_iopage fits in a page */
     BUILD_BUG_ON(sizeof(buffered_iopage_t) > PAGE_SIZE);
@@ -2497,12 +2520,18 @@ int hvm_buffered_io_send(ioreq_t *p)
     /*
      * Return 0 for the cases we can't deal with:
      *  - 'addr' is only a 20-bit field, so we cannot address beyond 1MB
-     *  - we cannot buffer accesses to guest memory buffers, as the guest
+     *  - we cannot buffer reads into guest memory buffers, as the guest
      *    may expect the memory buffer to be synchronously accessed
      *  - the count field is usually used with data_is_ptr and since we don't
      *    support data_is_ptr we do not waste space for the count field either
+     * Repeated writes (REP MOVS/STOS to VGA memory, say) are instead split
+     * into one slot per repetition, with the data read from guest memory
+     * now, and published as a single batch.  The batch is all or nothing:
+     * callers such as stdvga have already applied every repetition locally,
+     * so the request must never be partially queued and then re-issued.
      */
-    if ( (p->addr > 0xffffful) || p->data_is_ptr || (p->count != 1) )
+    if ( (p->addr > 0xffffful) || !p->count ||
+         ((p->data_is_ptr || (p->count != 1)) && (p->dir != IOREQ_WRITE)) )
         return 0;
 
     switch ( p->size )
@@ -2525,29 +2554,70 @@ int hvm_buffered_io_send(ioreq_t *p)
         return 0;
     }
 
+    step = p->df ? -(long)p->size : (long)p->size;
+
     spin_lock(&s->bufioreq_lock);
 
-    if ( (pg->write_pointer - pg->read_pointer) >=
-         (IOREQ_BUFFER_SLOT_NUM - qw) )
+    n = (IOREQ_BUFFER_SLOT_NUM - (pg->write_pointer - pg->read_pointer)) >>
+        qw;
+    if ( n < p->count )
     {
         /* The queue is full: send the iopacket through the normal path. */
         spin_unlock(&s->bufioreq_lock);
         return 0;
     }
+    n = p->count;
 
-    pg->buf_ioreq[pg->write_pointer % IOREQ_BUFFER_SLOT_NUM] = bp;
+    for ( i = 0, wp = pg->write_pointer; i < n; i++ )
+    {
+        paddr_t addr = p->addr + i * step;
+        uint64_t data = p->data;
+
+        if ( addr > 0xffffful )
+            break;
 
-    if ( qw )
+        if ( p->data_is_ptr )
+        {
+            data = 0;
+            if ( hvm_copy_from_guest_phys(&data, p->data + i * step,
+                                          p->size) != HVMCOPY_okay )
+                break;
+        }
+
+        bp.addr = addr;
+        bp.data = data;
+        pg->buf_ioreq[wp++ % IOREQ_BUFFER_SLOT_NUM] = bp;
+
+        if ( qw )
+        {
+            bp.data = data >> 32;
+            pg->buf_ioreq[wp++ % IOREQ_BUFFER_SLOT_NUM] = bp;
+        }
+    }
+
+    if ( i < n )
     {
-        bp.data = p->data >> 32;
-        pg->buf_ioreq[(pg->write_pointer+1) % IOREQ_BUFFER_SLOT_NUM] = bp;
+        /* Nothing has been published yet: use the normal path instead. */
+        spin_unlock(&s->bufioreq_lock);
+        return 0;
     }
 
-    /* Make the ioreq_t visible /before/ write_pointer. */
+    /* Make the ioreq_t-s visible /before/ write_pointer. */
     wmb();
-    pg->write_pointer += qw ? 2 : 1;
+    pg->write_pointer = wp;
 
-    notify_via_xen_event_channel(d, s->bufioreq_evtchn);
+    if ( s->bufioreq_polled )
+    {
+        /*
+         * The emulator only keeps the port masked while draining the ring,
+         * and re-scans it after unmasking: order the write_pointer update
+         * against the mask check so that it can't miss this batch.
+         */
+        smp_mb();
+        notify_via_xen_event_channel_unmasked(d, s->bufioreq_evtchn);
+    }
+    else
+        notify_via_xen_event_channel(d, s->bufioreq_evtchn);
     spin_unlock(&s->bufioreq_lock);
 
     return 1;
@@ -5283,7 +5353,7 @@ static int hvmop_create_ioreq_server(
         goto out;
 
     rc = hvm_create_ioreq_server(d, curr_d->domain_id, 0,
-                                 !!op.handle_bufioreq, &op.id);
+                                 op.handle_bufioreq, &op.id);
     if ( rc != 0 )
         goto out;
 
@@ -5717,7 +5787,9 @@ long do_hvm_op(unsigned long op, XEN_GUEST_HANDLE_PARAM(void) arg)
                 
                 /* May need to create server */
                 domid = d->arch.hvm_domain.params[HVM_PARAM_DM_DOMAIN];
-                rc = hvm_create_ioreq_server(d, domid, 1, 1, NULL);
+                rc = hvm_create_ioreq_server(d, domid, 1,
+                                             HVM_IOREQSRV_BUFIOREQ_LEGACY,
+                                             NULL);
                 if ( rc != 0 && rc != -EEXIST )
                     goto param_fail;
                 /*FALLTHRU*/
@@ -38,6 +38,7 @@
 #include <asm/hvm/support.h>
 #include <asm/hvm/vmx/vmx.h>
 #include <asm/hvm/nestedhvm.h>
+#include <public/hvm/hvm_info_table.h>
 #include <public/hvm/ioreq.h>
 #include <public/hvm/params.h>
 
@@ -238,6 +239,127 @@ bool_t vlapic_match_dest(
     return 0;
 }
 
+/*
+ * Domain-wide cache of the VCPUs matched by each no-shorthand destination,
+ * so that a multicast IPI need not evaluate vlapic_match_dest() against
+ * every VCPU. It is rebuilt on first use after any change to a VCPU's APIC
+ * ID, LDR, DFR or x2APIC mode. Readers do not take @lock: they retry via
+ * the slow path if @seq changed (or was odd, i.e. a rebuild was underway).
+ */
+struct vlapic_dest_map {
+    spinlock_t   lock;
+    unsigned int seq;
+#define VLAPIC_DEST_MAP_STALE    0
+#define VLAPIC_DEST_MAP_VALID    1
+#define VLAPIC_DEST_MAP_UNUSABLE 2 /* Bad DFR somewhere: use slow path. */
+    unsigned int state;
+    /* Indexed by [dest_mode][dest]. */
+    unsigned long vcpus[2][256][BITS_TO_LONGS(HVM_MAX_VCPUS)];
+};
+
+static void vlapic_dest_map_invalidate(struct domain *d)
+{
+    struct vlapic_dest_map *map = d->arch.hvm_domain.vlapic_dest_map;
+
+    if ( map == NULL )
+        return;
+
+    spin_lock(&map->lock);
+    map->state = VLAPIC_DEST_MAP_STALE;
+    map->seq += 2;
+    spin_unlock(&map->lock);
+}
+
+static void vlapic_dest_map_build(struct domain *d,
+                                  struct vlapic_dest_map *map)
+{
+    struct vcpu *v;
+    struct vlapic *vlapic;
+    unsigned int dest_mode, dest;
+
+    spin_lock(&map->lock);
+
+    if ( map->state == VLAPIC_DEST_MAP_STALE )
+    {
+        map->seq++;
+        smp_wmb();
+
+        memset(map->vcpus, 0, sizeof(map->vcpus));
+        map->state = VLAPIC_DEST_MAP_VALID;
+
+        for_each_vcpu ( d, v )
+        {
+            vlapic = vcpu_vlapic(v);
+            if ( (v->vcpu_id >= HVM_MAX_VCPUS) ||
+                 (!vlapic_x2apic_mode(vlapic) &&
+                  (vlapic_get_reg(vlapic, APIC_DFR) != APIC_DFR_FLAT) &&
+                  (vlapic_get_reg(vlapic, APIC_DFR) != APIC_DFR_CLUSTER)) )
+            {
+                map->state = VLAPIC_DEST_MAP_UNUSABLE;
+                break;
+            }
+
+            for ( dest_mode = 0; dest_mode < 2; dest_mode++ )
+                for ( dest = 0; dest < 256; dest++ )
+                    if ( vlapic_match_dest(vlapic, NULL, APIC_DEST_NOSHORT,
+                                           dest, dest_mode) )
+                        __set_bit(v->vcpu_id, map->vcpus[dest_mode][dest]);
+        }
+
+        smp_wmb();
+        map->seq++;
+    }
+
+    spin_unlock(&map->lock);
+}
+
+/*
+ * Fill @targets with the VCPUs of @d matched by a no-shorthand destination.
+ * Returns 0 if the caller has to fall back to vlapic_match_dest().
+ */
+static bool_t vlapic_dest_map_lookup(
+    struct domain *d, uint8_t dest, unsigned int dest_mode,
+    unsigned long *targets)
+{
+    struct vlapic_dest_map *map = d->arch.hvm_domain.vlapic_dest_map;
+    unsigned int seq;
+
+    if ( map == NULL )
+        return 0;
+
+    if ( read_atomic(&map->state) == VLAPIC_DEST_MAP_STALE )
+        vlapic_dest_map_build(d, map);
+
+    seq = read_atomic(&map->seq);
+    smp_rmb();
+    if ( (seq & 1) || (map->state != VLAPIC_DEST_MAP_VALID) )
+        return 0;
+
+    bitmap_copy(targets, map->vcpus[dest_mode][dest], HVM_MAX_VCPUS);
+
+    smp_rmb();
+    return read_atomic(&map->seq) == seq;
+}
+
+int vlapic_domain_init(struct domain *d)
+{
+    struct vlapic_dest_map *map = xzalloc(struct vlapic_dest_map);
+
+    if ( map == NULL )
+        return -ENOMEM;
+
+    spin_lock_init(&map->lock);
+    d->arch.hvm_domain.vlapic_dest_map = map;
+
+    return 0;
+}
+
+void vlapic_domain_destroy(struct domain *d)
+{
+    xfree(d->arch.hvm_domain.vlapic_dest_map);
+    d->arch.hvm_domain.vlapic_dest_map = NULL;
+}
+
 static void vlapic_init_sipi_one(struct vcpu *target, uint32_t icr)
 {
     vcpu_pause(target);
@@ -446,13 +568,34 @@ void vlapic_ipi(
     }
 
     default: {
+        struct domain *d = vlapic_domain(vlapic);
         struct vcpu *v;
-        for_each_vcpu ( vlapic_domain(vlapic), v )
+        DECLARE_BITMAP(targets, HVM_MAX_VCPUS);
+        unsigned int id;
+
+        /*
+         * Mark the vector pending in all targets first, then interrupt
+         * each pCPU running one of them at most once.
+         */
+        cpu_raise_softirq_batch_begin();
+
+        if ( (short_hand == APIC_DEST_NOSHORT) &&
+             vlapic_dest_map_lookup(d, dest, dest_mode, targets) )
         {
-            if ( vlapic_match_dest(vcpu_vlapic(v), vlapic,
-                                   short_hand, dest, dest_mode) )
-                vlapic_accept_irq(v, icr_low);
+            for_each_set_bit ( id, targets, HVM_MAX_VCPUS )
+                vlapic_accept_irq(d->vcpu[id], icr_low);
         }
+        else
+        {
+            for_each_vcpu ( d, v )
+            {
+                if ( vlapic_match_dest(vcpu_vlapic(v), vlapic,
+                                       short_hand, dest, dest_mode) )
+                    vlapic_accept_irq(v, icr_low);
+            }
+        }
+
+        cpu_raise_softirq_batch_finish();
         break;
     }
     }
@@ -631,7 +774,10 @@ static int vlapic_reg_write(struct vcpu *v,
     {
     case APIC_ID:
         if ( !vlapic_x2apic_mode(vlapic) )
+        {
             vlapic_set_reg(vlapic, APIC_ID, val);
+            vlapic_dest_map_invalidate(v->domain);
+        }
         else
             rc = X86EMUL_UNHANDLEABLE;
         break;
@@ -646,14 +792,20 @@ static int vlapic_reg_write(struct vcpu *v,
 
     case APIC_LDR:
         if ( !vlapic_x2apic_mode(vlapic) )
+        {
             vlapic_set_reg(vlapic, APIC_LDR, val & APIC_LDR_MASK);
+            vlapic_dest_map_invalidate(v->domain);
+        }
         else
             rc = X86EMUL_UNHANDLEABLE;
         break;
 
     case APIC_DFR:
         if ( !vlapic_x2apic_mode(vlapic) )
+        {
             vlapic_set_reg(vlapic, APIC_DFR, val | 0x0FFFFFFF);
+            vlapic_dest_map_invalidate(v->domain);
+        }
         else
             rc = X86EMUL_UNHANDLEABLE;
         break;
@@ -919,6 +1071,8 @@ void vlapic_msr_set(struct vlapic *vlapic, uint64_t value)
         vlapic_set_reg(vlapic, APIC_LDR, ldr);
     }
 
+    vlapic_dest_map_invalidate(vlapic_domain(vlapic));
+
     vmx_vlapic_msr_changed(vlapic_vcpu(vlapic));
 
     HVM_DBG_LOG(DBG_LEVEL_VLAPIC,
@@ -1115,6 +1269,8 @@ void vlapic_reset(struct vlapic *vlapic)
 
     vlapic_set_reg(vlapic, APIC_DFR, 0xffffffffU);
 
+    vlapic_dest_map_invalidate(v->domain);
+
     for ( i = 0; i < VLAPIC_LVT_NUM; i++ )
         vlapic_set_reg(vlapic, APIC_LVTT + 0x10 * i, APIC_LVT_MASKED);
 
@@ -1206,6 +1362,8 @@ static int lapic_load_hidden(struct domain *d, hvm_domain_context_t *h)
     if ( hvm_load_entry_zeroextend(LAPIC, h, &s->hw) != 0 ) 
         return -EINVAL;
 
+    vlapic_dest_map_invalidate(d);
+
     vmx_vlapic_msr_changed(v);
 
     return 0;
@@ -1230,6 +1388,8 @@ static int lapic_load_regs(struct domain *d, hvm_domain_context_t *h)
     if ( hvm_load_entry(LAPIC_REGS, h, s->regs) != 0 ) 
         return -EINVAL;
 
+    vlapic_dest_map_invalidate(d);
+
     if ( hvm_funcs.process_isr )
         hvm_funcs.process_isr(vlapic_find_highest_isr(s), v);
 
@@ -1281,6 +1441,9 @@ int vlapic_init(struct vcpu *v)
     if ( v->vcpu_id == 0 )
         vlapic->hw.apic_base_msr |= MSR_IA32_APICBASE_BSP;
 
+    /* A new VCPU may match existing destinations. */
+    vlapic_dest_map_invalidate(v->domain);
+
     tasklet_init(&vlapic->init_sipi.tasklet,
                  vlapic_init_sipi_action,
                  (unsigned long)v);
@@ -27,6 +27,16 @@
 #define mode_is(d, name) \
     ((d)->arch.hvm_domain.params[HVM_PARAM_TIMER_MODE] == HVMPTM_##name)
 
+/*
+ * Guests which drop missed ticks can take them a little late. Coalesced mode
+ * aligns their ticks and gives them enough timer slack to be batched with
+ * other expiries on the same pCPU, and does not wake a pCPU just to mark a
+ * tick pending for a preempted VCPU: it gets the tick when it next runs.
+ */
+#define pt_coalesce(d) \
+    ((d)->arch.hvm_domain.params[HVM_PARAM_VPT_COALESCE] && \
+     mode_is(d, no_missed_ticks_pending))
+
 void hvm_init_guest_time(struct domain *d)
 {
     struct pl_time *pl = &d->arch.hvm_domain.pl_time;
@@ -178,6 +188,7 @@ void pt_save_timer(struct vcpu *v)
 {
     struct list_head *head = &v->arch.hvm_vcpu.tm_list;
     struct periodic_time *pt;
+    bool_t coalesce = pt_coalesce(v->domain);
 
     if ( test_bit(_VPF_blocked, &v->pause_flags) )
         return;
@@ -185,7 +196,7 @@ void pt_save_timer(struct vcpu *v)
     spin_lock(&v->arch.hvm_vcpu.tm_lock);
 
     list_for_each_entry ( pt, head, list )
-        if ( !pt->do_not_freeze )
+        if ( !pt->do_not_freeze || coalesce )
             stop_timer(&pt->timer);
 
     pt_freeze_time(v);
@@ -197,6 +208,7 @@ void pt_restore_timer(struct vcpu *v)
 {
     struct list_head *head = &v->arch.hvm_vcpu.tm_list;
     struct periodic_time *pt;
+    bool_t coalesce = pt_coalesce(v->domain);
 
     spin_lock(&v->arch.hvm_vcpu.tm_lock);
 
@@ -204,6 +216,18 @@ void pt_restore_timer(struct vcpu *v)
     {
         if ( pt->pending_intr_nr == 0 )
         {
+            /*
+             * A tick which would have been marked pending while we were
+             * preempted: pt_timer_fn() was not left running to do it.
+             */
+            if ( coalesce && pt->do_not_freeze && (pt->scheduled <= NOW()) )
+            {
+                pt->pending_intr_nr = 1;
+                pt->scheduled += pt->period;
+                pt->do_not_freeze = 0;
+                continue;
+            }
+
             pt_process_missed_ticks(pt);
             set_timer(&pt->timer, pt->scheduled);
         }
@@ -415,7 +439,8 @@ void create_periodic_time(
 
     if ( !pt->one_shot )
     {
-        if ( v->domain->arch.hvm_domain.params[HVM_PARAM_VPT_ALIGN] )
+        if ( v->domain->arch.hvm_domain.params[HVM_PARAM_VPT_ALIGN] ||
+             pt_coalesce(v->domain) )
         {
             pt->scheduled = align_timer(pt->scheduled, pt->period);
         }
@@ -438,6 +463,11 @@ void create_periodic_time(
     list_add(&pt->list, &v->arch.hvm_vcpu.tm_list);
 
     init_timer(&pt->timer, pt_timer_fn, pt, v->processor);
+    /* Missed-tick accounting copes with periodic ticks arriving a bit late. */
+    if ( !pt->one_shot )
+        set_timer_slack(&pt->timer, pt_coalesce(v->domain)
+                        ? min_t(uint64_t, pt->period >> 2, MILLISECS(4))
+                        : min_t(uint64_t, pt->period >> 4, MICROSECS(100)));
     set_timer(&pt->timer, pt->scheduled);
 
     spin_unlock(&v->arch.hvm_vcpu.tm_lock);
@@ -185,6 +185,17 @@ out:
  * NB: Domain that having device assigned should not set log_global. Because
  * there is no way to track the memory updating from device.
  */
+/*
+ * Make guest writes to pages just made log-dirty fault.  A p2m with its own
+ * flush hook (EPT) has already invalidated the guest's mappings on every
+ * CPU it ran on, so a second round of IPIs is only needed otherwise.
+ */
+static void hap_flush_logdirty(struct domain *d)
+{
+    if ( !p2m_get_hostp2m(d)->tlb_flush )
+        flush_tlb_mask(d->domain_dirty_cpumask);
+}
+
 static int hap_enable_log_dirty(struct domain *d, bool_t log_global)
 {
     /* turn on PG_log_dirty bit in paging mode */
@@ -196,7 +207,7 @@ static int hap_enable_log_dirty(struct domain *d, bool_t log_global)
     {
         /* set l1e entries of P2M table to be read-only. */
         p2m_change_entry_type_global(d, p2m_ram_rw, p2m_ram_logdirty);
-        flush_tlb_mask(d->domain_dirty_cpumask);
+        hap_flush_logdirty(d);
     }
     return 0;
 }
@@ -216,7 +227,7 @@ static void hap_clean_dirty_bitmap(struct domain *d)
 {
     /* set l1e entries of P2M table to be read-only. */
     p2m_change_entry_type_global(d, p2m_ram_rw, p2m_ram_logdirty);
-    flush_tlb_mask(d->domain_dirty_cpumask);
+    hap_flush_logdirty(d);
 }
 
 void hap_logdirty_init(struct domain *d)
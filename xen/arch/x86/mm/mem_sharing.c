@@ -33,6 +33,8 @@
 #include <asm/mem_event.h>
 #include <asm/atomic.h>
 #include <xen/rcupdate.h>
+#include <xen/tasklet.h>
+#include <xen/timer.h>
 #include <asm/event.h>
 #include <xsm/xsm.h>
 
@@ -1518,6 +1520,317 @@ int mem_sharing_domctl(struct domain *d, xen_domctl_mem_sharing_op_t *mec)
     return rc;
 }
 
+/*
+ * Background sharing scanner.
+ *
+ * Rather than relying on the toolstack to nominate and pair up candidate
+ * pages, Xen can walk the memory of sharing-enabled domains itself.  Each
+ * page is hashed and looked up in a host-wide content index; on a hash hit
+ * the two pages are compared in full, nominated, compared again now that
+ * both are read-only, and shared.  The index is a direct-mapped table, so
+ * memory use is bounded and a collision simply replaces the older entry.
+ *
+ * The scanner is off unless mem_sharing_scan=<pages> is given on the
+ * command line, in which case that many pages are looked at every
+ * SHR_SCAN_PERIOD, or four times as many when the host is short of free
+ * memory.  The tasklet gives way to pending softirqs and picks up the rest
+ * of its budget on its next run.  All scanner state is only touched from
+ * the tasklet, which never runs concurrently with itself, so needs no
+ * locking of its own.
+ */
+static unsigned int __read_mostly opt_shr_scan_pages;
+integer_param("mem_sharing_scan", opt_shr_scan_pages);
+
+#define SHR_SCAN_PERIOD       MILLISECS(100)
+#define SHR_SCAN_INDEX_ORDER  16
+#define SHR_SCAN_INDEX_SIZE   (1UL << SHR_SCAN_INDEX_ORDER)
+
+struct shr_scan_slot {
+    uint64_t      hash;
+    unsigned long gfn;
+    domid_t       domain;
+};
+
+static struct shr_scan_slot *shr_scan_index;
+static domid_t shr_scan_domain;
+static unsigned long shr_scan_gfn;
+static unsigned long shr_scan_budget;
+static struct timer shr_scan_timer;
+static struct tasklet shr_scan_tasklet;
+
+#define SHR_HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define SHR_HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define shr_rotl(x, r)  (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* xxhash64-style page hash: four independent lanes so the multiplies can
+ * overlap, folded together and avalanched at the end. */
+static uint64_t shr_page_hash(const uint64_t *p)
+{
+    uint64_t v0 = SHR_HASH_PRIME1 + SHR_HASH_PRIME2, v1 = SHR_HASH_PRIME2;
+    uint64_t v2 = 0, v3 = -SHR_HASH_PRIME1, h;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 4 )
+    {
+        v0 = shr_rotl(v0 + p[i + 0] * SHR_HASH_PRIME2, 31) * SHR_HASH_PRIME1;
+        v1 = shr_rotl(v1 + p[i + 1] * SHR_HASH_PRIME2, 31) * SHR_HASH_PRIME1;
+        v2 = shr_rotl(v2 + p[i + 2] * SHR_HASH_PRIME2, 31) * SHR_HASH_PRIME1;
+        v3 = shr_rotl(v3 + p[i + 3] * SHR_HASH_PRIME2, 31) * SHR_HASH_PRIME1;
+    }
+
+    h = shr_rotl(v0, 1) + shr_rotl(v1, 7) + shr_rotl(v2, 12) +
+        shr_rotl(v3, 18);
+    h ^= h >> 33;
+    h *= SHR_HASH_PRIME2;
+    h ^= h >> 29;
+    h *= SHR_HASH_PRIME1;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/* Compare the contents of two gfns.  Only private ram or already-shared
+ * pages qualify. */
+static int shr_scan_same(struct domain *sd, unsigned long sgfn,
+                         struct domain *cd, unsigned long cgfn)
+{
+    p2m_type_t st, ct;
+    mfn_t smfn, cmfn;
+    struct two_gfns tg;
+    void *s, *c;
+    int same = 0;
+
+    get_two_gfns(sd, sgfn, &st, NULL, &smfn, cd, cgfn, &ct, NULL, &cmfn,
+                 0, &tg);
+
+    if ( mfn_valid(smfn) && mfn_valid(cmfn) &&
+         (p2m_is_sharable(st) || p2m_is_shared(st)) &&
+         (p2m_is_sharable(ct) || p2m_is_shared(ct)) )
+    {
+        s = map_domain_page(mfn_x(smfn));
+        c = map_domain_page(mfn_x(cmfn));
+        same = !memcmp(s, c, PAGE_SIZE);
+        unmap_domain_page(c);
+        unmap_domain_page(s);
+    }
+
+    put_two_gfns(&tg);
+
+    return same;
+}
+
+static int shr_scan_is_shared(struct domain *d, unsigned long gfn)
+{
+    p2m_type_t t;
+
+    get_gfn_query(d, gfn, &t);
+    put_gfn(d, gfn);
+
+    return p2m_is_shared(t);
+}
+
+static int shr_scan_try_share(domid_t sdomid, unsigned long sgfn,
+                              struct domain *cd, unsigned long cgfn)
+{
+    struct domain *sd;
+    shr_handle_t sh, ch;
+    int s_nominated = 0, c_nominated = 0;
+    int rc = -EINVAL;
+
+    if ( (sd = rcu_lock_domain_by_id(sdomid)) == NULL )
+        return -ESRCH;
+
+    if ( sd->is_dying || !mem_sharing_enabled(sd) )
+        goto out;
+
+    /* Cheap rejection of stale index entries and hash collisions... */
+    if ( !shr_scan_same(sd, sgfn, cd, cgfn) )
+        goto out;
+
+    /* Pages which were already shared are left as they are on failure;
+     * the ones nominated here are made private again. */
+    s_nominated = !shr_scan_is_shared(sd, sgfn);
+    if ( (rc = mem_sharing_nominate_page(sd, sgfn, 0, &sh)) != 0 )
+    {
+        s_nominated = 0;
+        goto out;
+    }
+
+    c_nominated = !shr_scan_is_shared(cd, cgfn);
+    if ( (rc = mem_sharing_nominate_page(cd, cgfn, 0, &ch)) != 0 )
+    {
+        c_nominated = 0;
+        goto out;
+    }
+
+    /* ...and the real check, now that neither page can change under our
+     * feet.  A write in between will have unshared one of the pages, in
+     * which case its handle no longer matches and sharing fails safely. */
+    rc = -EINVAL;
+    if ( shr_scan_same(sd, sgfn, cd, cgfn) )
+        rc = mem_sharing_share_pages(sd, sgfn, sh, cd, cgfn, ch);
+
+out:
+    if ( rc )
+    {
+        if ( s_nominated )
+            mem_sharing_unshare_page(sd, sgfn, 0);
+        if ( c_nominated )
+            mem_sharing_unshare_page(cd, cgfn, 0);
+    }
+    rcu_unlock_domain(sd);
+    return rc;
+}
+
+static void shr_scan_page(struct domain *d, unsigned long gfn)
+{
+    struct shr_scan_slot *slot;
+    p2m_type_t t;
+    mfn_t mfn;
+    void *p;
+    uint64_t hash;
+
+    mfn = get_gfn_query(d, gfn, &t);
+    if ( !mfn_valid(mfn) || !(p2m_is_sharable(t) || p2m_is_shared(t)) )
+    {
+        put_gfn(d, gfn);
+        return;
+    }
+    p = map_domain_page(mfn_x(mfn));
+    hash = shr_page_hash(p);
+    unmap_domain_page(p);
+    put_gfn(d, gfn);
+
+    slot = &shr_scan_index[hash & (SHR_SCAN_INDEX_SIZE - 1)];
+
+    /* On a successful share the slot keeps pointing at the source page,
+     * which is now the shared one. */
+    if ( slot->domain != DOMID_INVALID && slot->hash == hash &&
+         (slot->domain != d->domain_id || slot->gfn != gfn) &&
+         shr_scan_try_share(slot->domain, slot->gfn, d, gfn) == 0 )
+        return;
+
+    slot->hash = hash;
+    slot->domain = d->domain_id;
+    slot->gfn = gfn;
+}
+
+/* Find the next sharing-enabled domain at or after the scan cursor,
+ * wrapping around once.  Returns it with a reference held. */
+static struct domain *shr_scan_next_domain(void)
+{
+    struct domain *d, *found = NULL;
+    unsigned int pass;
+
+    rcu_read_lock(&domlist_read_lock);
+    for ( pass = 0; pass < 2 && !found; pass++ )
+    {
+        for_each_domain ( d )
+        {
+            if ( d->domain_id < shr_scan_domain || d->is_dying ||
+                 !mem_sharing_enabled(d) || !get_domain(d) )
+                continue;
+            found = d;
+            break;
+        }
+        if ( !found )
+        {
+            shr_scan_domain = 0;
+            shr_scan_gfn = 0;
+        }
+    }
+    rcu_read_unlock(&domlist_read_lock);
+
+    if ( found && found->domain_id != shr_scan_domain )
+    {
+        shr_scan_domain = found->domain_id;
+        shr_scan_gfn = 0;
+    }
+
+    return found;
+}
+
+static void shr_scan_tasklet_fn(unsigned long unused)
+{
+    unsigned long max_gfn;
+    struct domain *d;
+    int preempted = 0;
+
+    if ( !shr_scan_budget )
+    {
+        shr_scan_budget = opt_shr_scan_pages;
+
+        /* Scan harder when we are running low on memory. */
+        if ( avail_domheap_pages() < total_pages / 8 )
+            shr_scan_budget *= 4;
+    }
+
+    while ( !preempted && shr_scan_budget &&
+            (d = shr_scan_next_domain()) != NULL )
+    {
+        max_gfn = domain_get_maximum_gpfn(d);
+
+        while ( shr_scan_budget && shr_scan_gfn <= max_gfn )
+        {
+            shr_scan_page(d, shr_scan_gfn++);
+            shr_scan_budget--;
+
+            if ( softirq_pending(smp_processor_id()) )
+            {
+                preempted = 1;
+                break;
+            }
+        }
+
+        if ( shr_scan_gfn > max_gfn )
+        {
+            shr_scan_domain = d->domain_id + 1;
+            shr_scan_gfn = 0;
+        }
+
+        put_domain(d);
+    }
+
+    /* Carry on where we left off once the softirqs have run. */
+    if ( preempted && shr_scan_budget )
+    {
+        tasklet_schedule(&shr_scan_tasklet);
+        return;
+    }
+
+    shr_scan_budget = 0;
+    set_timer(&shr_scan_timer, NOW() + SHR_SCAN_PERIOD);
+}
+
+static void shr_scan_timer_fn(void *unused)
+{
+    tasklet_schedule(&shr_scan_tasklet);
+}
+
+static void __init mem_sharing_scan_init(void)
+{
+    unsigned long i;
+
+    if ( !opt_shr_scan_pages )
+        return;
+
+    shr_scan_index = xmalloc_array(struct shr_scan_slot, SHR_SCAN_INDEX_SIZE);
+    if ( !shr_scan_index )
+    {
+        printk(XENLOG_WARNING "Memory sharing scanner disabled: no memory\n");
+        return;
+    }
+    for ( i = 0; i < SHR_SCAN_INDEX_SIZE; i++ )
+        shr_scan_index[i].domain = DOMID_INVALID;
+
+    tasklet_init(&shr_scan_tasklet, shr_scan_tasklet_fn, 0);
+    init_timer(&shr_scan_timer, shr_scan_timer_fn, NULL, 0);
+    set_timer(&shr_scan_timer, NOW() + SHR_SCAN_PERIOD);
+
+    printk("Memory sharing scanner: %u pages every %lums\n",
+           opt_shr_scan_pages, (unsigned long)(SHR_SCAN_PERIOD / MILLISECS(1)));
+}
+
 void __init mem_sharing_init(void)
 {
     printk("Initing memory sharing.\n");
@@ -1525,5 +1838,6 @@ void __init mem_sharing_init(void)
     spin_lock_init(&shr_audit_lock);
     INIT_LIST_HEAD(&shr_audit_list);
 #endif
+    mem_sharing_scan_init();
 }
 
@@ -590,10 +590,16 @@ bool_t ept_handle_misconfig(uint64_t gpa)
 
     p2m_lock(p2m);
 
+    /*
+     * No flush is needed: resolve_misconfig() only turns mis-configured
+     * entries, which the hardware never caches, into valid ones, after
+     * pushing the mis-configuration down to the (hence equally uncached)
+     * next level.  Flushing here used to IPI every CPU the domain ran on
+     * for each of the many misconfig exits following a type change.
+     */
     spurious = curr->arch.hvm_vmx.ept_spurious_misconfig;
     rc = resolve_misconfig(p2m, PFN_DOWN(gpa));
     curr->arch.hvm_vmx.ept_spurious_misconfig = 0;
-    ept_sync_domain(p2m);
 
     p2m_unlock(p2m);
 
@@ -618,7 +624,7 @@ ept_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
     uint8_t ipat = 0;
     int need_modify_vtd_table = 1;
     int vtd_pte_present = 0;
-    enum { sync_off, sync_on, sync_check } needs_sync = sync_check;
+    bool_t needs_sync = 1;
     ept_entry_t old_entry = { .epte = 0 };
     ept_entry_t new_entry = { .epte = 0 };
     struct ept_data *ept = &p2m->ept;
@@ -636,15 +642,13 @@ ept_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
          (order % EPT_TABLE_ORDER) )
         return -EINVAL;
 
-    /* Carry out any eventually pending earlier changes first. */
+    /*
+     * Carry out any eventually pending earlier changes first. As in
+     * ept_handle_misconfig() this by itself doesn't require a flush.
+     */
     ret = resolve_misconfig(p2m, gfn);
     if ( ret < 0 )
-    {
-        ept_sync_domain(p2m);
         return ret;
-    }
-    if ( ret > 0 )
-        needs_sync = sync_on;
 
     ASSERT((target == 2 && hvm_hap_has_1gb()) ||
            (target == 1 && hvm_hap_has_2mb()) ||
@@ -687,8 +691,8 @@ ept_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
         /* We reached the target level. */
 
         /* No need to flush if the old entry wasn't valid */
-        if ( needs_sync == sync_check && !is_epte_present(ept_entry) )
-            needs_sync = sync_off;
+        if ( !is_epte_present(ept_entry) )
+            needs_sync = 0;
 
         /* If we're replacing a non-leaf entry with a leaf entry (1GiB or 2MiB),
          * the intermediate tables will be freed below after the ept flush
@@ -765,9 +769,13 @@ ept_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
 out:
     unmap_domain_page(table);
 
-    if ( needs_sync != sync_off )
+    if ( needs_sync )
         ept_sync_domain(p2m);
 
+    /* Old intermediate tables must not be freed with a flush pending. */
+    if ( is_epte_present(&old_entry) )
+        p2m_tlb_flush_sync(p2m);
+
     /* For non-nested p2m, may need to change VT-d page table.*/
     if ( rc == 0 && !p2m_is_nestedp2m(p2m) && need_iommu(d) &&
          need_modify_vtd_table )
@@ -778,12 +786,12 @@ out:
         {
             unsigned int flags = p2m_get_iommu_flags(p2mt);
 
+            iommu_batch_begin(d);
             if ( flags != 0 )
-                for ( i = 0; i < (1 << order); i++ )
-                    iommu_map_page(d, gfn + i, mfn_x(mfn) + i, flags);
+                iommu_map_pages(d, gfn, mfn_x(mfn), order, flags);
             else
-                for ( i = 0; i < (1 << order); i++ )
-                    iommu_unmap_page(d, gfn + i);
+                iommu_unmap_pages(d, gfn, order);
+            iommu_batch_end(d);
         }
     }
 
@@ -1030,7 +1038,7 @@ static void __ept_sync_domain(void *info)
     __invept(INVEPT_SINGLE_CONTEXT, ept_get_eptp(ept), 0);
 }
 
-void ept_sync_domain(struct p2m_domain *p2m)
+static void ept_flush_domain(struct p2m_domain *p2m)
 {
     struct domain *d = p2m->domain;
     struct ept_data *ept = &p2m->ept;
@@ -1053,6 +1061,18 @@ void ept_sync_domain(struct p2m_domain *p2m)
                      __ept_sync_domain, p2m, 1);
 }
 
+void ept_sync_domain(struct p2m_domain *p2m)
+{
+    /* Batched update in progress: one flush when it completes. */
+    if ( p2m->defer_flush )
+    {
+        p2m->need_flush = 1;
+        return;
+    }
+
+    ept_flush_domain(p2m);
+}
+
 int ept_p2m_init(struct p2m_domain *p2m)
 {
     struct ept_data *ept = &p2m->ept;
@@ -1062,6 +1082,7 @@ int ept_p2m_init(struct p2m_domain *p2m)
     p2m->change_entry_type_global = ept_change_entry_type_global;
     p2m->change_entry_type_range = ept_change_entry_type_range;
     p2m->memory_type_changed = ept_memory_type_changed;
+    p2m->tlb_flush = ept_flush_domain;
     p2m->audit_p2m = NULL;
 
     /* Set the memory type used when accessing EPT paging structures. */
@@ -30,6 +30,8 @@
 #include <public/mem_event.h>
 #include <asm/mem_sharing.h>
 #include <xen/event.h>
+#include <xen/bitmap.h>
+#include <xen/xmalloc.h>
 #include <asm/hvm/nestedhvm.h>
 #include <asm/hvm/svm/amd-iommu-proto.h>
 
@@ -59,6 +61,129 @@ static inline void unlock_page_alloc(struct p2m_domain *p2m)
     spin_unlock(&(p2m->domain->page_alloc_lock));
 }
 
+/*
+ * Zero-page hints.
+ *
+ * Everything handed out by demand-populate comes from the PoD cache, which
+ * is scrubbed, so a freshly populated 2M region is a good reclaim candidate
+ * until a sweep finds the guest has written to it.  We keep one bit per 2M
+ * region of guest physical space, plus a summary bit per 1G region, so that
+ * the emergency sweep can jump straight to likely candidates rather than
+ * walking the p2m linearly.  Bits are set on demand-populate and cleared
+ * once a sweep has looked at the region.  All protected by the pod lock.
+ */
+#define POD_HINT_1G_SHIFT (PAGE_ORDER_1G - PAGE_ORDER_2M)
+#define POD_HINT_1G_BITS  (1UL << POD_HINT_1G_SHIFT)
+
+static int pod_zero_hint_grow(struct p2m_domain *p2m, unsigned long idx)
+{
+    unsigned long nr = (idx + POD_HINT_1G_BITS) & ~(POD_HINT_1G_BITS - 1);
+    unsigned long *hint, *hint_1g;
+
+    if ( nr < 2 * p2m->pod.zero_hint_nr )
+        nr = 2 * p2m->pod.zero_hint_nr;
+
+    hint = xzalloc_array(unsigned long, BITS_TO_LONGS(nr));
+    hint_1g = xzalloc_array(unsigned long,
+                            BITS_TO_LONGS(nr >> POD_HINT_1G_SHIFT));
+    if ( !hint || !hint_1g )
+    {
+        xfree(hint);
+        xfree(hint_1g);
+        return -ENOMEM;
+    }
+
+    if ( p2m->pod.zero_hint_nr )
+    {
+        memcpy(hint, p2m->pod.zero_hint,
+               BITS_TO_LONGS(p2m->pod.zero_hint_nr) * sizeof(*hint));
+        memcpy(hint_1g, p2m->pod.zero_hint_1g,
+               BITS_TO_LONGS(p2m->pod.zero_hint_nr >> POD_HINT_1G_SHIFT) *
+               sizeof(*hint_1g));
+    }
+
+    xfree(p2m->pod.zero_hint);
+    xfree(p2m->pod.zero_hint_1g);
+    p2m->pod.zero_hint = hint;
+    p2m->pod.zero_hint_1g = hint_1g;
+    p2m->pod.zero_hint_nr = nr;
+
+    return 0;
+}
+
+static void pod_zero_hint_set(struct p2m_domain *p2m, unsigned long gfn)
+{
+    unsigned long idx = gfn >> PAGE_ORDER_2M;
+
+    ASSERT(pod_locked_by_me(p2m));
+
+    /* Hints are best-effort: if we can't grow the bitmap, do without. */
+    if ( idx >= p2m->pod.zero_hint_nr && pod_zero_hint_grow(p2m, idx) )
+        return;
+
+    __set_bit(idx, p2m->pod.zero_hint);
+    __set_bit(idx >> POD_HINT_1G_SHIFT, p2m->pod.zero_hint_1g);
+}
+
+static void pod_zero_hint_clear(struct p2m_domain *p2m, unsigned long idx)
+{
+    unsigned long first = idx & ~(POD_HINT_1G_BITS - 1);
+
+    ASSERT(pod_locked_by_me(p2m));
+
+    if ( idx >= p2m->pod.zero_hint_nr )
+        return;
+
+    __clear_bit(idx, p2m->pod.zero_hint);
+    if ( find_next_bit(p2m->pod.zero_hint, first + POD_HINT_1G_BITS,
+                       first) >= first + POD_HINT_1G_BITS )
+        __clear_bit(idx >> POD_HINT_1G_SHIFT, p2m->pod.zero_hint_1g);
+}
+
+/* Find the first hinted 2M region at or above idx, skipping unhinted 1G
+ * regions wholesale.  Returns zero_hint_nr if there is none. */
+static unsigned long pod_zero_hint_find(struct p2m_domain *p2m,
+                                        unsigned long idx)
+{
+    unsigned long nr = p2m->pod.zero_hint_nr;
+    unsigned long g, end, found;
+
+    while ( idx < nr )
+    {
+        g = find_next_bit(p2m->pod.zero_hint_1g, nr >> POD_HINT_1G_SHIFT,
+                          idx >> POD_HINT_1G_SHIFT);
+        if ( g >= (nr >> POD_HINT_1G_SHIFT) )
+            break;
+
+        if ( idx < (g << POD_HINT_1G_SHIFT) )
+            idx = g << POD_HINT_1G_SHIFT;
+        end = (g + 1) << POD_HINT_1G_SHIFT;
+
+        found = find_next_bit(p2m->pod.zero_hint, end, idx);
+        if ( found < end )
+            return found;
+
+        idx = end;
+    }
+
+    return nr;
+}
+
+/* Return 1 if the first 'words' words at p are all zero.  OR-ing a cache
+ * line's worth of words together before testing keeps the loop down to
+ * one branch per line.  'words' must be a multiple of 8. */
+static bool_t pod_words_zero(const unsigned long *p, unsigned int words)
+{
+    unsigned int i;
+
+    for ( i = 0; i < words; i += 8 )
+        if ( p[i] | p[i + 1] | p[i + 2] | p[i + 3] |
+             p[i + 4] | p[i + 5] | p[i + 6] | p[i + 7] )
+            return 0;
+
+    return 1;
+}
+
 /*
  * Populate-on-demand functionality
  */
@@ -412,6 +537,11 @@ p2m_pod_empty_cache(struct domain *d)
     BUG_ON(p2m->pod.count != 0);
 
     unlock_page_alloc(p2m);
+
+    xfree(p2m->pod.zero_hint);
+    xfree(p2m->pod.zero_hint_1g);
+    p2m->pod.zero_hint = p2m->pod.zero_hint_1g = NULL;
+    p2m->pod.zero_hint_nr = 0;
 }
 
 int
@@ -639,8 +769,10 @@ void p2m_pod_dump_data(struct domain *d)
 {
     struct p2m_domain *p2m = p2m_get_hostp2m(d);
 
-    printk("    PoD entries=%ld cachesize=%ld\n",
-           p2m->pod.entry_count, p2m->pod.count);
+    printk("    PoD entries=%ld cachesize=%ld zero-hints=%d\n",
+           p2m->pod.entry_count, p2m->pod.count,
+           p2m->pod.zero_hint_nr ?
+           bitmap_weight(p2m->pod.zero_hint, p2m->pod.zero_hint_nr) : 0);
 }
 
 
@@ -654,7 +786,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     p2m_type_t type, type0 = 0;
     unsigned long * map = NULL;
     int ret=0, reset = 0;
-    int i, j;
+    int i;
     int max_ref = 1;
     struct domain *d = p2m->domain;
 
@@ -711,15 +843,14 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     {
         /* Quick zero-check */
         map = map_domain_page(mfn_x(mfn0) + i);
-
-        for ( j=0; j<16; j++ )
-            if( *(map+j) != 0 )
-                break;
-
+        reset = !pod_words_zero(map, 16);
         unmap_domain_page(map);
 
-        if ( j < 16 )
+        if ( reset )
+        {
+            reset = 0;
             goto out;
+        }
 
     }
 
@@ -744,14 +875,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
     for ( i=0; i < SUPERPAGE_PAGES; i++ )
     {
         map = map_domain_page(mfn_x(mfn0) + i);
-
-        for ( j=0; j<PAGE_SIZE/sizeof(*map); j++ )
-            if( *(map+j) != 0 )
-            {
-                reset = 1;
-                break;
-            }
-
+        reset = !pod_words_zero(map, PAGE_SIZE / sizeof(*map));
         unmap_domain_page(map);
 
         if ( reset )
@@ -777,6 +901,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
      * back on the PoD cache, and account for the new p2m PoD entries */
     p2m_pod_cache_add(p2m, mfn_to_page(mfn0), PAGE_ORDER_2M);
     p2m->pod.entry_count += SUPERPAGE_PAGES;
+    pod_zero_hint_clear(p2m, gfn >> PAGE_ORDER_2M);
 
     ret = SUPERPAGE_PAGES;
 
@@ -797,7 +922,8 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
     unsigned long * map[count];
     struct domain *d = p2m->domain;
 
-    int i, j;
+    int i;
+    bool_t zero;
     int max_ref = 1;
 
     /* Allow an extra refcount for one shadow pt mapping in shadowed domains */
@@ -828,11 +954,7 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
             continue;
 
         /* Quick zero-check */
-        for ( j=0; j<16; j++ )
-            if( *(map[i]+j) != 0 )
-                break;
-
-        if ( j < 16 )
+        if ( !pod_words_zero(map[i], 16) )
         {
             unmap_domain_page(map[i]);
             map[i] = NULL;
@@ -863,15 +985,12 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
         if(!map[i])
             continue;
 
-        for ( j=0; j<PAGE_SIZE/sizeof(*map[i]); j++ )
-            if( *(map[i]+j) != 0 )
-                break;
-
+        zero = pod_words_zero(map[i], PAGE_SIZE / sizeof(*map[i]));
         unmap_domain_page(map[i]);
 
         /* See comment in p2m_pod_zero_check_superpage() re gnttab
          * check timing.  */
-        if ( j < PAGE_SIZE/sizeof(*map[i]) )
+        if ( !zero )
         {
             p2m_set_entry(p2m, gfns[i], mfns[i], PAGE_ORDER_4K,
                 types[i], p2m->default_access);
@@ -925,6 +1044,76 @@ p2m_pod_check_last_super(struct p2m_domain *p2m, unsigned long gfn_aligned)
 
 
 #define POD_SWEEP_STRIDE  16
+
+/* Visit the 2M regions flagged in the zero-page hints, carrying on from
+ * where the last sweep left off.  Each region gets a superpage check and,
+ * failing that, a 4k check of its ram pages; its hint is then dropped
+ * either way.  Stops once something has been found and we've looked at
+ * POD_SWEEP_LIMIT pages, or after one full pass. */
+static void
+p2m_pod_hinted_sweep(struct p2m_domain *p2m)
+{
+    unsigned long gfns[POD_SWEEP_STRIDE];
+    unsigned long idx, start, gfn, i, scanned = 0;
+    unsigned int j;
+    bool_t wrapped = 0;
+    p2m_type_t t;
+    p2m_access_t a;
+
+    if ( !p2m->pod.zero_hint_nr )
+        return;
+
+    start = p2m->pod.zero_hint_next;
+    if ( start >= p2m->pod.zero_hint_nr )
+        start = 0;
+
+    p2m_lock(p2m);
+    for ( idx = start; ; idx++ )
+    {
+        idx = pod_zero_hint_find(p2m, idx);
+        if ( idx >= p2m->pod.zero_hint_nr )
+        {
+            if ( wrapped || !start )
+                break;
+            wrapped = 1;
+            idx = pod_zero_hint_find(p2m, 0);
+        }
+        if ( wrapped && idx >= start )
+            break;
+
+        pod_zero_hint_clear(p2m, idx);
+        gfn = idx << PAGE_ORDER_2M;
+
+        if ( !p2m_pod_zero_check_superpage(p2m, gfn) )
+        {
+            for ( i = 0, j = 0; i < SUPERPAGE_PAGES; i++ )
+            {
+                (void)p2m->get_entry(p2m, gfn + i, &t, &a, 0, NULL);
+                if ( !p2m_is_ram(t) )
+                    continue;
+                gfns[j++] = gfn + i;
+                if ( j == POD_SWEEP_STRIDE )
+                {
+                    p2m_pod_zero_check(p2m, gfns, j);
+                    j = 0;
+                }
+            }
+            if ( j )
+                p2m_pod_zero_check(p2m, gfns, j);
+        }
+
+        scanned += SUPERPAGE_PAGES;
+        if ( p2m->pod.count > 0 && scanned >= POD_SWEEP_LIMIT )
+        {
+            idx++;
+            break;
+        }
+    }
+    p2m_unlock(p2m);
+
+    p2m->pod.zero_hint_next = idx;
+}
+
 static void
 p2m_pod_emergency_sweep(struct p2m_domain *p2m)
 {
@@ -932,6 +1121,11 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
     unsigned long i, j=0, start, limit;
     p2m_type_t t;
 
+    /* Try the regions we have reason to believe are zero first, and only
+     * fall back to a linear scan if that turns up nothing. */
+    p2m_pod_hinted_sweep(p2m);
+    if ( p2m->pod.count > 0 )
+        return;
 
     if ( p2m->pod.reclaim_single == 0 )
         p2m->pod.reclaim_single = p2m->pod.max_guest;
@@ -1052,6 +1246,10 @@ p2m_pod_demand_populate(struct p2m_domain *p2m, unsigned long gfn,
     p2m->pod.entry_count -= (1 << order);
     BUG_ON(p2m->pod.entry_count < 0);
 
+    /* Cache pages are scrubbed: remember this region as a reclaim
+     * candidate until a sweep finds otherwise. */
+    pod_zero_hint_set(p2m, gfn_aligned);
+
     if ( tb_init_done )
     {
         struct {
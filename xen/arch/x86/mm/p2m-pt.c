@@ -485,7 +485,7 @@ p2m_pt_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
 {
     /* XXX -- this might be able to be faster iff current->domain == d */
     void *table;
-    unsigned long i, gfn_remainder = gfn;
+    unsigned long gfn_remainder = gfn;
     l1_pgentry_t *p2m_entry;
     l1_pgentry_t entry_content;
     l2_pgentry_t l2e_content;
@@ -662,12 +662,13 @@ p2m_pt_set_entry(struct p2m_domain *p2m, unsigned long gfn, mfn_t mfn,
         {
             unsigned int flags = p2m_get_iommu_flags(p2mt);
 
+            iommu_batch_begin(p2m->domain);
             if ( flags != 0 )
-                for ( i = 0; i < (1UL << page_order); i++ )
-                    iommu_map_page(p2m->domain, gfn+i, mfn_x(mfn)+i, flags);
+                iommu_map_pages(p2m->domain, gfn, mfn_x(mfn), page_order,
+                                flags);
             else
-                for ( int i = 0; i < (1UL << page_order); i++ )
-                    iommu_unmap_page(p2m->domain, gfn+i);
+                iommu_unmap_pages(p2m->domain, gfn, page_order);
+            iommu_batch_end(p2m->domain);
         }
     }
 
@@ -225,6 +225,17 @@ void p2m_change_entry_type_global(struct domain *d,
     p2m_unlock(p2m);
 }
 
+void p2m_tlb_flush_sync(struct p2m_domain *p2m)
+{
+    ASSERT(p2m_locked_by_me(p2m));
+
+    if ( p2m->need_flush )
+    {
+        p2m->need_flush = 0;
+        p2m->tlb_flush(p2m);
+    }
+}
+
 void p2m_memory_type_changed(struct domain *d)
 {
     struct p2m_domain *p2m = p2m_get_hostp2m(d);
@@ -524,8 +535,11 @@ p2m_remove_page(struct p2m_domain *p2m, unsigned long gfn, unsigned long mfn,
     if ( !paging_mode_translate(p2m->domain) )
     {
         if ( need_iommu(p2m->domain) )
-            for ( i = 0; i < (1 << page_order); i++ )
-                iommu_unmap_page(p2m->domain, mfn + i);
+        {
+            iommu_batch_begin(p2m->domain);
+            iommu_unmap_pages(p2m->domain, mfn, page_order);
+            iommu_batch_end(p2m->domain);
+        }
         return 0;
     }
 
@@ -573,19 +587,12 @@ guest_physmap_add_entry(struct domain *d, unsigned long gfn,
     {
         if ( need_iommu(d) && t == p2m_ram_rw )
         {
-            for ( i = 0; i < (1 << page_order); i++ )
-            {
-                rc = iommu_map_page(
-                    d, mfn + i, mfn + i, IOMMUF_readable|IOMMUF_writable);
-                if ( rc != 0 )
-                {
-                    while ( i-- > 0 )
-                        iommu_unmap_page(d, mfn + i);
-                    return rc;
-                }
-            }
+            iommu_batch_begin(d);
+            rc = iommu_map_pages(d, mfn, mfn, page_order,
+                                 IOMMUF_readable|IOMMUF_writable);
+            iommu_batch_end(d);
         }
-        return 0;
+        return rc;
     }
 
     /* foreign pages are added thru p2m_add_foreign */
@@ -763,6 +770,7 @@ void p2m_change_type_range(struct domain *d,
 
     p2m_lock(p2m);
     p2m->defer_nested_flush = 1;
+    p2m->defer_flush = 1;
 
     if ( unlikely(end > p2m->max_mapped_pfn) )
     {
@@ -802,6 +810,8 @@ void p2m_change_type_range(struct domain *d,
         domain_crash(d);
     }
 
+    p2m->defer_flush = 0;
+    p2m_tlb_flush_sync(p2m);
     p2m->defer_nested_flush = 0;
     if ( nestedhvm_enabled(d) )
         p2m_flush_nestedp2m(d);
@@ -4523,3 +4523,258 @@ x86_emulate(
  cannot_emulate:
     return X86EMUL_UNHANDLEABLE;
 }
+
+int
+x86_decode_mov(
+    struct x86_emulate_mov *mov,
+    const uint8_t *insn,
+    unsigned int len,
+    const struct x86_emulate_ctxt *ctxt)
+{
+    unsigned int i = 0, def_ad_bytes = ctxt->addr_size / 8;
+    uint8_t b, modrm, modrm_mod, modrm_rm, sib, rex_prefix = 0;
+    int override_seg = -1;
+
+/* Fetch next part of the instruction, bailing if it is truncated. */
+#define fetch_type(_type)                                   \
+({ _type _x;                                                \
+   if ( i + sizeof(_x) > len )                              \
+       return X86EMUL_UNHANDLEABLE;                         \
+   memcpy(&_x, &insn[i], sizeof(_x));                       \
+   i += sizeof(_x);                                         \
+   _x;                                                      \
+})
+
+    if ( len > 15 )
+        len = 15;
+
+    /* 16-bit addressing is not handled here. */
+    if ( def_ad_bytes != 4 && def_ad_bytes != 8 )
+        return X86EMUL_UNHANDLEABLE;
+#ifndef __x86_64__
+    if ( mode_64bit() )
+        return X86EMUL_UNHANDLEABLE;
+#endif
+
+    memset(mov, 0, sizeof(*mov));
+    mov->op_bytes = mov->ad_bytes = def_ad_bytes;
+    if ( mov->op_bytes == 8 )
+        mov->op_bytes = 4;
+    mov->seg = x86_seg_ds;
+    mov->base = mov->index = X86_MOV_NONE;
+
+    /* Prefix bytes. Address-size, LOCK and REP are left to x86_emulate(). */
+    for ( ; ; )
+    {
+        switch ( b = fetch_type(uint8_t) )
+        {
+        case 0x66: /* operand-size override */
+            mov->op_bytes = 2;
+            break;
+        case 0x2e: /* CS override */
+            override_seg = x86_seg_cs;
+            break;
+        case 0x3e: /* DS override */
+            override_seg = x86_seg_ds;
+            break;
+        case 0x26: /* ES override */
+            override_seg = x86_seg_es;
+            break;
+        case 0x64: /* FS override */
+            override_seg = x86_seg_fs;
+            break;
+        case 0x65: /* GS override */
+            override_seg = x86_seg_gs;
+            break;
+        case 0x36: /* SS override */
+            override_seg = x86_seg_ss;
+            break;
+        case 0x40 ... 0x4f: /* REX */
+            if ( !mode_64bit() )
+                goto done_prefixes;
+            rex_prefix = b;
+            continue;
+        default:
+            goto done_prefixes;
+        }
+
+        /* Any legacy prefix after a REX prefix nullifies its effect. */
+        rex_prefix = 0;
+    }
+ done_prefixes:
+
+    if ( rex_prefix & REX_W )
+        mov->op_bytes = 8;
+
+    switch ( b )
+    {
+    case 0x88: case 0x89: /* mov r,r/m */
+        mov->to_mem = 1;
+        break;
+    case 0x8a: case 0x8b: /* mov r/m,r */
+        break;
+    case 0xc6: case 0xc7: /* mov imm,r/m */
+        mov->to_mem = 1;
+        break;
+    default:
+        return X86EMUL_UNHANDLEABLE;
+    }
+    if ( !(b & 1) )
+        mov->op_bytes = 1;
+
+    modrm = fetch_type(uint8_t);
+    modrm_mod = (modrm & 0xc0) >> 6;
+    modrm_rm  = modrm & 0x07;
+    if ( modrm_mod == 3 )
+        return X86EMUL_UNHANDLEABLE;
+
+    if ( b >= 0xc6 )
+    {
+        if ( modrm & 0x38 )
+            return X86EMUL_UNHANDLEABLE;
+        mov->reg = X86_MOV_IMM;
+    }
+    else
+    {
+        mov->reg = ((rex_prefix & 4) << 1) | ((modrm & 0x38) >> 3);
+        mov->highbyte = (mov->op_bytes == 1) && (rex_prefix == 0);
+    }
+
+    /* 32/64-bit ModR/M decode, as in x86_emulate(). */
+    if ( modrm_rm == 4 )
+    {
+        uint8_t sib_index, sib_base;
+
+        sib = fetch_type(uint8_t);
+        sib_index = ((sib >> 3) & 7) | ((rex_prefix << 2) & 8);
+        sib_base  = (sib & 7) | ((rex_prefix << 3) & 8);
+        if ( sib_index != 4 )
+        {
+            mov->index = sib_index;
+            mov->scale = (sib >> 6) & 3;
+        }
+        if ( (modrm_mod == 0) && ((sib_base & 7) == 5) )
+            mov->disp = fetch_type(int32_t);
+        else
+        {
+            if ( sib_base == 4 || sib_base == 5 )
+                mov->seg = x86_seg_ss;
+            mov->base = sib_base;
+        }
+    }
+    else
+    {
+        modrm_rm |= (rex_prefix & 1) << 3;
+        if ( (modrm_mod == 0) && ((modrm_rm & 7) == 5) )
+        {
+            mov->disp = fetch_type(int32_t);
+            if ( mode_64bit() )
+                mov->base = X86_MOV_RIP;
+        }
+        else
+        {
+            mov->base = modrm_rm;
+            if ( (modrm_rm == 5) && (modrm_mod != 0) )
+                mov->seg = x86_seg_ss;
+        }
+    }
+
+    switch ( modrm_mod )
+    {
+    case 1:
+        mov->disp = fetch_type(int8_t);
+        break;
+    case 2:
+        mov->disp = fetch_type(int32_t);
+        break;
+    }
+
+    if ( override_seg != -1 )
+        mov->seg = override_seg;
+
+    /* Immediates are sign-extended, as in x86_emulate(). */
+    if ( mov->reg == X86_MOV_IMM )
+    {
+        switch ( mov->op_bytes )
+        {
+        case 1: mov->imm = fetch_type(int8_t);  break;
+        case 2: mov->imm = fetch_type(int16_t); break;
+        default: mov->imm = fetch_type(int32_t); break;
+        }
+    }
+
+#undef fetch_type
+
+    mov->len = i;
+
+    return X86EMUL_OKAY;
+}
+
+int
+x86_emulate_mov(
+    const struct x86_emulate_mov *mov,
+    struct x86_emulate_ctxt *ctxt,
+    const struct x86_emulate_ops *ops)
+{
+    /* Shadow copy of register state. Committed on successful emulation. */
+    struct cpu_user_regs _regs = *ctxt->regs;
+    unsigned long off = (long)mov->disp, val = 0;
+    void *reg = NULL;
+    int rc;
+
+    ctxt->retire.byte = 0;
+
+    if ( mov->base == X86_MOV_RIP )
+        /* Relative to RIP of next instruction. */
+        off += _regs.eip + mov->len;
+    else if ( mov->base != X86_MOV_NONE )
+        off += *(long *)decode_register(mov->base, &_regs, 0);
+    if ( mov->index != X86_MOV_NONE )
+        off += *(long *)decode_register(mov->index, &_regs, 0) << mov->scale;
+    off = truncate_word(off, mov->ad_bytes);
+
+    if ( mov->reg != X86_MOV_IMM )
+        reg = decode_register(mov->reg, &_regs, mov->highbyte);
+
+    if ( mov->to_mem )
+    {
+        if ( !reg )
+            val = mov->imm;
+        else
+            switch ( mov->op_bytes )
+            {
+            case 1: val = *(uint8_t  *)reg; break;
+            case 2: val = *(uint16_t *)reg; break;
+            case 4: val = *(uint32_t *)reg; break;
+            case 8: val = *(unsigned long *)reg; break;
+            }
+        rc = ops->write(mov->seg, off, &val, mov->op_bytes, ctxt);
+    }
+    else
+    {
+        rc = ops->read(mov->seg, off, &val, mov->op_bytes, ctxt);
+        if ( rc == X86EMUL_OKAY )
+            /* The 4-byte case *is* correct: in 64-bit mode we zero-extend. */
+            switch ( mov->op_bytes )
+            {
+            case 1: *(uint8_t  *)reg = (uint8_t)val; break;
+            case 2: *(uint16_t *)reg = (uint16_t)val; break;
+            case 4: *(unsigned long *)reg = (uint32_t)val; break;
+            case 8: *(unsigned long *)reg = val; break;
+            }
+    }
+    if ( rc != X86EMUL_OKAY )
+        return rc;
+
+    _regs.eip += mov->len;
+
+    /* Inject #DB if single-step tracing was enabled at instruction start. */
+    if ( (ctxt->regs->eflags & EFLG_TF) && (ops->inject_hw_exception != NULL) )
+        rc = ops->inject_hw_exception(EXC_DB, -1, ctxt) ? : X86EMUL_EXCEPTION;
+
+    /* Commit shadow register state. */
+    _regs.eflags &= ~EFLG_RF;
+    *ctxt->regs = _regs;
+
+    return rc;
+}
@@ -399,6 +399,54 @@ x86_emulate(
     struct x86_emulate_ctxt *ctxt,
     const struct x86_emulate_ops *ops);
 
+/*
+ * Pre-decoded form of a plain MOV between a general purpose register (or an
+ * immediate) and memory: opcodes 88-8B and C6/C7 /0 with 32- or 64-bit
+ * addressing. Produced by x86_decode_mov() and replayed, without touching
+ * the instruction bytes again, by x86_emulate_mov().
+ */
+struct x86_emulate_mov
+{
+    uint8_t len;        /* Total instruction length, including prefixes. */
+    uint8_t op_bytes;   /* Operand size: 1, 2, 4 or 8. */
+    uint8_t ad_bytes;   /* Address size: 4 or 8. */
+    uint8_t to_mem;     /* Store (register/immediate to memory)? */
+    uint8_t reg;        /* Register operand, or X86_MOV_IMM. */
+    uint8_t highbyte;   /* Decode regs 4-7 as AH,CH,DH,BH? */
+    uint8_t base;       /* Base register, X86_MOV_NONE, or X86_MOV_RIP. */
+    uint8_t index;      /* Index register, or X86_MOV_NONE. */
+    uint8_t scale;      /* Index shift count. */
+    uint8_t seg;        /* enum x86_segment of the memory operand. */
+    int32_t disp;
+    unsigned long imm;
+};
+#define X86_MOV_IMM  0xff
+#define X86_MOV_NONE 0xff
+#define X86_MOV_RIP  0xfe
+
+/*
+ * x86_decode_mov: Decode @insn (at most @len bytes) if it is a simple MOV as
+ * described above, for the execution mode in @ctxt->addr_size.
+ * Returns X86EMUL_OKAY on success, X86EMUL_UNHANDLEABLE for anything else
+ * (in which case the caller should use x86_emulate()).
+ */
+int
+x86_decode_mov(
+    struct x86_emulate_mov *mov,
+    const uint8_t *insn,
+    unsigned int len,
+    const struct x86_emulate_ctxt *ctxt);
+
+/*
+ * x86_emulate_mov: Execute a MOV previously decoded by x86_decode_mov(),
+ * with the same register, memory and retirement semantics as x86_emulate().
+ */
+int
+x86_emulate_mov(
+    const struct x86_emulate_mov *mov,
+    struct x86_emulate_ctxt *ctxt,
+    const struct x86_emulate_ops *ops);
+
 /*
  * Given the 'reg' portion of a ModRM byte, and a register block, return a
  * pointer into the block that addresses the relevant register.
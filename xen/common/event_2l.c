@@ -14,7 +14,8 @@
 #include <xen/sched.h>
 #include <xen/event.h>
 
-static void evtchn_2l_set_pending(struct vcpu *v, struct evtchn *evtchn)
+static void __evtchn_2l_set_pending(struct vcpu *v, struct evtchn *evtchn,
+                                    struct evtchn_batch *b)
 {
     struct domain *d = v->domain;
     unsigned int port = evtchn->port;
@@ -33,12 +34,26 @@ static void evtchn_2l_set_pending(struct vcpu *v, struct evtchn *evtchn)
          !test_and_set_bit(port / BITS_PER_EVTCHN_WORD(d),
                            &vcpu_info(v, evtchn_pending_sel)) )
     {
-        vcpu_mark_events_pending(v);
+        evtchn_batch_upcall(b, v);
     }
 
     evtchn_check_pollers(d, port);
 }
 
+static void evtchn_2l_set_pending(struct vcpu *v, struct evtchn *evtchn)
+{
+    __evtchn_2l_set_pending(v, evtchn, NULL);
+}
+
+static void evtchn_2l_set_pending_batch(struct evtchn_batch *b,
+                                        unsigned int first, unsigned int nr)
+{
+    unsigned int i;
+
+    for ( i = first; i < first + nr; i++ )
+        __evtchn_2l_set_pending(b->vcpu[i], b->evtchn[i], b);
+}
+
 static void evtchn_2l_clear_pending(struct domain *d, struct evtchn *evtchn)
 {
     clear_bit(evtchn->port, &shared_info(d, evtchn_pending));
@@ -86,6 +101,7 @@ static void evtchn_2l_print_state(struct domain *d,
 static const struct evtchn_port_ops evtchn_port_ops_2l =
 {
     .set_pending   = evtchn_2l_set_pending,
+    .set_pending_batch = evtchn_2l_set_pending_batch,
     .clear_pending = evtchn_2l_clear_pending,
     .unmask        = evtchn_2l_unmask,
     .is_pending    = evtchn_2l_is_pending,
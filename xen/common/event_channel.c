@@ -599,62 +599,123 @@ static long evtchn_close(evtchn_close_t *close)
     return __evtchn_close(current->domain, close->port);
 }
 
-int evtchn_send(struct domain *d, unsigned int lport)
+/*
+ * Find the event raised by a send on local port @lport of @ld.  Returns 1
+ * and sets *v and *chn if there is one, 0 if the send is silently dropped,
+ * or a negative errno.  The caller must hold @ld's event lock.
+ */
+static int evtchn_send_target(struct domain *ld, unsigned int lport,
+                              struct vcpu **v, struct evtchn **chn)
 {
     struct evtchn *lchn, *rchn;
-    struct domain *ld = d, *rd;
-    struct vcpu   *rvcpu;
-    int            rport, ret = 0;
-
-    spin_lock(&ld->event_lock);
+    struct domain *rd;
+    int            ret;
 
     if ( unlikely(!port_is_valid(ld, lport)) )
-    {
-        spin_unlock(&ld->event_lock);
         return -EINVAL;
-    }
 
     lchn = evtchn_from_port(ld, lport);
 
     /* Guest cannot send via a Xen-attached event channel. */
     if ( unlikely(consumer_is_xen(lchn)) )
-    {
-        spin_unlock(&ld->event_lock);
         return -EINVAL;
-    }
 
     ret = xsm_evtchn_send(XSM_HOOK, ld, lchn);
     if ( ret )
-        goto out;
+        return ret;
 
     switch ( lchn->state )
     {
     case ECS_INTERDOMAIN:
         rd    = lchn->u.interdomain.remote_dom;
-        rport = lchn->u.interdomain.remote_port;
-        rchn  = evtchn_from_port(rd, rport);
-        rvcpu = rd->vcpu[rchn->notify_vcpu_id];
-        if ( consumer_is_xen(rchn) )
-            (*xen_notification_fn(rchn))(rvcpu, rport);
-        else
-            evtchn_set_pending(rvcpu, rport);
-        break;
+        rchn  = evtchn_from_port(rd, lchn->u.interdomain.remote_port);
+        *v    = rd->vcpu[rchn->notify_vcpu_id];
+        *chn  = rchn;
+        return 1;
     case ECS_IPI:
-        evtchn_set_pending(ld->vcpu[lchn->notify_vcpu_id], lport);
-        break;
+        *v    = ld->vcpu[lchn->notify_vcpu_id];
+        *chn  = lchn;
+        return 1;
     case ECS_UNBOUND:
         /* silently drop the notification */
-        break;
+        return 0;
     default:
-        ret = -EINVAL;
+        return -EINVAL;
+    }
+}
+
+int evtchn_send(struct domain *d, unsigned int lport)
+{
+    struct domain *ld = d;
+    struct evtchn *rchn;
+    struct vcpu   *rvcpu;
+    int            ret;
+
+    spin_lock(&ld->event_lock);
+
+    ret = evtchn_send_target(ld, lport, &rvcpu, &rchn);
+    if ( ret > 0 )
+    {
+        if ( consumer_is_xen(rchn) )
+            (*xen_notification_fn(rchn))(rvcpu, rchn->port);
+        else
+            evtchn_port_set_pending(rvcpu, rchn);
+        ret = 0;
     }
 
-out:
     spin_unlock(&ld->event_lock);
 
     return ret;
 }
 
+static long evtchn_send_multi(const struct evtchn_send_multi *send)
+{
+    struct domain *ld = current->domain;
+    struct evtchn_batch b;
+    unsigned int i, j;
+    int rc = 0;
+
+    if ( send->nr > EVTCHN_SEND_MULTI_MAX )
+        return -EINVAL;
+
+    b.nr = b.nr_upcalls = 0;
+
+    spin_lock(&ld->event_lock);
+
+    for ( i = 0; i < send->nr; i++ )
+    {
+        struct vcpu *v;
+        struct evtchn *chn;
+
+        rc = evtchn_send_target(ld, send->port[i], &v, &chn);
+        if ( rc < 0 )
+            goto out;
+        if ( rc > 0 )
+            evtchn_batch_add(&b, v, chn);
+    }
+    rc = 0;
+
+    /* Xen-attached ports are notified directly and dropped from the batch. */
+    for ( i = j = 0; i < b.nr; i++ )
+    {
+        if ( consumer_is_xen(b.evtchn[i]) )
+        {
+            (*xen_notification_fn(b.evtchn[i]))(b.vcpu[i], b.evtchn[i]->port);
+            continue;
+        }
+        b.vcpu[j] = b.vcpu[i];
+        b.evtchn[j++] = b.evtchn[i];
+    }
+    b.nr = j;
+
+    evtchn_batch_send(&b);
+
+ out:
+    spin_unlock(&ld->event_lock);
+
+    return rc;
+}
+
 static void evtchn_set_pending(struct vcpu *v, int port)
 {
     evtchn_port_set_pending(v, evtchn_from_port(v->domain, port));
@@ -1059,6 +1120,14 @@ long do_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         break;
     }
 
+    case EVTCHNOP_send_multi: {
+        struct evtchn_send_multi send_multi;
+        if ( copy_from_guest(&send_multi, arg, 1) != 0 )
+            return -EFAULT;
+        rc = evtchn_send_multi(&send_multi);
+        break;
+    }
+
     case EVTCHNOP_status: {
         struct evtchn_status status;
         if ( copy_from_guest(&status, arg, 1) != 0 )
@@ -1212,6 +1281,42 @@ void notify_via_xen_event_channel(struct domain *ld, int lport)
     spin_unlock(&ld->event_lock);
 }
 
+bool_t notify_via_xen_event_channel_unmasked(struct domain *ld, int lport)
+{
+    struct evtchn *lchn, *rchn;
+    struct domain *rd;
+    int            rport;
+    bool_t         sent = 0;
+
+    spin_lock(&ld->event_lock);
+
+    if ( unlikely(ld->is_dying) )
+    {
+        spin_unlock(&ld->event_lock);
+        return 0;
+    }
+
+    ASSERT(port_is_valid(ld, lport));
+    lchn = evtchn_from_port(ld, lport);
+    ASSERT(consumer_is_xen(lchn));
+
+    if ( likely(lchn->state == ECS_INTERDOMAIN) )
+    {
+        rd    = lchn->u.interdomain.remote_dom;
+        rport = lchn->u.interdomain.remote_port;
+        rchn  = evtchn_from_port(rd, rport);
+        if ( !evtchn_port_is_masked(rd, rchn) )
+        {
+            evtchn_set_pending(rd->vcpu[rchn->notify_vcpu_id], rport);
+            sent = 1;
+        }
+    }
+
+    spin_unlock(&ld->event_lock);
+
+    return sent;
+}
+
 void evtchn_check_pollers(struct domain *d, unsigned int port)
 {
     struct vcpu *v;
@@ -144,6 +144,99 @@ static bool_t evtchn_fifo_set_link(const struct domain *d, event_word_t *word,
     return 1;
 }
 
+/*
+ * Link an unmasked, pending event onto the tail of its queue.
+ *
+ * *held is the queue lock held by the caller, if any (with its saved
+ * interrupt state in *flags).  It is reused if it is the lock needed for
+ * this event; otherwise it is dropped first.  On return *held is the queue
+ * lock still held, which the caller must release.
+ *
+ * Returns 1 if the queue's READY bit was set and an upcall is needed.
+ */
+static bool_t evtchn_fifo_link(struct vcpu *v, struct evtchn *evtchn,
+                               event_word_t *word,
+                               struct evtchn_fifo_queue **held,
+                               unsigned long *flags)
+{
+    struct domain *d = v->domain;
+    unsigned int port = evtchn->port;
+    struct evtchn_fifo_queue *q, *old_q;
+    event_word_t *tail_word;
+    bool_t linked = 0;
+
+    /*
+     * No locking around getting the queue. This may race with
+     * changing the priority but we are allowed to signal the
+     * event once on the old priority.
+     */
+    q = &v->evtchn_fifo->queue[evtchn->priority];
+
+    /*
+     * The last queue can only change under its own lock, so if we
+     * already hold it the check below is stable.
+     */
+    old_q = *held;
+    if ( old_q &&
+         old_q != &d->vcpu[evtchn->last_vcpu_id]->evtchn_fifo->queue[
+                       evtchn->last_priority] )
+    {
+        spin_unlock_irqrestore(&old_q->lock, *flags);
+        old_q = NULL;
+    }
+    if ( !old_q )
+    {
+        old_q = lock_old_queue(d, evtchn, flags);
+        *held = old_q;
+        if ( !old_q )
+            return 0;
+    }
+
+    if ( test_and_set_bit(EVTCHN_FIFO_LINKED, word) )
+        return 0;
+
+    /*
+     * If this event was a tail, the old queue is now empty and
+     * its tail must be invalidated to prevent adding an event to
+     * the old queue from corrupting the new queue.
+     */
+    if ( old_q->tail == port )
+        old_q->tail = 0;
+
+    /* Moved to a different queue? */
+    if ( old_q != q )
+    {
+        evtchn->last_vcpu_id = evtchn->notify_vcpu_id;
+        evtchn->last_priority = evtchn->priority;
+
+        spin_unlock_irqrestore(&old_q->lock, *flags);
+        spin_lock_irqsave(&q->lock, *flags);
+        *held = q;
+    }
+
+    /*
+     * Atomically link the tail to port iff the tail is linked.
+     * If the tail is unlinked the queue is empty.
+     *
+     * If port is the same as tail, the queue is empty but q->tail
+     * will appear linked as we just set LINKED above.
+     *
+     * If the queue is empty (i.e., we haven't linked to the new
+     * event), head must be updated.
+     */
+    if ( q->tail )
+    {
+        tail_word = evtchn_fifo_word_from_port(d, q->tail);
+        linked = evtchn_fifo_set_link(d, tail_word, port);
+    }
+    if ( !linked )
+        write_atomic(q->head, port);
+    q->tail = port;
+
+    return !linked && !test_and_set_bit(q->priority,
+                                        &v->evtchn_fifo->control_block->ready);
+}
+
 static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
 {
     struct domain *d = v->domain;
@@ -173,74 +266,62 @@ static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
     if ( !test_bit(EVTCHN_FIFO_MASKED, word)
          && !test_bit(EVTCHN_FIFO_LINKED, word) )
     {
-        struct evtchn_fifo_queue *q, *old_q;
-        event_word_t *tail_word;
-        bool_t linked = 0;
-
-        /*
-         * No locking around getting the queue. This may race with
-         * changing the priority but we are allowed to signal the
-         * event once on the old priority.
-         */
-        q = &v->evtchn_fifo->queue[evtchn->priority];
-
-        old_q = lock_old_queue(d, evtchn, &flags);
-        if ( !old_q )
-            goto done;
+        struct evtchn_fifo_queue *held = NULL;
+        bool_t upcall = evtchn_fifo_link(v, evtchn, word, &held, &flags);
 
-        if ( test_and_set_bit(EVTCHN_FIFO_LINKED, word) )
-        {
-            spin_unlock_irqrestore(&old_q->lock, flags);
-            goto done;
-        }
+        if ( held )
+            spin_unlock_irqrestore(&held->lock, flags);
 
-        /*
-         * If this event was a tail, the old queue is now empty and
-         * its tail must be invalidated to prevent adding an event to
-         * the old queue from corrupting the new queue.
-         */
-        if ( old_q->tail == port )
-            old_q->tail = 0;
+        if ( upcall )
+            vcpu_mark_events_pending(v);
+    }
 
-        /* Moved to a different queue? */
-        if ( old_q != q )
-        {
-            evtchn->last_vcpu_id = evtchn->notify_vcpu_id;
-            evtchn->last_priority = evtchn->priority;
+    if ( !was_pending )
+        evtchn_check_pollers(d, port);
+}
 
-            spin_unlock_irqrestore(&old_q->lock, flags);
-            spin_lock_irqsave(&q->lock, flags);
-        }
+/*
+ * As evtchn_fifo_set_pending() for several events, keeping a queue lock
+ * held from one event to the next while they go to the same queue.
+ * Pollers are woken once all locks are dropped.
+ */
+static void evtchn_fifo_set_pending_batch(struct evtchn_batch *b,
+                                          unsigned int first, unsigned int nr)
+{
+    struct domain *d = b->vcpu[first]->domain;
+    struct evtchn_fifo_queue *held = NULL;
+    unsigned long flags = 0, poll = 0;
+    unsigned int i;
 
-        /*
-         * Atomically link the tail to port iff the tail is linked.
-         * If the tail is unlinked the queue is empty.
-         *
-         * If port is the same as tail, the queue is empty but q->tail
-         * will appear linked as we just set LINKED above.
-         *
-         * If the queue is empty (i.e., we haven't linked to the new
-         * event), head must be updated.
-         */
-        if ( q->tail )
+    BUILD_BUG_ON(EVTCHN_BATCH_MAX > BITS_PER_LONG);
+
+    for ( i = first; i < first + nr; i++ )
+    {
+        struct vcpu *v = b->vcpu[i];
+        struct evtchn *evtchn = b->evtchn[i];
+        event_word_t *word = evtchn_fifo_word_from_port(d, evtchn->port);
+
+        if ( unlikely(!word) )
         {
-            tail_word = evtchn_fifo_word_from_port(d, q->tail);
-            linked = evtchn_fifo_set_link(d, tail_word, port);
+            evtchn->pending = 1;
+            continue;
         }
-        if ( !linked )
-            write_atomic(q->head, port);
-        q->tail = port;
 
-        spin_unlock_irqrestore(&q->lock, flags);
+        if ( !test_and_set_bit(EVTCHN_FIFO_PENDING, word) )
+            __set_bit(i, &poll);
 
-        if ( !linked
-             && !test_and_set_bit(q->priority,
-                                  &v->evtchn_fifo->control_block->ready) )
-            vcpu_mark_events_pending(v);
+        if ( !test_bit(EVTCHN_FIFO_MASKED, word)
+             && !test_bit(EVTCHN_FIFO_LINKED, word)
+             && evtchn_fifo_link(v, evtchn, word, &held, &flags) )
+            evtchn_batch_upcall(b, v);
     }
- done:
-    if ( !was_pending )
-        evtchn_check_pollers(d, port);
+
+    if ( held )
+        spin_unlock_irqrestore(&held->lock, flags);
+
+    for ( i = first; i < first + nr; i++ )
+        if ( test_bit(i, &poll) )
+            evtchn_check_pollers(d, b->evtchn[i]->port);
 }
 
 static void evtchn_fifo_clear_pending(struct domain *d, struct evtchn *evtchn)
@@ -335,6 +416,7 @@ static const struct evtchn_port_ops evtchn_port_ops_fifo =
 {
     .init          = evtchn_fifo_init,
     .set_pending   = evtchn_fifo_set_pending,
+    .set_pending_batch = evtchn_fifo_set_pending_batch,
     .clear_pending = evtchn_fifo_clear_pending,
     .unmask        = evtchn_fifo_unmask,
     .is_pending    = evtchn_fifo_is_pending,
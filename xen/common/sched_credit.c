@@ -517,11 +517,13 @@ csched_alloc_pdata(const struct scheduler *ops, int cpu)
     {
         prv->master = cpu;
         init_timer(&prv->master_ticker, csched_acct, prv, cpu);
+        set_timer_slack(&prv->master_ticker, MILLISECS(prv->tslice_ms) / 16);
         set_timer(&prv->master_ticker,
                   NOW() + MILLISECS(prv->tslice_ms));
     }
 
     init_timer(&spc->ticker, csched_tick, (void *)(unsigned long)cpu, cpu);
+    set_timer_slack(&spc->ticker, MICROSECS(prv->tick_period_us) / 16);
     set_timer(&spc->ticker, NOW() + MICROSECS(prv->tick_period_us) );
 
     INIT_LIST_HEAD(&spc->runq);
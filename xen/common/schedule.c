@@ -869,7 +869,10 @@ void watchdog_domain_init(struct domain *d)
     d->watchdog_inuse_map = 0;
 
     for ( i = 0; i < NR_DOMAIN_WATCHDOG_TIMERS; i++ )
+    {
         init_timer(&d->watchdog_timer[i], domain_watchdog_timeout, d, 0);
+        set_timer_slack(&d->watchdog_timer[i], MILLISECS(10));
+    }
 }
 
 void watchdog_domain_destroy(struct domain *d)
@@ -29,10 +29,38 @@
 static unsigned int timer_slop __read_mostly = 50000; /* 50 us */
 integer_param("timer_slop", timer_slop);
 
+/* Keep timers which tolerate some slack on a per-CPU timer wheel. */
+static bool_t __read_mostly opt_timer_wheel = 1;
+boolean_param("timer_wheel", opt_timer_wheel);
+
+/*
+ * The timer wheel has TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SIZE buckets.
+ * Level-0 buckets span 2^TIMER_WHEEL_SHIFT ns (~33us) each, and each further
+ * level is TIMER_WHEEL_SIZE times coarser, covering ~10 hours in total.
+ */
+#define TIMER_WHEEL_SHIFT   15
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SIZE    (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS  5
+#define TIMER_WHEEL_EXPIRED 0xffffu /* wheel_slot of a timer on ->expired */
+
+struct timer_wheel {
+    /* Next level-0 tick to be processed. */
+    uint64_t         clk;
+    unsigned int     count;
+    /* Non-empty buckets of each level. */
+    uint64_t         pending[TIMER_WHEEL_LEVELS];
+    struct list_head bucket[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SIZE];
+    /* Timers due for execution by the current softirq. */
+    struct list_head expired;
+};
+
 struct timers {
     spinlock_t     lock;
     struct timer **heap;
     struct timer  *list;
+    struct timer_wheel *wheel;
     struct timer  *running;
     struct list_head inactive;
 } __cacheline_aligned;
@@ -167,6 +195,169 @@ static int add_to_list(struct timer **pprev, struct timer *t)
 }
 
 
+/****************************************************************************
+ * TIMER WHEEL OPERATIONS.
+ */
+
+static uint64_t wheel_tick(s_time_t t)
+{
+    return (t > 0) ? (uint64_t)t >> TIMER_WHEEL_SHIFT : 0;
+}
+
+/* Add @t to @wheel. Return the level-0 tick at which it will expire. */
+static uint64_t add_to_wheel(struct timer_wheel *wheel, struct timer *t)
+{
+    /* Round up so that we never fire early. */
+    uint64_t tick = wheel_tick(t->expires + (1u << TIMER_WHEEL_SHIFT) - 1);
+    uint64_t delta;
+    unsigned int level, idx, gran;
+
+    /*
+     * Round further up to the coarsest power-of-two number of ticks that the
+     * timer's slack allows, so that timers tolerating more slack line up on
+     * fewer ticks and expire together.
+     */
+    gran = min_t(uint32_t, t->slack >> TIMER_WHEEL_SHIFT, TIMER_WHEEL_SIZE);
+    if ( gran > 1 )
+    {
+        gran = 1u << (fls(gran) - 1);
+        tick = (tick + gran - 1) & ~(uint64_t)(gran - 1);
+    }
+
+    if ( tick < wheel->clk )
+        tick = wheel->clk;
+    delta = tick - wheel->clk;
+
+    for ( level = 0; level < TIMER_WHEEL_LEVELS - 1; level++ )
+        if ( delta < (1ull << (TIMER_WHEEL_BITS * (level + 1))) )
+            break;
+
+    /* Beyond the wheel's range: park in its furthest bucket. */
+    if ( delta >= (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) )
+        tick = wheel->clk +
+            (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+    idx = (tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    t->wheel_slot = level * TIMER_WHEEL_SIZE + idx;
+    list_add_tail(&t->wheel, &wheel->bucket[t->wheel_slot]);
+    wheel->pending[level] |= 1ull << idx;
+    wheel->count++;
+
+    return tick;
+}
+
+static void remove_from_wheel(struct timer_wheel *wheel, struct timer *t)
+{
+    unsigned int slot = t->wheel_slot;
+
+    list_del(&t->wheel);
+    wheel->count--;
+
+    if ( (slot != TIMER_WHEEL_EXPIRED) && list_empty(&wheel->bucket[slot]) )
+        wheel->pending[slot / TIMER_WHEEL_SIZE] &=
+            ~(1ull << (slot & TIMER_WHEEL_MASK));
+}
+
+/* Re-file the timers of the current bucket of @level into lower levels. */
+static void cascade_wheel(struct timer_wheel *wheel, unsigned int level)
+{
+    unsigned int idx = (wheel->clk >> (TIMER_WHEEL_BITS * level)) &
+                       TIMER_WHEEL_MASK;
+    struct list_head *bucket = &wheel->bucket[level * TIMER_WHEEL_SIZE + idx];
+    struct timer *t;
+
+    if ( !(wheel->pending[level] & (1ull << idx)) )
+        return;
+
+    while ( !list_empty(bucket) )
+    {
+        t = list_entry(bucket->next, struct timer, wheel);
+        remove_from_wheel(wheel, t);
+        add_to_wheel(wheel, t);
+    }
+}
+
+/*
+ * Return the first level-0 tick, at or after @wheel->clk, at which a bucket
+ * of @wheel expires or needs cascading.
+ */
+static uint64_t wheel_next_tick(const struct timer_wheel *wheel)
+{
+    uint64_t tick, next = ~0ull, map;
+    unsigned int level, shift, idx;
+
+    for ( level = 0; level < TIMER_WHEEL_LEVELS; level++ )
+    {
+        if ( (map = wheel->pending[level]) == 0 )
+            continue;
+
+        shift = TIMER_WHEEL_BITS * level;
+        tick = wheel->clk >> shift;
+
+        /*
+         * The current bucket of an upper level has already been cascaded,
+         * unless the clock sits exactly on its boundary.
+         */
+        if ( wheel->clk & ((1ull << shift) - 1) )
+            tick++;
+
+        idx = tick & TIMER_WHEEL_MASK;
+        map = (map >> idx) | (idx ? map << (TIMER_WHEEL_SIZE - idx) : 0);
+        tick = (tick + find_first_set_bit(map)) << shift;
+
+        if ( tick < next )
+            next = tick;
+    }
+
+    return next;
+}
+
+/* Move all timers which expire at or before tick @now onto @wheel->expired. */
+static void advance_wheel(struct timer_wheel *wheel, uint64_t now)
+{
+    uint64_t clk;
+    unsigned int level, idx;
+    struct timer *t;
+
+    while ( (clk = wheel_next_tick(wheel)) <= now )
+    {
+        wheel->clk = clk;
+
+        for ( level = 1; level < TIMER_WHEEL_LEVELS; level++ )
+        {
+            if ( clk & ((1ull << (TIMER_WHEEL_BITS * level)) - 1) )
+                break;
+            cascade_wheel(wheel, level);
+        }
+
+        idx = clk & TIMER_WHEEL_MASK;
+        while ( !list_empty(&wheel->bucket[idx]) )
+        {
+            t = list_entry(wheel->bucket[idx].next, struct timer, wheel);
+            list_del(&t->wheel);
+            t->wheel_slot = TIMER_WHEEL_EXPIRED;
+            list_add_tail(&t->wheel, &wheel->expired);
+        }
+        wheel->pending[0] &= ~(1ull << idx);
+
+        wheel->clk = clk + 1;
+    }
+
+    wheel->clk = max(wheel->clk, now + 1);
+}
+
+/* Return the earliest time at which @wheel needs processing, or STIME_MAX. */
+static s_time_t wheel_deadline(const struct timer_wheel *wheel)
+{
+    if ( wheel == NULL || wheel->count == 0 )
+        return STIME_MAX;
+    if ( !list_empty(&wheel->expired) )
+        return 0;
+
+    return (s_time_t)(wheel_next_tick(wheel) << TIMER_WHEEL_SHIFT);
+}
+
+
 /****************************************************************************
  * TIMER OPERATIONS.
  */
@@ -184,6 +375,11 @@ static int remove_entry(struct timer *t)
     case TIMER_STATUS_in_list:
         rc = remove_from_list(&timers->list, t);
         break;
+    case TIMER_STATUS_in_wheel:
+        /* An earlier deadline than necessary is harmless: don't reprogram. */
+        remove_from_wheel(timers->wheel, t);
+        rc = 0;
+        break;
     default:
         rc = 0;
         BUG();
@@ -200,6 +396,20 @@ static int add_entry(struct timer *t)
 
     ASSERT(t->status == TIMER_STATUS_invalid);
 
+    if ( (timers->wheel != NULL) &&
+         (t->slack >= (1u << TIMER_WHEEL_SHIFT)) )
+    {
+        s_time_t deadline = per_cpu(timer_deadline, t->cpu);
+
+        /* Nothing was pending: no need to walk the ticks since last used. */
+        if ( timers->wheel->count == 0 )
+            timers->wheel->clk = max(timers->wheel->clk, wheel_tick(NOW()));
+
+        t->status = TIMER_STATUS_in_wheel;
+        return ((s_time_t)(add_to_wheel(timers->wheel, t) << TIMER_WHEEL_SHIFT)
+                < deadline) || (deadline == 0);
+    }
+
     /* Try to add to heap. t->heap_offset indicates whether we succeed. */
     t->heap_offset = 0;
     t->status = TIMER_STATUS_in_heap;
@@ -277,7 +487,7 @@ static inline void timer_unlock(struct timer *timer)
 static bool_t active_timer(struct timer *timer)
 {
     ASSERT(timer->status >= TIMER_STATUS_inactive);
-    ASSERT(timer->status <= TIMER_STATUS_in_list);
+    ASSERT(timer->status <= TIMER_STATUS_in_wheel);
     return (timer->status >= TIMER_STATUS_in_heap);
 }
 
@@ -432,11 +642,26 @@ static void timer_softirq_action(void)
 {
     struct timer  *t, **heap, *next;
     struct timers *ts;
+    struct timer_wheel *wheel;
     s_time_t       now, deadline;
+    unsigned int   i;
 
     ts = &this_cpu(timers);
     heap = ts->heap;
 
+    /* Set up the timer wheel on first use of this CPU's timers. */
+    if ( unlikely(ts->wheel == NULL) && opt_timer_wheel &&
+         ((wheel = xzalloc(struct timer_wheel)) != NULL) )
+    {
+        for ( i = 0; i < ARRAY_SIZE(wheel->bucket); i++ )
+            INIT_LIST_HEAD(&wheel->bucket[i]);
+        INIT_LIST_HEAD(&wheel->expired);
+        spin_lock_irq(&ts->lock);
+        wheel->clk = wheel_tick(NOW());
+        ts->wheel = wheel;
+        spin_unlock_irq(&ts->lock);
+    }
+
     /* If we overflowed the heap, try to allocate a larger heap. */
     if ( unlikely(ts->list != NULL) )
     {
@@ -476,6 +701,18 @@ static void timer_softirq_action(void)
         execute_timer(ts, t);
     }
 
+    /* Execute ready wheel timers. */
+    if ( (wheel = ts->wheel) != NULL )
+    {
+        advance_wheel(wheel, wheel_tick(now));
+        while ( !list_empty(&wheel->expired) )
+        {
+            t = list_entry(wheel->expired.next, struct timer, wheel);
+            remove_from_wheel(wheel, t);
+            execute_timer(ts, t);
+        }
+    }
+
     /* Try to move timers from linked list to more efficient heap. */
     next = ts->list;
     ts->list = NULL;
@@ -486,9 +723,12 @@ static void timer_softirq_action(void)
         add_entry(t);
     }
 
-    /* Find earliest deadline from head of linked list and top of heap. */
-    deadline = STIME_MAX;
-    if ( GET_HEAP_SIZE(heap) != 0 )
+    /*
+     * Find earliest deadline from head of linked list, top of heap and the
+     * next non-empty timer wheel bucket.
+     */
+    deadline = wheel_deadline(ts->wheel);
+    if ( (GET_HEAP_SIZE(heap) != 0) && (heap[1]->expires < deadline) )
         deadline = heap[1]->expires;
     if ( (ts->list != NULL) && (ts->list->expires < deadline) )
         deadline = ts->list->expires;
@@ -523,6 +763,7 @@ static void dump_timerq(unsigned char key)
     unsigned long  flags;
     s_time_t       now = NOW();
     int            i, j;
+    unsigned int   k;
 
     printk("Dumping timer queues:\n");
 
@@ -536,6 +777,13 @@ static void dump_timerq(unsigned char key)
             dump_timer(ts->heap[j], now);
         for ( t = ts->list, j = 0; t != NULL; t = t->list_next, j++ )
             dump_timer(t, now);
+        if ( ts->wheel != NULL )
+        {
+            printk(" wheel: %u timers\n", ts->wheel->count);
+            for ( k = 0; k < ARRAY_SIZE(ts->wheel->bucket); k++ )
+                list_for_each_entry ( t, &ts->wheel->bucket[k], wheel )
+                    dump_timer(t, now);
+        }
         spin_unlock_irqrestore(&ts->lock, flags);
     }
 }
@@ -552,6 +800,7 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
     struct timers *old_ts, *new_ts;
     struct timer *t;
     bool_t notify = 0;
+    unsigned int i;
 
     ASSERT(!cpu_online(old_cpu) && cpu_online(new_cpu));
 
@@ -577,6 +826,21 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
         notify |= add_entry(t);
     }
 
+    for ( i = 0; old_ts->wheel && old_ts->wheel->count; i++ )
+    {
+        struct list_head *bucket = &old_ts->wheel->expired;
+
+        if ( i < ARRAY_SIZE(old_ts->wheel->bucket) )
+            bucket = &old_ts->wheel->bucket[i];
+        while ( !list_empty(bucket) )
+        {
+            t = list_entry(bucket->next, struct timer, wheel);
+            remove_entry(t);
+            write_atomic(&t->cpu, new_cpu);
+            notify |= add_entry(t);
+        }
+    }
+
     while ( !list_empty(&old_ts->inactive) )
     {
         t = list_entry(old_ts->inactive.next, struct timer, inactive);
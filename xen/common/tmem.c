@@ -23,6 +23,7 @@
 #include <xen/radix-tree.h>
 #include <xen/list.h>
 #include <xen/init.h>
+#include <xen/cpu.h>
 
 #define TMEM_SPEC_VERSION 1
 
@@ -42,7 +43,7 @@ static int global_pgp_count_max = 0;
 static int global_pcd_count_max = 0;
 static int global_page_count_max = 0;
 static int global_rtree_node_count_max = 0;
-static long global_eph_count_max = 0;
+static int global_eph_count_max = 0;
 static unsigned long failed_copies;
 static unsigned long pcd_tot_tze_size = 0;
 static unsigned long pcd_tot_csize = 0;
@@ -60,6 +61,7 @@ struct client {
     struct tmem_pool *pools[MAX_POOLS_PER_DOMAIN];
     struct domain *domain;
     struct xmem_pool *persistent_pool;
+    spinlock_t eph_lock; /* protects ephemeral_page_list and eph_count */
     struct list_head ephemeral_page_list;
     long eph_count, eph_count_max;
     domid_t cli_id;
@@ -101,6 +103,7 @@ struct tmem_pool {
     uint32_t pool_id;
     rwlock_t pool_rwlock;
     struct rb_root obj_rb_root[OBJ_HASH_BUCKETS]; /* protected by pool_rwlock */
+    unsigned int obj_rb_seq; /* odd while obj_rb_root is being changed */
     struct list_head share_list; /* valid if shared */
     int shared_count; /* valid if shared */
     /* for save/restore/migration */
@@ -137,6 +140,7 @@ struct tmem_object_root {
     struct tmem_pool *pool;
     domid_t last_client;
     spinlock_t obj_spinlock;
+    struct rcu_head rcu;
 };
 
 struct tmem_object_node {
@@ -165,6 +169,7 @@ struct tmem_page_descriptor {
     /* must hold pcd_tree_rwlocks[firstbyte] to use pcd pointer/siblings */
     uint16_t firstbyte; /* NON_SHAREABLE->pfp  otherwise->pcd */
     bool_t eviction_attempted;  /* CHANGE TO lifetimes? (settable) */
+    uint16_t eph_cpu; /* which cpu's eph_lru global_eph_pages is on */
     struct list_head pcd_siblings;
     union {
         struct page_info *pfp;  /* page frame pointer */
@@ -195,7 +200,19 @@ struct tmem_page_content_descriptor {
 struct rb_root pcd_tree_roots[256]; /* choose based on first byte of page */
 rwlock_t pcd_tree_rwlocks[256]; /* poor man's concurrency for now */
 
-static LIST_HEAD(global_ephemeral_page_list); /* all pages in ephemeral pools */
+/*
+ * All pages in ephemeral pools, in LRU order, on the list of the cpu which
+ * did the put.  Splitting the list per cpu keeps concurrent puts and gets
+ * from different vcpus off each other's locks; eviction works through the
+ * local list first and then the others in turn.  Lock order is
+ * client->eph_lock, then eph_lru.lock.  A page's eph_cpu only changes with
+ * both held, when the pages of a cpu going offline are handed to another.
+ */
+struct tmem_eph_lru {
+    spinlock_t lock;
+    struct list_head list;
+};
+static DEFINE_PER_CPU(struct tmem_eph_lru, eph_lru);
 
 static LIST_HEAD(global_client_list);
 
@@ -212,14 +229,15 @@ PAGE_LIST_HEAD(tmem_page_list);
 unsigned long tmem_page_list_pages = 0;
 
 DEFINE_RWLOCK(tmem_rwlock);
-static DEFINE_SPINLOCK(eph_lists_spinlock); /* protects global AND clients */
 static DEFINE_SPINLOCK(pers_lists_spinlock);
 
 #define ASSERT_SPINLOCK(_l) ASSERT(spin_is_locked(_l))
 #define ASSERT_WRITELOCK(_l) ASSERT(rw_is_write_locked(_l))
 
+static DEFINE_RCU_READ_LOCK(tmem_rcu_lock);
+
 /* global counters (should use long_atomic_t access) */
-static long global_eph_count = 0; /* atomicity depends on eph_lists_spinlock */
+static atomic_t global_eph_count = ATOMIC_INIT(0);
 static atomic_t global_obj_count = ATOMIC_INIT(0);
 static atomic_t global_pgp_count = ATOMIC_INIT(0);
 static atomic_t global_pcd_count = ATOMIC_INIT(0);
@@ -608,6 +626,7 @@ static struct tmem_page_descriptor *pgp_alloc(struct tmem_object_root *obj)
     pgp->us.obj = obj;
     INIT_LIST_HEAD(&pgp->global_eph_pages);
     INIT_LIST_HEAD(&pgp->us.client_eph_pages);
+    pgp->eph_cpu = smp_processor_id();
     pgp->pfp = NULL;
     if ( tmem_dedup_enabled() )
     {
@@ -701,16 +720,20 @@ static void pgp_delist_free(struct tmem_page_descriptor *pgp)
     /* Delist pgp */
     if ( !is_persistent(pgp->us.obj->pool) )
     {
-        spin_lock(&eph_lists_spinlock);
+        struct tmem_eph_lru *lru;
+
+        spin_lock(&client->eph_lock);
+        lru = &per_cpu(eph_lru, pgp->eph_cpu);
+        spin_lock(&lru->lock);
         if ( !list_empty(&pgp->us.client_eph_pages) )
             client->eph_count--;
         ASSERT(client->eph_count >= 0);
         list_del_init(&pgp->us.client_eph_pages);
         if ( !list_empty(&pgp->global_eph_pages) )
-            global_eph_count--;
-        ASSERT(global_eph_count >= 0);
+            atomic_dec_and_assert(global_eph_count);
         list_del_init(&pgp->global_eph_pages);
-        spin_unlock(&eph_lists_spinlock);
+        spin_unlock(&lru->lock);
+        spin_unlock(&client->eph_lock);
     }
     else
     {
@@ -849,11 +872,67 @@ static unsigned oid_hash(struct oid *oidp)
                      BITS_PER_LONG) & OBJ_HASH_BUCKETS_MASK);
 }
 
-/* searches for object==oid in pool, returns locked object if found */
+/*
+ * Searches for object==oid in pool, returns locked object if found.
+ *
+ * The tree is first walked without pool_rwlock: objects are freed via RCU
+ * so the nodes stay valid under us, and a hit is confirmed once we hold the
+ * object's lock.  A miss is only believed if obj_rb_seq shows the tree
+ * didn't change during the walk.  Writers rebalancing the tree can send us
+ * the wrong way, so the walk is bounded and, after a few unlucky tries, we
+ * fall back to searching under the read lock.
+ */
+#define OBJ_FIND_LOCKLESS_TRIES 3
+#define OBJ_RB_MAX_DEPTH (2 * BITS_PER_LONG)
+
 static struct tmem_object_root * obj_find(struct tmem_pool *pool, struct oid *oidp)
 {
     struct rb_node *node;
     struct tmem_object_root *obj;
+    unsigned int seq, depth, tries;
+
+    for ( tries = 0; tries < OBJ_FIND_LOCKLESS_TRIES; tries++ )
+    {
+        seq = read_atomic(&pool->obj_rb_seq);
+        smp_rmb();
+        if ( seq & 1 )
+        {
+            cpu_relax();
+            continue;
+        }
+
+        rcu_read_lock(&tmem_rcu_lock);
+        node = pool->obj_rb_root[oid_hash(oidp)].rb_node;
+        for ( depth = 0; node && depth < OBJ_RB_MAX_DEPTH; depth++ )
+        {
+            obj = container_of(node, struct tmem_object_root, rb_tree_node);
+            switch ( oid_compare(&obj->oid, oidp) )
+            {
+                case 0: /* equal */
+                    spin_lock(&obj->obj_spinlock);
+                    if ( obj->pool == pool && !oid_compare(&obj->oid, oidp) )
+                    {
+                        rcu_read_unlock(&tmem_rcu_lock);
+                        return obj;
+                    }
+                    /* Raced with obj_free(). */
+                    spin_unlock(&obj->obj_spinlock);
+                    node = NULL;
+                    depth = OBJ_RB_MAX_DEPTH;
+                    break;
+                case -1:
+                    node = node->rb_left;
+                    break;
+                case 1:
+                    node = node->rb_right;
+            }
+        }
+        rcu_read_unlock(&tmem_rcu_lock);
+
+        smp_rmb();
+        if ( depth < OBJ_RB_MAX_DEPTH && read_atomic(&pool->obj_rb_seq) == seq )
+            return NULL;
+    }
 
 restart_find:
     read_lock(&pool->pool_rwlock);
@@ -882,6 +961,11 @@ restart_find:
     return NULL;
 }
 
+static void obj_free_rcu(struct rcu_head *head)
+{
+    tmem_free(container_of(head, struct tmem_object_root, rcu), NULL);
+}
+
 /* free an object that has no more pgps in it */
 static void obj_free(struct tmem_object_root *obj)
 {
@@ -903,12 +987,17 @@ static void obj_free(struct tmem_object_root *obj)
     ASSERT(pool->obj_count >= 0);
     obj->pool = NULL;
     old_oid = obj->oid;
+    pool->obj_rb_seq++;
+    smp_wmb();
     oid_set_invalid(&obj->oid);
     obj->last_client = TMEM_CLI_ID_NULL;
     atomic_dec_and_assert(global_obj_count);
     rb_erase(&obj->rb_tree_node, &pool->obj_rb_root[oid_hash(&old_oid)]);
+    smp_wmb();
+    pool->obj_rb_seq++;
     spin_unlock(&obj->obj_spinlock);
-    tmem_free(obj, pool);
+    /* Lockless obj_find() callers may still be looking at it. */
+    call_rcu(&obj->rcu, obj_free_rcu);
 }
 
 static int obj_rb_insert(struct rb_root *root, struct tmem_object_root *obj)
@@ -933,8 +1022,12 @@ static int obj_rb_insert(struct rb_root *root, struct tmem_object_root *obj)
                 break;
         }
     }
+    obj->pool->obj_rb_seq++;
+    smp_wmb();
     rb_link_node(&obj->rb_tree_node, parent, new);
     rb_insert_color(&obj->rb_tree_node, root);
+    smp_wmb();
+    obj->pool->obj_rb_seq++;
     return 1;
 }
 
@@ -947,7 +1040,11 @@ static struct tmem_object_root * obj_alloc(struct tmem_pool *pool, struct oid *o
     struct tmem_object_root *obj;
 
     ASSERT(pool != NULL);
-    if ( (obj = tmem_malloc(sizeof(struct tmem_object_root), pool)) == NULL )
+    /*
+     * Always from the global mempool, never a client's persistent pool: the
+     * RCU-deferred free may run after the pool and its client are gone.
+     */
+    if ( (obj = tmem_malloc(sizeof(struct tmem_object_root), NULL)) == NULL )
         return NULL;
     pool->obj_count++;
     if (pool->obj_count > pool->obj_count_max)
@@ -1062,10 +1159,14 @@ static void shared_pool_reassign(struct tmem_pool *pool)
         if (new_client->pools[poolid] == pool)
             break;
     ASSERT(poolid != MAX_POOLS_PER_DOMAIN);
+    spin_lock(&old_client->eph_lock);
+    spin_lock(&new_client->eph_lock);
     new_client->eph_count += _atomic_read(pool->pgp_count);
     old_client->eph_count -= _atomic_read(pool->pgp_count);
     list_splice_init(&old_client->ephemeral_page_list,
                      &new_client->ephemeral_page_list);
+    spin_unlock(&new_client->eph_lock);
+    spin_unlock(&old_client->eph_lock);
     tmem_client_info("reassigned shared pool from %s=%d to %s=%d pool_id=%d\n",
         tmem_cli_id_str, old_client->cli_id, tmem_cli_id_str, new_client->cli_id, poolid);
     pool->pool_id = poolid;
@@ -1179,6 +1280,7 @@ static struct client *client_create(domid_t cli_id)
         client->shared_auth_uuid[i][0] =
             client->shared_auth_uuid[i][1] = -1L;
     list_add_tail(&client->client_list, &global_client_list);
+    spin_lock_init(&client->eph_lock);
     INIT_LIST_HEAD(&client->ephemeral_page_list);
     INIT_LIST_HEAD(&client->persistent_invalidated_list);
     tmem_client_info("ok\n");
@@ -1220,7 +1322,7 @@ static bool_t client_over_quota(struct client *client)
     if ( (total == 0) || (client->weight == 0) || 
           (client->eph_count == 0) )
         return 0;
-    return ( ((global_eph_count*100L) / client->eph_count ) >
+    return ( ((_atomic_read(global_eph_count)*100L) / client->eph_count ) >
              ((total*100L) / client->weight) );
 }
 
@@ -1248,10 +1350,10 @@ static bool_t tmem_try_to_evict_pgp(struct tmem_page_descriptor *pgp, bool_t *ho
             if ( pgp->pcd->pgp_ref_count > 1 && !pgp->eviction_attempted )
             {
                 pgp->eviction_attempted++;
-                list_del(&pgp->global_eph_pages);
-                list_add_tail(&pgp->global_eph_pages,&global_ephemeral_page_list);
-                list_del(&pgp->us.client_eph_pages);
-                list_add_tail(&pgp->us.client_eph_pages,&client->ephemeral_page_list);
+                list_move_tail(&pgp->global_eph_pages,
+                               &per_cpu(eph_lru, pgp->eph_cpu).list);
+                list_move_tail(&pgp->us.client_eph_pages,
+                               &client->ephemeral_page_list);
                 goto pcd_unlock;
             }
         }
@@ -1277,29 +1379,50 @@ static int tmem_evict(void)
     struct tmem_page_descriptor *pgp = NULL, *pgp_del;
     struct tmem_object_root *obj;
     struct tmem_pool *pool;
+    struct tmem_eph_lru *lru;
+    unsigned int i, cpu;
     int ret = 0;
     bool_t hold_pool_rwlock = 0;
 
     evict_attempts++;
-    spin_lock(&eph_lists_spinlock);
     if ( (client != NULL) && client_over_quota(client) &&
          !list_empty(&client->ephemeral_page_list) )
     {
+        spin_lock(&client->eph_lock);
         list_for_each_entry(pgp, &client->ephemeral_page_list, us.client_eph_pages)
+        {
+            lru = &per_cpu(eph_lru, pgp->eph_cpu);
+            spin_lock(&lru->lock);
             if ( tmem_try_to_evict_pgp(pgp, &hold_pool_rwlock) )
                 goto found;
+            spin_unlock(&lru->lock);
+        }
+        spin_unlock(&client->eph_lock);
+        goto out;
     }
-    else if ( !list_empty(&global_ephemeral_page_list) )
+
+    /* Oldest pages on this cpu first, then the other cpus' lists. */
+    cpu = smp_processor_id();
+    for ( i = 0; i < num_online_cpus();
+          i++, cpu = cpumask_cycle(cpu, &cpu_online_map) )
     {
-        list_for_each_entry(pgp, &global_ephemeral_page_list, global_eph_pages)
+        lru = &per_cpu(eph_lru, cpu);
+        if ( list_empty(&lru->list) )
+            continue;
+        spin_lock(&lru->lock);
+        list_for_each_entry(pgp, &lru->list, global_eph_pages)
+        {
+            /* Wrong lock order, so only trylock the client. */
+            client = pgp->us.obj->pool->client;
+            if ( !spin_trylock(&client->eph_lock) )
+                continue;
             if ( tmem_try_to_evict_pgp(pgp, &hold_pool_rwlock) )
-            {
-                client = pgp->us.obj->pool->client;
                 goto found;
-            }
+            spin_unlock(&client->eph_lock);
+        }
+        spin_unlock(&lru->lock);
     }
-     /* global_ephemeral_page_list is empty, so we bail out. */
-    spin_unlock(&eph_lists_spinlock);
+    /* All ephemeral lists are empty (or busy), so we bail out. */
     goto out;
 
 found:
@@ -1307,10 +1430,10 @@ found:
     list_del_init(&pgp->us.client_eph_pages);
     client->eph_count--;
     list_del_init(&pgp->global_eph_pages);
-    global_eph_count--;
-    ASSERT(global_eph_count >= 0);
+    atomic_dec_and_assert(global_eph_count);
     ASSERT(client->eph_count >= 0);
-    spin_unlock(&eph_lists_spinlock);
+    spin_unlock(&lru->lock);
+    spin_unlock(&client->eph_lock);
 
     ASSERT(pgp != NULL);
     obj = pgp->us.obj;
@@ -1565,7 +1688,7 @@ refind:
 	 */
         if (!obj_rb_insert(&pool->obj_rb_root[oid_hash(oidp)], obj))
         {
-            tmem_free(obj, pool);
+            tmem_free(obj, NULL);
             write_unlock(&pool->pool_rwlock);
             goto refind;
         }
@@ -1630,16 +1753,20 @@ copy_uncompressed:
 insert_page:
     if ( !is_persistent(pool) )
     {
-        spin_lock(&eph_lists_spinlock);
-        list_add_tail(&pgp->global_eph_pages,
-            &global_ephemeral_page_list);
-        if (++global_eph_count > global_eph_count_max)
-            global_eph_count_max = global_eph_count;
+        struct tmem_eph_lru *lru;
+
+        spin_lock(&client->eph_lock);
+        pgp->eph_cpu = smp_processor_id();
+        lru = &per_cpu(eph_lru, pgp->eph_cpu);
+        spin_lock(&lru->lock);
+        list_add_tail(&pgp->global_eph_pages, &lru->list);
         list_add_tail(&pgp->us.client_eph_pages,
             &client->ephemeral_page_list);
+        spin_unlock(&lru->lock);
         if (++client->eph_count > client->eph_count_max)
             client->eph_count_max = client->eph_count;
-        spin_unlock(&eph_lists_spinlock);
+        spin_unlock(&client->eph_lock);
+        atomic_inc_and_max(global_eph_count);
     }
     else
     { /* is_persistent */
@@ -1738,12 +1865,16 @@ static int do_tmem_get(struct tmem_pool *pool, struct oid *oidp, uint32_t index,
                 write_unlock(&pool->pool_rwlock);
             }
         } else {
-            spin_lock(&eph_lists_spinlock);
-            list_del(&pgp->global_eph_pages);
-            list_add_tail(&pgp->global_eph_pages,&global_ephemeral_page_list);
-            list_del(&pgp->us.client_eph_pages);
-            list_add_tail(&pgp->us.client_eph_pages,&client->ephemeral_page_list);
-            spin_unlock(&eph_lists_spinlock);
+            struct tmem_eph_lru *lru;
+
+            spin_lock(&client->eph_lock);
+            lru = &per_cpu(eph_lru, pgp->eph_cpu);
+            spin_lock(&lru->lock);
+            list_move_tail(&pgp->global_eph_pages, &lru->list);
+            list_move_tail(&pgp->us.client_eph_pages,
+                           &client->ephemeral_page_list);
+            spin_unlock(&lru->lock);
+            spin_unlock(&client->eph_lock);
             obj->last_client = current->domain->domain_id;
         }
     }
@@ -2175,9 +2306,9 @@ static int tmemc_list_global(tmem_cli_va_param_t buf, int off, uint32_t len,
       total_flush_pool, use_long ? ',' : '\n');
     if (use_long)
         n += scnprintf(info+n,BSIZE-n,
-          "Ec:%ld,Em:%ld,Oc:%d,Om:%d,Nc:%d,Nm:%d,Pc:%d,Pm:%d,"
+          "Ec:%d,Em:%d,Oc:%d,Om:%d,Nc:%d,Nm:%d,Pc:%d,Pm:%d,"
           "Fc:%d,Fm:%d,Sc:%d,Sm:%d,Ep:%lu,Gd:%lu,Zt:%lu,Gz:%lu\n",
-          global_eph_count, global_eph_count_max,
+          _atomic_read(global_eph_count), global_eph_count_max,
           _atomic_read(global_obj_count), global_obj_count_max,
           _atomic_read(global_rtree_node_count), global_rtree_node_count_max,
           _atomic_read(global_pgp_count), global_pgp_count_max,
@@ -2628,6 +2759,7 @@ long do_tmem_op(tmem_cli_op_t uops)
     bool_t succ_get = 0, succ_put = 0;
     bool_t non_succ_get = 0, non_succ_put = 0;
     bool_t flush = 0, flush_obj = 0;
+    bool_t write_locked;
 
     if ( !tmem_initialized )
         return -ENODEV;
@@ -2650,8 +2782,18 @@ long do_tmem_op(tmem_cli_op_t uops)
         return -EFAULT;
     }
 
-    /* Acquire wirte lock for all command at first */
-    write_lock(&tmem_rwlock);
+    /*
+     * Page operations from an existing client only need the read lock.
+     * Everything else may create or destroy clients or pools, so takes the
+     * write lock, at least to begin with.
+     */
+    write_locked = client == NULL ||
+                   (op.cmd != TMEM_PUT_PAGE && op.cmd != TMEM_GET_PAGE &&
+                    op.cmd != TMEM_FLUSH_PAGE && op.cmd != TMEM_FLUSH_OBJECT);
+    if ( write_locked )
+        write_lock(&tmem_rwlock);
+    else
+        read_lock(&tmem_rwlock);
 
     if ( op.cmd == TMEM_CONTROL )
     {
@@ -2693,6 +2835,13 @@ long do_tmem_op(tmem_cli_op_t uops)
         }
         else
         {
+            /* Commands only need read lock */
+            if ( write_locked )
+            {
+                write_unlock(&tmem_rwlock);
+                read_lock(&tmem_rwlock);
+                write_locked = 0;
+            }
             if ( ((uint32_t)op.pool_id >= MAX_POOLS_PER_DOMAIN) ||
                  ((pool = client->pools[op.pool_id]) == NULL) )
             {
@@ -2700,9 +2849,6 @@ long do_tmem_op(tmem_cli_op_t uops)
                 rc = -ENODEV;
                 goto out;
             }
-            /* Commands only need read lock */
-            write_unlock(&tmem_rwlock);
-            read_lock(&tmem_rwlock);
 
             oidp = (struct oid *)&op.u.gen.oid[0];
             switch ( op.cmd )
@@ -2746,7 +2892,10 @@ long do_tmem_op(tmem_cli_op_t uops)
         }
     }
 out:
-    write_unlock(&tmem_rwlock);
+    if ( write_locked )
+        write_unlock(&tmem_rwlock);
+    else
+        read_unlock(&tmem_rwlock);
     if ( rc < 0 )
         errored_tmem_ops++;
     return rc;
@@ -2817,13 +2966,74 @@ unsigned long tmem_freeable_pages(void)
     return tmem_page_list_pages + _atomic_read(freeable_page_count);
 }
 
+/* Hand the ephemeral pages of a dead cpu to a live one. */
+static void eph_lru_migrate(unsigned int from, unsigned int to)
+{
+    struct tmem_eph_lru *old = &per_cpu(eph_lru, from);
+    struct tmem_eph_lru *new = &per_cpu(eph_lru, to);
+    struct tmem_page_descriptor *pgp;
+    struct client *client;
+
+    spin_lock(&old->lock);
+    while ( !list_empty(&old->list) )
+    {
+        pgp = list_entry(old->list.next, struct tmem_page_descriptor,
+                         global_eph_pages);
+        /* Wrong lock order, so only trylock the client. */
+        client = pgp->us.obj->pool->client;
+        if ( !spin_trylock(&client->eph_lock) )
+        {
+            spin_unlock(&old->lock);
+            cpu_relax();
+            spin_lock(&old->lock);
+            continue;
+        }
+        spin_lock(&new->lock);
+        list_move_tail(&pgp->global_eph_pages, &new->list);
+        pgp->eph_cpu = to;
+        spin_unlock(&new->lock);
+        spin_unlock(&client->eph_lock);
+    }
+    spin_unlock(&old->lock);
+}
+
+static int cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&per_cpu(eph_lru, cpu).lock);
+        INIT_LIST_HEAD(&per_cpu(eph_lru, cpu).list);
+        break;
+    case CPU_DEAD:
+        eph_lru_migrate(cpu, smp_processor_id());
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback
+};
+
 /* called at hypervisor startup */
 static int __init init_tmem(void)
 {
+    unsigned int cpu;
     int i;
     if ( !tmem_enabled() )
         return 0;
 
+    for_each_online_cpu ( cpu )
+        cpu_callback(&cpu_nfb, CPU_UP_PREPARE, (void *)(long)cpu);
+    register_cpu_notifier(&cpu_nfb);
+
     if ( tmem_dedup_enabled() )
         for (i = 0; i < 256; i++ )
         {
@@ -330,6 +330,27 @@ static void set_pde_count(u64 *pde, unsigned int count)
     *pde |= ((count & upper_mask ) << 55) | ((count & lower_mask ) << 1);
 }
 
+/* The pde count only tracks mapping events, so before merging make sure
+ * that all entries of the next level table really are leaves mapping one
+ * contiguous range with identical permissions.
+ */
+static bool_t iommu_table_is_contiguous(const u64 *ntable,
+                                        unsigned int next_level)
+{
+    u64 step = (u64)PAGE_SIZE << (PTE_PER_TABLE_SHIFT * (next_level - 1));
+    unsigned int i;
+
+    if ( !iommu_is_pte_present((const u32 *)ntable) ||
+         iommu_next_level((const u32 *)ntable) != 0 )
+        return 0;
+
+    for ( i = 1; i < PTE_PER_TABLE_SIZE; i++ )
+        if ( ntable[i] != ntable[0] + i * step )
+            return 0;
+
+    return 1;
+}
+
 /* Return 1, if pages are suitable for merging at merge_level.
  * otherwise increase pde count if mfn is contigous with mfn - 1
  */
@@ -370,7 +391,7 @@ static int iommu_update_pde_count(struct domain *d, unsigned long pt_mfn,
         pde_count = get_pde_count(*pde);
 
         if ( pde_count == (PTE_PER_TABLE_SIZE - 1) )
-            ok = 1;
+            ok = iommu_table_is_contiguous(ntable, next_level);
         else if ( pde_count < (PTE_PER_TABLE_SIZE - 1))
         {
             pde_count++;
@@ -425,8 +446,8 @@ static int iommu_merge_pages(struct domain *d, unsigned long pt_mfn,
     /* setup super page mapping, next level = 0 */
     set_iommu_pde_present((u32*)pde, first_mfn,
                           IOMMU_PAGING_MODE_LEVEL_0,
-                          !!(flags & IOMMUF_writable),
-                          !!(flags & IOMMUF_readable));
+                          iommu_pte_writable((u32*)ntable),
+                          iommu_pte_readable((u32*)ntable));
 
     amd_iommu_flush_all_pages(d);
 
@@ -440,7 +461,7 @@ static int iommu_merge_pages(struct domain *d, unsigned long pt_mfn,
  * page tables.
  */
 static int iommu_pde_from_gfn(struct domain *d, unsigned long pfn, 
-                              unsigned long pt_mfn[])
+                              unsigned long pt_mfn[], unsigned int target)
 {
     u64 *pde, *next_table_vaddr;
     unsigned long  next_table_mfn;
@@ -462,7 +483,7 @@ static int iommu_pde_from_gfn(struct domain *d, unsigned long pfn,
         return 0;
     }
 
-    while ( level > IOMMU_PAGING_MODE_LEVEL_1 )
+    while ( level > target )
     {
         unsigned int next_level = level - 1;
         pt_mfn[level] = next_table_mfn;
@@ -482,6 +503,8 @@ static int iommu_pde_from_gfn(struct domain *d, unsigned long pfn,
             int i;
             unsigned long mfn, gfn;
             unsigned int page_sz;
+            bool_t iw = iommu_pte_writable((u32*)pde);
+            bool_t ir = iommu_pte_readable((u32*)pde);
 
             page_sz = 1 << (PTE_PER_TABLE_SHIFT * (next_level - 1));
             gfn =  pfn & ~((1 << (PTE_PER_TABLE_SHIFT * next_level)) - 1);
@@ -503,7 +526,7 @@ static int iommu_pde_from_gfn(struct domain *d, unsigned long pfn,
             for ( i = 0; i < PTE_PER_TABLE_SIZE; i++ )
             {
                 set_iommu_pte_present(next_table_mfn, gfn, mfn, next_level,
-                                      !!IOMMUF_writable, !!IOMMUF_readable);
+                                      iw, ir);
                 mfn += page_sz;
                 gfn += page_sz;
              }
@@ -538,7 +561,7 @@ static int iommu_pde_from_gfn(struct domain *d, unsigned long pfn,
         level--;
     }
 
-    /* mfn of level 1 page table */
+    /* mfn of the page table at the target level */
     pt_mfn[level] = next_table_mfn;
     return 0;
 }
@@ -630,13 +653,46 @@ static int update_paging_mode(struct domain *d, unsigned long gfn)
     return 0;
 }
 
+/*
+ * Having just installed a leaf at level merge_level - 1, replace the tables
+ * holding it with superpage leaves for as long as they've become fully
+ * contiguous.
+ */
+static int iommu_merge_from(struct domain *d, unsigned long pt_mfn[],
+                            unsigned long gfn, unsigned long mfn,
+                            unsigned int flags, unsigned int merge_level)
+{
+    struct hvm_iommu *hd = domain_hvm_iommu(d);
+
+    for ( ; merge_level <= hd->arch.paging_mode; merge_level++ )
+    {
+        if ( pt_mfn[merge_level] == 0 )
+            break;
+        if ( !iommu_update_pde_count(d, pt_mfn[merge_level],
+                                     gfn, mfn, merge_level) )
+            break;
+
+        if ( iommu_merge_pages(d, pt_mfn[merge_level], gfn, 
+                               flags, merge_level) )
+        {
+            AMD_IOMMU_DEBUG("Merge iommu page failed at level %d, "
+                            "gfn = %lx mfn = %lx\n", merge_level, gfn, mfn);
+            return -EFAULT;
+        }
+
+        /* Deallocate lower level page table */
+        free_amd_iommu_pgtable(mfn_to_page(pt_mfn[merge_level - 1]));
+    }
+
+    return 0;
+}
+
 int amd_iommu_map_page(struct domain *d, unsigned long gfn, unsigned long mfn,
                        unsigned int flags)
 {
     bool_t need_flush = 0;
     struct hvm_iommu *hd = domain_hvm_iommu(d);
     unsigned long pt_mfn[7];
-    unsigned int merge_level;
 
     BUG_ON( !hd->arch.root_table );
 
@@ -660,7 +716,8 @@ int amd_iommu_map_page(struct domain *d, unsigned long gfn, unsigned long mfn,
         }
     }
 
-    if ( iommu_pde_from_gfn(d, gfn, pt_mfn) || (pt_mfn[1] == 0) )
+    if ( iommu_pde_from_gfn(d, gfn, pt_mfn, IOMMU_PAGING_MODE_LEVEL_1) ||
+         (pt_mfn[1] == 0) )
     {
         spin_unlock(&hd->arch.mapping_lock);
         AMD_IOMMU_DEBUG("Invalid IO pagetable entry gfn = %lx\n", gfn);
@@ -680,34 +737,110 @@ int amd_iommu_map_page(struct domain *d, unsigned long gfn, unsigned long mfn,
 
     /* 4K mapping for PV guests never changes, 
      * no need to flush if we trust non-present bits */
-    if ( is_hvm_domain(d) )
+    if ( is_hvm_domain(d) && !this_cpu(iommu_dont_flush_iotlb) )
         amd_iommu_flush_pages(d, gfn, 0);
 
-    for ( merge_level = IOMMU_PAGING_MODE_LEVEL_2;
-          merge_level <= hd->arch.paging_mode; merge_level++ )
+    if ( iommu_merge_from(d, pt_mfn, gfn, mfn, flags,
+                          IOMMU_PAGING_MODE_LEVEL_2) )
     {
-        if ( pt_mfn[merge_level] == 0 )
-            break;
-        if ( !iommu_update_pde_count(d, pt_mfn[merge_level],
-                                     gfn, mfn, merge_level) )
-            break;
+        spin_unlock(&hd->arch.mapping_lock);
+        domain_crash(d);
+        return -EFAULT;
+    }
 
-        if ( iommu_merge_pages(d, pt_mfn[merge_level], gfn, 
-                               flags, merge_level) )
-        {
-            spin_unlock(&hd->arch.mapping_lock);
-            AMD_IOMMU_DEBUG("Merge iommu page failed at level %d, "
-                            "gfn = %lx mfn = %lx\n", merge_level, gfn, mfn);
-            domain_crash(d);
-            return -EFAULT;
-        }
+out:
+    spin_unlock(&hd->arch.mapping_lock);
+    return 0;
+}
 
-        /* Deallocate lower level page table */
-        free_amd_iommu_pgtable(mfn_to_page(pt_mfn[merge_level - 1]));
+/*
+ * Map 2^order pages (2M or 1G) through a single leaf pde, replacing any
+ * lower level table there.
+ */
+int amd_iommu_map_pages(struct domain *d, unsigned long gfn, unsigned long mfn,
+                        unsigned int order, unsigned int flags)
+{
+    struct hvm_iommu *hd = domain_hvm_iommu(d);
+    unsigned long pt_mfn[7];
+    unsigned int level = order / PTE_PER_TABLE_SHIFT + 1;
+    u64 *table, *pde, old;
+    struct page_info *old_table = NULL;
+    unsigned int old_level = 0;
+
+    BUG_ON( !hd->arch.root_table );
+
+    if ( (order % PTE_PER_TABLE_SHIFT) || level < IOMMU_PAGING_MODE_LEVEL_2 ||
+         level > IOMMU_PAGING_MODE_LEVEL_3 || !iommu_superpages )
+        return -EOPNOTSUPP;
+
+    if ( iommu_use_hap_pt(d) )
+        return 0;
+
+    memset(pt_mfn, 0, sizeof(pt_mfn));
+
+    spin_lock(&hd->arch.mapping_lock);
+
+    if ( is_hvm_domain(d) && update_paging_mode(d, gfn) )
+    {
+        spin_unlock(&hd->arch.mapping_lock);
+        AMD_IOMMU_DEBUG("Update page mode failed gfn = %lx\n", gfn);
+        domain_crash(d);
+        return -EFAULT;
+    }
+
+    if ( level >= hd->arch.paging_mode )
+    {
+        spin_unlock(&hd->arch.mapping_lock);
+        return -EOPNOTSUPP;
+    }
+
+    if ( iommu_pde_from_gfn(d, gfn, pt_mfn, level) || (pt_mfn[level] == 0) )
+    {
+        spin_unlock(&hd->arch.mapping_lock);
+        AMD_IOMMU_DEBUG("Invalid IO pagetable entry gfn = %lx\n", gfn);
+        domain_crash(d);
+        return -EFAULT;
+    }
+
+    table = map_domain_page(pt_mfn[level]);
+    pde = table + pfn_to_pde_idx(gfn, level);
+    old = *pde;
+    if ( iommu_is_pte_present((u32*)pde) && iommu_next_level((u32*)pde) )
+    {
+        old_table = maddr_to_page(amd_iommu_get_next_table_from_pte((u32*)pde));
+        old_level = iommu_next_level((u32*)pde);
+    }
+    set_iommu_pde_present((u32*)pde, mfn, IOMMU_PAGING_MODE_LEVEL_0,
+                          !!(flags & IOMMUF_writable),
+                          !!(flags & IOMMUF_readable));
+    if ( *pde == old )
+    {
+        unmap_domain_page(table);
+        spin_unlock(&hd->arch.mapping_lock);
+        return 0;
+    }
+    unmap_domain_page(table);
+
+    if ( iommu_merge_from(d, pt_mfn, gfn, mfn, flags, level + 1) )
+    {
+        spin_unlock(&hd->arch.mapping_lock);
+        domain_crash(d);
+        return -EFAULT;
     }
 
-out:
     spin_unlock(&hd->arch.mapping_lock);
+
+    /* A replaced table may only be freed once the IOTLB is clean. */
+    if ( old_table )
+    {
+        amd_iommu_flush_pages(d, gfn, order);
+        deallocate_next_page_table(old_table, old_level);
+        iommu_pt_cleanup_schedule();
+    }
+    else if ( iommu_is_pte_present((u32*)&old) &&
+              !this_cpu(iommu_dont_flush_iotlb) )
+        amd_iommu_flush_pages(d, gfn, order);
+
     return 0;
 }
 
@@ -738,7 +871,8 @@ int amd_iommu_unmap_page(struct domain *d, unsigned long gfn)
         }
     }
 
-    if ( iommu_pde_from_gfn(d, gfn, pt_mfn) || (pt_mfn[1] == 0) )
+    if ( iommu_pde_from_gfn(d, gfn, pt_mfn, IOMMU_PAGING_MODE_LEVEL_1) ||
+         (pt_mfn[1] == 0) )
     {
         spin_unlock(&hd->arch.mapping_lock);
         AMD_IOMMU_DEBUG("Invalid IO pagetable entry gfn = %lx\n", gfn);
@@ -750,11 +884,109 @@ int amd_iommu_unmap_page(struct domain *d, unsigned long gfn)
     clear_iommu_pte_present(pt_mfn[1], gfn);
     spin_unlock(&hd->arch.mapping_lock);
 
-    amd_iommu_flush_pages(d, gfn, 0);
+    if ( !this_cpu(iommu_dont_flush_iotlb) )
+        amd_iommu_flush_pages(d, gfn, 0);
 
     return 0;
 }
 
+/* Drop the level order / 9 + 1 pde covering 2^order pages (2M or 1G). */
+int amd_iommu_unmap_pages(struct domain *d, unsigned long gfn,
+                          unsigned int order)
+{
+    struct hvm_iommu *hd = domain_hvm_iommu(d);
+    unsigned long pt_mfn[7];
+    unsigned int level = order / PTE_PER_TABLE_SHIFT + 1;
+    u64 *table, *pde, old;
+
+    BUG_ON( !hd->arch.root_table );
+
+    if ( (order % PTE_PER_TABLE_SHIFT) || level < IOMMU_PAGING_MODE_LEVEL_2 ||
+         level > IOMMU_PAGING_MODE_LEVEL_3 )
+        return -EOPNOTSUPP;
+
+    if ( iommu_use_hap_pt(d) )
+        return 0;
+
+    memset(pt_mfn, 0, sizeof(pt_mfn));
+
+    spin_lock(&hd->arch.mapping_lock);
+
+    if ( is_hvm_domain(d) && update_paging_mode(d, gfn) )
+    {
+        spin_unlock(&hd->arch.mapping_lock);
+        AMD_IOMMU_DEBUG("Update page mode failed gfn = %lx\n", gfn);
+        domain_crash(d);
+        return -EFAULT;
+    }
+
+    if ( level >= hd->arch.paging_mode )
+    {
+        spin_unlock(&hd->arch.mapping_lock);
+        return -EOPNOTSUPP;
+    }
+
+    if ( iommu_pde_from_gfn(d, gfn, pt_mfn, level) || (pt_mfn[level] == 0) )
+    {
+        spin_unlock(&hd->arch.mapping_lock);
+        AMD_IOMMU_DEBUG("Invalid IO pagetable entry gfn = %lx\n", gfn);
+        domain_crash(d);
+        return -EFAULT;
+    }
+
+    table = map_domain_page(pt_mfn[level]);
+    pde = table + pfn_to_pde_idx(gfn, level);
+    old = *pde;
+    *pde = 0;
+    unmap_domain_page(table);
+    spin_unlock(&hd->arch.mapping_lock);
+
+    if ( !iommu_is_pte_present((u32*)&old) )
+        return 0;
+
+    /* A table may only be freed once the IOTLB is clean. */
+    if ( iommu_next_level((u32*)&old) )
+    {
+        amd_iommu_flush_pages(d, gfn, order);
+        deallocate_next_page_table(
+            maddr_to_page(amd_iommu_get_next_table_from_pte((u32*)&old)),
+            iommu_next_level((u32*)&old));
+        iommu_pt_cleanup_schedule();
+    }
+    else if ( !this_cpu(iommu_dont_flush_iotlb) )
+        amd_iommu_flush_pages(d, gfn, order);
+
+    return 0;
+}
+
+/*
+ * INVALIDATE_IOMMU_PAGES only takes 4k, 2M or 1G sized ranges, so round the
+ * range up to the smallest naturally aligned one of those covering it, and
+ * fall back to invalidating everything for the domain beyond that.
+ */
+void amd_iommu_iotlb_flush(struct domain *d, unsigned long gfn,
+                           unsigned int page_count)
+{
+    unsigned long diff = gfn ^ (gfn + page_count - 1);
+
+    if ( !page_count )
+        return;
+
+    if ( !diff )
+        amd_iommu_flush_pages(d, gfn, 0);
+    else if ( !(diff >> 9) )
+        amd_iommu_flush_pages(d, gfn, 9);
+    else if ( !(diff >> 18) )
+        amd_iommu_flush_pages(d, gfn, 18);
+    else
+        amd_iommu_flush_all_pages(d);
+}
+
+void amd_iommu_iotlb_flush_all(struct domain *d)
+{
+    amd_iommu_flush_all_pages(d);
+}
+
 int amd_iommu_reserve_domain_unity_map(struct domain *domain,
                                        u64 phys_addr,
                                        unsigned long size, int iw, int ir)
@@ -405,7 +405,7 @@ static int amd_iommu_assign_device(struct domain *d, u8 devfn,
     return reassign_device(hardware_domain, d, devfn, pdev);
 }
 
-static void deallocate_next_page_table(struct page_info *pg, int level)
+void deallocate_next_page_table(struct page_info *pg, int level)
 {
     PFN_ORDER(pg) = level;
     spin_lock(&iommu_pt_cleanup_lock);
@@ -600,6 +600,47 @@ static void amd_dump_p2m_table(struct domain *d)
     amd_dump_p2m_table_level(hd->arch.root_table, hd->arch.paging_mode, 0, 0);
 }
 
+static void amd_pgtable_stats_level(struct page_info *pg, unsigned int level,
+                                    struct iommu_pgtable_stats *stats)
+{
+    void *table_vaddr;
+    u32 *entry;
+    unsigned int index, next_level;
+
+    table_vaddr = __map_domain_page(pg);
+    stats->tables++;
+
+    for ( index = 0; index < PTE_PER_TABLE_SIZE; index++ )
+    {
+        if ( !(index % 64) )
+            process_pending_softirqs();
+
+        entry = table_vaddr + (index * IOMMU_PAGE_TABLE_ENTRY_SIZE);
+        if ( !iommu_is_pte_present(entry) )
+            continue;
+
+        next_level = iommu_next_level(entry);
+        if ( next_level && next_level == level - 1 )
+            amd_pgtable_stats_level(
+                maddr_to_page(amd_iommu_get_next_table_from_pte(entry)),
+                next_level, stats);
+        else if ( !next_level && level <= IOMMU_STATS_LEVELS )
+            stats->leaves[level - 1]++;
+    }
+
+    unmap_domain_page(table_vaddr);
+}
+
+static void amd_pgtable_stats(struct domain *d,
+                              struct iommu_pgtable_stats *stats)
+{
+    struct hvm_iommu *hd  = domain_hvm_iommu(d);
+
+    if ( hd->arch.root_table )
+        amd_pgtable_stats_level(hd->arch.root_table, hd->arch.paging_mode,
+                                stats);
+}
+
 const struct iommu_ops amd_iommu_ops = {
     .init = amd_iommu_domain_init,
     .hwdom_init = amd_iommu_hwdom_init,
@@ -609,6 +650,8 @@ const struct iommu_ops amd_iommu_ops = {
     .teardown = amd_iommu_domain_destroy,
     .map_page = amd_iommu_map_page,
     .unmap_page = amd_iommu_unmap_page,
+    .map_pages = amd_iommu_map_pages,
+    .unmap_pages = amd_iommu_unmap_pages,
     .free_page_table = deallocate_page_table,
     .reassign_device = reassign_device,
     .get_device_group_id = amd_iommu_group_id,
@@ -621,5 +664,8 @@ const struct iommu_ops amd_iommu_ops = {
     .resume = amd_iommu_resume,
     .share_p2m = amd_iommu_share_p2m,
     .crash_shutdown = amd_iommu_suspend,
+    .iotlb_flush = amd_iommu_iotlb_flush,
+    .iotlb_flush_all = amd_iommu_iotlb_flush_all,
     .dump_p2m_table = amd_dump_p2m_table,
+    .pgtable_stats = amd_pgtable_stats,
 };
@@ -25,6 +25,7 @@
 
 static void parse_iommu_param(char *s);
 static void iommu_dump_p2m_table(unsigned char key);
+static void iommu_dump_pgtable_stats(unsigned char key);
 
 /*
  * The 'iommu' parameter enables the IOMMU.  Optional comma separated
@@ -39,6 +40,7 @@ static void iommu_dump_p2m_table(unsigned char key);
  *   no-snoop                   Disable VT-d Snoop Control
  *   no-qinval                  Disable VT-d Queued Invalidation
  *   no-intremap                Disable VT-d Interrupt Remapping
+ *   no-superpages              Build DMA page tables from 4k leaves only
  */
 custom_param("iommu", parse_iommu_param);
 bool_t __initdata iommu_enable = 1;
@@ -52,11 +54,29 @@ bool_t __read_mostly iommu_snoop = 1;
 bool_t __read_mostly iommu_qinval = 1;
 bool_t __read_mostly iommu_intremap = 1;
 bool_t __read_mostly iommu_hap_pt_share = 1;
+bool_t __read_mostly iommu_superpages = 1;
 bool_t __read_mostly iommu_debug;
 bool_t __read_mostly amd_iommu_perdev_intremap = 1;
 
 DEFINE_PER_CPU(bool_t, iommu_dont_flush_iotlb);
 
+/*
+ * State of an iommu_batch_begin()/iommu_batch_end() section on this CPU:
+ * the span of gfns whose mappings in @domain were changed without an IOTLB
+ * flush, and whether the caller of the outermost section had already asked
+ * for flushes to be suppressed (in which case flushing is left to it).
+ */
+struct iommu_batch {
+    struct domain *domain;
+    unsigned int depth;
+    bool_t dont_flush;
+    unsigned long gfn_min, gfn_max;
+};
+static DEFINE_PER_CPU(struct iommu_batch, iommu_batch);
+
+/* Spans wider than this get a domain-wide flush rather than a ranged one. */
+#define IOMMU_BATCH_MAX_RANGE (1UL << 18)
+
 DEFINE_SPINLOCK(iommu_pt_cleanup_lock);
 PAGE_LIST_HEAD(iommu_pt_cleanup_list);
 static struct tasklet iommu_pt_cleanup_tasklet;
@@ -67,6 +87,12 @@ static struct keyhandler iommu_p2m_table = {
     .desc = "dump iommu p2m table"
 };
 
+static struct keyhandler iommu_pgtable_stats = {
+    .diagnostic = 0,
+    .u.fn = iommu_dump_pgtable_stats,
+    .desc = "dump iommu page table statistics"
+};
+
 static void __init parse_iommu_param(char *s)
 {
     char *ss;
@@ -109,6 +135,8 @@ static void __init parse_iommu_param(char *s)
             iommu_dom0_strict = val;
         else if ( !strcmp(s, "sharept") )
             iommu_hap_pt_share = val;
+        else if ( !strcmp(s, "superpages") )
+            iommu_superpages = val;
 
         s = ss + 1;
     } while ( ss );
@@ -154,6 +182,7 @@ void __hwdom_init iommu_hwdom_init(struct domain *d)
         return;
 
     register_keyhandler('o', &iommu_p2m_table);
+    register_keyhandler('j', &iommu_pgtable_stats);
     d->need_iommu = !!iommu_dom0_strict;
     if ( need_iommu(d) && !iommu_use_hap_pt(d) )
     {
@@ -200,25 +229,187 @@ void iommu_domain_destroy(struct domain *d)
     arch_iommu_domain_destroy(d);
 }
 
+static void iommu_batch_note(struct domain *d, unsigned long gfn,
+                             unsigned long nr)
+{
+    struct iommu_batch *b = &this_cpu(iommu_batch);
+
+    if ( !b->depth )
+        return;
+
+    /* Only one domain's range is tracked; flush any other right away. */
+    if ( d != b->domain )
+    {
+        if ( nr > IOMMU_BATCH_MAX_RANGE )
+            iommu_iotlb_flush_all(d);
+        else
+            iommu_iotlb_flush(d, gfn, nr);
+        return;
+    }
+
+    if ( gfn < b->gfn_min )
+        b->gfn_min = gfn;
+    if ( gfn + nr - 1 > b->gfn_max )
+        b->gfn_max = gfn + nr - 1;
+}
+
 int iommu_map_page(struct domain *d, unsigned long gfn, unsigned long mfn,
                    unsigned int flags)
 {
     struct hvm_iommu *hd = domain_hvm_iommu(d);
+    int rc;
 
     if ( !iommu_enabled || !hd->platform_ops )
         return 0;
 
-    return hd->platform_ops->map_page(d, gfn, mfn, flags);
+    rc = hd->platform_ops->map_page(d, gfn, mfn, flags);
+    iommu_batch_note(d, gfn, 1);
+
+    return rc;
 }
 
 int iommu_unmap_page(struct domain *d, unsigned long gfn)
 {
     struct hvm_iommu *hd = domain_hvm_iommu(d);
+    int rc;
 
     if ( !iommu_enabled || !hd->platform_ops )
         return 0;
 
-    return hd->platform_ops->unmap_page(d, gfn);
+    rc = hd->platform_ops->unmap_page(d, gfn);
+    iommu_batch_note(d, gfn, 1);
+
+    return rc;
+}
+
+/* Superpage leaves come in strides of 9 address bits with either vendor. */
+#define IOMMU_ORDER_STRIDE 9
+
+/*
+ * Map 2^order naturally aligned pages, as a single superpage leaf where the
+ * IOMMU driver can, otherwise in the largest chunks it accepts.
+ */
+int iommu_map_pages(struct domain *d, unsigned long gfn, unsigned long mfn,
+                    unsigned int order, unsigned int flags)
+{
+    struct hvm_iommu *hd = domain_hvm_iommu(d);
+    unsigned long i, nr = 1UL << order;
+    unsigned int sub;
+    int rc;
+
+    if ( !order )
+        return iommu_map_page(d, gfn, mfn, flags);
+
+    if ( !iommu_enabled || !hd->platform_ops )
+        return 0;
+
+    if ( iommu_superpages && hd->platform_ops->map_pages &&
+         !((gfn | mfn) & (nr - 1)) )
+    {
+        rc = hd->platform_ops->map_pages(d, gfn, mfn, order, flags);
+        if ( rc != -EOPNOTSUPP )
+        {
+            iommu_batch_note(d, gfn, nr);
+            return rc;
+        }
+    }
+
+    sub = ((order - 1) / IOMMU_ORDER_STRIDE) * IOMMU_ORDER_STRIDE;
+    for ( i = 0; i < nr; i += 1UL << sub )
+    {
+        rc = iommu_map_pages(d, gfn + i, mfn + i, sub, flags);
+        if ( rc )
+        {
+            while ( i )
+            {
+                i -= 1UL << sub;
+                iommu_unmap_pages(d, gfn + i, sub);
+            }
+            return rc;
+        }
+    }
+
+    return 0;
+}
+
+int iommu_unmap_pages(struct domain *d, unsigned long gfn, unsigned int order)
+{
+    struct hvm_iommu *hd = domain_hvm_iommu(d);
+    unsigned long i, nr = 1UL << order;
+    unsigned int sub;
+    int rc = 0, err;
+
+    if ( !order )
+        return iommu_unmap_page(d, gfn);
+
+    if ( !iommu_enabled || !hd->platform_ops )
+        return 0;
+
+    if ( hd->platform_ops->unmap_pages && !(gfn & (nr - 1)) )
+    {
+        rc = hd->platform_ops->unmap_pages(d, gfn, order);
+        if ( rc != -EOPNOTSUPP )
+        {
+            iommu_batch_note(d, gfn, nr);
+            return rc;
+        }
+        rc = 0;
+    }
+
+    sub = ((order - 1) / IOMMU_ORDER_STRIDE) * IOMMU_ORDER_STRIDE;
+    for ( i = 0; i < nr; i += 1UL << sub )
+    {
+        err = iommu_unmap_pages(d, gfn + i, sub);
+        if ( !rc )
+            rc = err;
+    }
+
+    return rc;
+}
+
+void iommu_batch_begin(struct domain *d)
+{
+    struct iommu_batch *b = &this_cpu(iommu_batch);
+
+    /*
+     * Nested sections extend the outermost one; should they be for another
+     * domain, that domain's pages are flushed individually as before.
+     */
+    if ( b->depth++ )
+        return;
+
+    b->domain = d;
+    b->gfn_min = ~0UL;
+    b->gfn_max = 0;
+    b->dont_flush = this_cpu(iommu_dont_flush_iotlb);
+    this_cpu(iommu_dont_flush_iotlb) = 1;
+}
+
+void iommu_batch_end(struct domain *d)
+{
+    struct iommu_batch *b = &this_cpu(iommu_batch);
+
+    ASSERT(b->depth);
+    if ( --b->depth )
+        return;
+
+    ASSERT(b->domain == d);
+    b->domain = NULL;
+    this_cpu(iommu_dont_flush_iotlb) = b->dont_flush;
+
+    if ( b->dont_flush || b->gfn_min > b->gfn_max )
+        return;
+
+    if ( b->gfn_max - b->gfn_min >= IOMMU_BATCH_MAX_RANGE )
+        iommu_iotlb_flush_all(d);
+    else
+        iommu_iotlb_flush(d, b->gfn_min, b->gfn_max - b->gfn_min + 1);
+}
+
+/* Have page tables queued on iommu_pt_cleanup_list freed. */
+void iommu_pt_cleanup_schedule(void)
+{
+    tasklet_schedule(&iommu_pt_cleanup_tasklet);
 }
 
 static void iommu_free_pagetables(unsigned long unused)
@@ -382,6 +573,52 @@ static void iommu_dump_p2m_table(unsigned char key)
     }
 }
 
+static void iommu_dump_pgtable_stats(unsigned char key)
+{
+    static const char *const sizes[IOMMU_STATS_LEVELS] = { "4k", "2M", "1G" };
+    struct iommu_pgtable_stats stats;
+    const struct iommu_ops *ops;
+    struct domain *d;
+    unsigned int i;
+
+    if ( !iommu_enabled )
+    {
+        printk("IOMMU not enabled!\n");
+        return;
+    }
+
+    ops = iommu_get_ops();
+    if ( !ops->pgtable_stats )
+        return;
+
+    printk("IOMMU page table statistics:\n");
+
+    rcu_read_lock(&domlist_read_lock);
+
+    for_each_domain ( d )
+    {
+        if ( !need_iommu(d) )
+            continue;
+
+        if ( iommu_use_hap_pt(d) )
+        {
+            printk("d%d: shared with the p2m\n", d->domain_id);
+            continue;
+        }
+
+        memset(&stats, 0, sizeof(stats));
+        ops->pgtable_stats(d, &stats);
+
+        printk("d%d: %lu table pages (%lukB), leaves:", d->domain_id,
+               stats.tables, stats.tables << (PAGE_SHIFT - 10));
+        for ( i = 0; i < IOMMU_STATS_LEVELS; i++ )
+            printk(" %s %lu", sizes[i], stats.leaves[i]);
+        printk("\n");
+    }
+
+    rcu_read_unlock(&domlist_read_lock);
+}
+
 /*
  * Local variables:
  * mode: C
@@ -53,6 +53,9 @@ bool_t __read_mostly untrusted_msi;
 
 int nr_iommus;
 
+/* Highest level at which all VT-d engines support superpage leaves. */
+static int __read_mostly vtd_sp_level = 3;
+
 static struct tasklet vtd_fault_tasklet;
 
 static int setup_hwdom_device(u8 devfn, struct pci_dev *);
@@ -248,7 +251,54 @@ static u64 bus_to_context_maddr(struct iommu *iommu, u8 bus)
     return maddr;
 }
 
-static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
+/*
+ * Replace the superpage mapped by the level @level entry @pte with a table
+ * of level - 1 entries mapping the same range with the same attributes.
+ * Returns the new table's machine address, or 0 if none could be allocated.
+ */
+static u64 dma_pte_split_superpage(struct domain *domain, struct dma_pte *pte,
+                                   int level)
+{
+    struct acpi_drhd_unit *drhd;
+    struct dma_pte *table, new = { 0 };
+    u64 maddr;
+    int i;
+
+    drhd = acpi_find_matched_drhd_unit(
+        pci_get_pdev_by_domain(domain, -1, -1, -1));
+    maddr = alloc_pgtable_maddr(drhd, 1);
+    if ( !maddr )
+        return 0;
+
+    table = (struct dma_pte *)map_vtd_domain_page(maddr);
+    for ( i = 0; i < PTE_NUM; i++ )
+    {
+        table[i].val = pte->val + offset_level_address(i, level - 1);
+        if ( level == 2 )
+            table[i].val &= ~DMA_PTE_SP;
+    }
+    iommu_flush_cache_page(table, 1);
+    unmap_vtd_domain_page(table);
+
+    dma_set_pte_addr(new, maddr);
+    dma_set_pte_readable(new);
+    dma_set_pte_writable(new);
+    *pte = new;
+    iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+
+    return maddr;
+}
+
+/*
+ * Return the machine address of the page table holding the level @target
+ * entries covering @addr, allocating missing tables on the way if @alloc.
+ * Superpages above @target get split. Should that fail for a lookup
+ * (i.e. when about to unmap part of it) the superpage is left intact and
+ * 0 is returned; the domain gets crashed, as the caller can't honour the
+ * unmap.
+ */
+static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr,
+                                  int target, int alloc)
 {
     struct acpi_drhd_unit *drhd;
     struct pci_dev *pdev;
@@ -258,7 +308,6 @@ static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
     int level = agaw_to_level(hd->arch.agaw);
     int offset;
     u64 pte_maddr = 0, maddr;
-    u64 *vaddr = NULL;
 
     addr &= (((u64)1) << addr_width) - 1;
     ASSERT(spin_is_locked(&hd->arch.mapping_lock));
@@ -274,13 +323,15 @@ static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
             goto out;
     }
 
-    parent = (struct dma_pte *)map_vtd_domain_page(hd->arch.pgd_maddr);
-    while ( level > 1 )
+    pte_maddr = hd->arch.pgd_maddr;
+    parent = (struct dma_pte *)map_vtd_domain_page(pte_maddr);
+    while ( level > target )
     {
         offset = address_level_offset(addr, level);
         pte = &parent[offset];
 
-        if ( dma_pte_addr(*pte) == 0 )
+        pte_maddr = dma_pte_addr(*pte);
+        if ( pte_maddr == 0 )
         {
             if ( !alloc )
                 break;
@@ -292,7 +343,6 @@ static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
                 break;
 
             dma_set_pte_addr(*pte, maddr);
-            vaddr = map_vtd_domain_page(maddr);
 
             /*
              * high level table always sets r/w, last level
@@ -301,22 +351,27 @@ static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
             dma_set_pte_readable(*pte);
             dma_set_pte_writable(*pte);
             iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+            pte_maddr = maddr;
         }
-        else
-        {
-            vaddr = map_vtd_domain_page(pte->val);
-        }
-
-        if ( level == 2 )
+        else if ( dma_pte_superpage(*pte) )
         {
-            pte_maddr = pte->val & PAGE_MASK_4K;
-            unmap_vtd_domain_page(vaddr);
-            break;
+            pte_maddr = dma_pte_split_superpage(domain, pte, level);
+            if ( pte_maddr == 0 )
+            {
+                if ( !alloc )
+                {
+                    printk(XENLOG_ERR VTDPREFIX
+                           "d%d: can't split superpage at %"PRIx64"\n",
+                           domain->domain_id, addr);
+                    if ( !is_hardware_domain(domain) )
+                        domain_crash(domain);
+                }
+                break;
+            }
         }
 
         unmap_vtd_domain_page(parent);
-        parent = (struct dma_pte *)vaddr;
-        vaddr = NULL;
+        parent = (struct dma_pte *)map_vtd_domain_page(pte_maddr);
         level--;
     }
 
@@ -608,6 +663,31 @@ static void __intel_iommu_iotlb_flush(struct domain *d, unsigned long gfn,
     }
 }
 
+/* Flush all of @d's IOTLB entries, e.g. after replacing a page table. */
+static void intel_iommu_iotlb_flush_domain(struct domain *d)
+{
+    struct hvm_iommu *hd = domain_hvm_iommu(d);
+    struct acpi_drhd_unit *drhd;
+    struct iommu *iommu;
+    int iommu_domid;
+
+    for_each_drhd_unit ( drhd )
+    {
+        iommu = drhd->iommu;
+
+        if ( !test_bit(iommu->index, &hd->arch.iommu_bitmap) )
+            continue;
+
+        iommu_domid = domain_iommu_domid(d, iommu);
+        if ( iommu_domid == -1 )
+            continue;
+
+        if ( iommu_flush_iotlb_dsi(iommu, iommu_domid, 0,
+                                   !!find_ats_dev_drhd(iommu)) )
+            iommu_flush_write_buffer(iommu);
+    }
+}
+
 static void intel_iommu_iotlb_flush(struct domain *d, unsigned long gfn, unsigned int page_count)
 {
     __intel_iommu_iotlb_flush(d, gfn, 1, page_count);
@@ -627,7 +707,7 @@ static void dma_pte_clear_one(struct domain *domain, u64 addr)
 
     spin_lock(&hd->arch.mapping_lock);
     /* get last level pte */
-    pg_maddr = addr_to_dma_page_maddr(domain, addr, 0);
+    pg_maddr = addr_to_dma_page_maddr(domain, addr, 1, 0);
     if ( pg_maddr == 0 )
     {
         spin_unlock(&hd->arch.mapping_lock);
@@ -682,7 +762,7 @@ static void iommu_free_page_table(struct page_info *pg)
         if ( !dma_pte_present(*pte) )
             continue;
 
-        if ( next_level >= 1 )
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             iommu_free_pagetable(dma_pte_addr(*pte), next_level);
 
         dma_clear_pte(*pte);
@@ -693,6 +773,77 @@ static void iommu_free_page_table(struct page_info *pg)
     free_pgtable_maddr(pt_maddr);
 }
 
+/*
+ * Having just installed an entry in the level @level table at @pt_maddr,
+ * replace that table (and then in turn its ancestors) by a superpage leaf
+ * in its parent, for as long as all its entries map a single naturally
+ * aligned, contiguous range with identical attributes. The tables replaced
+ * (at most two, at @level and @level + 1) are stored in @replaced and their
+ * number returned; the caller has to flush the IOTLB before freeing them.
+ */
+static unsigned int dma_pte_coalesce(struct domain *d, u64 addr, u64 pt_maddr,
+                                     int level, u64 replaced[2])
+{
+    struct hvm_iommu *hd = domain_hvm_iommu(d);
+    unsigned int nr = 0;
+
+    if ( !iommu_superpages )
+        return 0;
+
+    for ( ; level < vtd_sp_level && level < agaw_to_level(hd->arch.agaw);
+          level++ )
+    {
+        struct dma_pte *table, *pte, first;
+        u64 step = offset_level_address(1, level), parent_maddr;
+        int i = 0;
+
+        table = (struct dma_pte *)map_vtd_domain_page(pt_maddr);
+        first = table[0];
+
+        /*
+         * Check the last entry before scanning all of them, so that mapping
+         * a range in ascending order doesn't rescan the table every time.
+         */
+        if ( dma_pte_present(first) &&
+             dma_pte_superpage(first) == (level > 1) &&
+             !(dma_pte_addr(first) & ~level_mask(level + 1)) &&
+             table[PTE_NUM - 1].val == first.val + (PTE_NUM - 1) * step )
+            for ( i = 1; i < PTE_NUM; i++ )
+                if ( table[i].val != first.val + i * step )
+                    break;
+
+        unmap_vtd_domain_page(table);
+        if ( i < PTE_NUM )
+            break;
+
+        parent_maddr = addr_to_dma_page_maddr(d, addr, level + 1, 0);
+        if ( !parent_maddr )
+            break;
+
+        table = (struct dma_pte *)map_vtd_domain_page(parent_maddr);
+        pte = table + address_level_offset(addr, level + 1);
+        pte->val = first.val | DMA_PTE_SP;
+        iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+        unmap_vtd_domain_page(table);
+
+        replaced[nr++] = pt_maddr;
+        pt_maddr = parent_maddr;
+    }
+
+    return nr;
+}
+
+/* Free the tables dma_pte_coalesce() replaced, starting at @level. */
+static void dma_pte_free_replaced(const u64 *replaced, int level,
+                                  unsigned int nr)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr; i++ )
+        iommu_free_pagetable(replaced[i], level + i);
+    iommu_pt_cleanup_schedule();
+}
+
 static int iommu_set_root_entry(struct iommu *iommu)
 {
     u32 sts;
@@ -1338,7 +1489,7 @@ int domain_context_mapping_one(
         /* Ensure we have pagetables allocated down to leaf PTE. */
         if ( hd->arch.pgd_maddr == 0 )
         {
-            addr_to_dma_page_maddr(domain, 0, 1);
+            addr_to_dma_page_maddr(domain, 0, 1, 1);
             if ( hd->arch.pgd_maddr == 0 )
             {
             nomem:
@@ -1718,7 +1869,8 @@ static int intel_iommu_map_page(
 {
     struct hvm_iommu *hd = domain_hvm_iommu(d);
     struct dma_pte *page = NULL, *pte = NULL, old, new = { 0 };
-    u64 pg_maddr;
+    u64 pg_maddr, replaced[2];
+    unsigned int nr;
 
     /* Do nothing if VT-d shares EPT page table */
     if ( iommu_use_hap_pt(d) )
@@ -1730,7 +1882,7 @@ static int intel_iommu_map_page(
 
     spin_lock(&hd->arch.mapping_lock);
 
-    pg_maddr = addr_to_dma_page_maddr(d, (paddr_t)gfn << PAGE_SHIFT_4K, 1);
+    pg_maddr = addr_to_dma_page_maddr(d, (paddr_t)gfn << PAGE_SHIFT_4K, 1, 1);
     if ( pg_maddr == 0 )
     {
         spin_unlock(&hd->arch.mapping_lock);
@@ -1757,15 +1909,88 @@ static int intel_iommu_map_page(
     *pte = new;
 
     iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
-    spin_unlock(&hd->arch.mapping_lock);
     unmap_vtd_domain_page(page);
+    nr = dma_pte_coalesce(d, (paddr_t)gfn << PAGE_SHIFT_4K, pg_maddr, 1,
+                          replaced);
+    spin_unlock(&hd->arch.mapping_lock);
 
-    if ( !this_cpu(iommu_dont_flush_iotlb) )
+    if ( nr )
+    {
+        intel_iommu_iotlb_flush_domain(d);
+        dma_pte_free_replaced(replaced, 1, nr);
+    }
+    else if ( !this_cpu(iommu_dont_flush_iotlb) )
         __intel_iommu_iotlb_flush(d, gfn, dma_pte_present(old), 1);
 
     return 0;
 }
 
+static int intel_iommu_map_pages(
+    struct domain *d, unsigned long gfn, unsigned long mfn,
+    unsigned int order, unsigned int flags)
+{
+    struct hvm_iommu *hd = domain_hvm_iommu(d);
+    struct dma_pte *page, *pte, old, new = { 0 };
+    int level = order / LEVEL_STRIDE + 1;
+    u64 addr = (paddr_t)gfn << PAGE_SHIFT_4K, pg_maddr, replaced[2];
+    unsigned int nr;
+
+    if ( (order % LEVEL_STRIDE) || level < 2 || level > vtd_sp_level ||
+         level > agaw_to_level(hd->arch.agaw) || !iommu_superpages )
+        return -EOPNOTSUPP;
+
+    if ( iommu_use_hap_pt(d) )
+        return 0;
+
+    if ( iommu_passthrough && is_hardware_domain(d) )
+        return 0;
+
+    spin_lock(&hd->arch.mapping_lock);
+
+    pg_maddr = addr_to_dma_page_maddr(d, addr, level, 1);
+    if ( pg_maddr == 0 )
+    {
+        spin_unlock(&hd->arch.mapping_lock);
+        return -ENOMEM;
+    }
+    page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
+    pte = page + address_level_offset(addr, level);
+    old = *pte;
+    dma_set_pte_addr(new, (paddr_t)mfn << PAGE_SHIFT_4K);
+    dma_set_pte_prot(new,
+                     ((flags & IOMMUF_readable) ? DMA_PTE_READ  : 0) |
+                     ((flags & IOMMUF_writable) ? DMA_PTE_WRITE : 0));
+    dma_set_pte_superpage(new);
+    if ( iommu_snoop )
+        dma_set_pte_snp(new);
+
+    if ( old.val == new.val )
+    {
+        spin_unlock(&hd->arch.mapping_lock);
+        unmap_vtd_domain_page(page);
+        return 0;
+    }
+    *pte = new;
+
+    iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+    unmap_vtd_domain_page(page);
+    nr = dma_pte_coalesce(d, addr, pg_maddr, level, replaced);
+    spin_unlock(&hd->arch.mapping_lock);
+
+    /* Replaced tables may only go once the IOTLB is clean. */
+    if ( (dma_pte_present(old) && !dma_pte_superpage(old)) || nr )
+    {
+        intel_iommu_iotlb_flush_domain(d);
+        if ( dma_pte_present(old) && !dma_pte_superpage(old) )
+            iommu_free_pagetable(dma_pte_addr(old), level - 1);
+        dma_pte_free_replaced(replaced, level, nr);
+    }
+    else if ( !this_cpu(iommu_dont_flush_iotlb) )
+        __intel_iommu_iotlb_flush(d, gfn, dma_pte_present(old), 1U << order);
+
+    return 0;
+}
+
 static int intel_iommu_unmap_page(struct domain *d, unsigned long gfn)
 {
     /* Do nothing if dom0 and iommu supports pass thru. */
@@ -1777,6 +2002,56 @@ static int intel_iommu_unmap_page(struct domain *d, unsigned long gfn)
     return 0;
 }
 
+static int intel_iommu_unmap_pages(struct domain *d, unsigned long gfn,
+                                   unsigned int order)
+{
+    struct hvm_iommu *hd = domain_hvm_iommu(d);
+    struct dma_pte *page, *pte, old;
+    int level = order / LEVEL_STRIDE + 1;
+    u64 addr = (paddr_t)gfn << PAGE_SHIFT_4K, pg_maddr;
+
+    if ( (order % LEVEL_STRIDE) || level < 2 ||
+         level > agaw_to_level(hd->arch.agaw) )
+        return -EOPNOTSUPP;
+
+    if ( iommu_passthrough && is_hardware_domain(d) )
+        return 0;
+
+    spin_lock(&hd->arch.mapping_lock);
+
+    pg_maddr = addr_to_dma_page_maddr(d, addr, level, 0);
+    if ( pg_maddr == 0 )
+    {
+        spin_unlock(&hd->arch.mapping_lock);
+        return 0;
+    }
+    page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
+    pte = page + address_level_offset(addr, level);
+    old = *pte;
+    if ( dma_pte_present(old) )
+    {
+        dma_clear_pte(*pte);
+        iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+    }
+    spin_unlock(&hd->arch.mapping_lock);
+    unmap_vtd_domain_page(page);
+
+    if ( !dma_pte_present(old) )
+        return 0;
+
+    /* Whole tables can be dropped, but only once the IOTLB is clean. */
+    if ( !dma_pte_superpage(old) )
+    {
+        intel_iommu_iotlb_flush_domain(d);
+        iommu_free_pagetable(dma_pte_addr(old), level - 1);
+        iommu_pt_cleanup_schedule();
+    }
+    else if ( !this_cpu(iommu_dont_flush_iotlb) )
+        __intel_iommu_iotlb_flush(d, gfn, 1, 1U << order);
+
+    return 0;
+}
+
 void iommu_pte_flush(struct domain *d, u64 gfn, u64 *pte,
                      int order, int present)
 {
@@ -2199,6 +2474,11 @@ int __init intel_vtd_setup(void)
 
         printk(".\n");
 
+        if ( !cap_sps_2mb(iommu->cap) )
+            vtd_sp_level = 1;
+        else if ( !cap_sps_1gb(iommu->cap) && vtd_sp_level > 2 )
+            vtd_sp_level = 2;
+
         if ( iommu_snoop && !ecap_snp_ctl(iommu->ecap) )
             iommu_snoop = 0;
 
@@ -2436,9 +2716,15 @@ static void vtd_dump_p2m_table_level(paddr_t pt_maddr, int level, paddr_t gpa,
             continue;
 
         address = gpa + offset_level_address(i, level);
-        if ( next_level >= 1 ) 
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             vtd_dump_p2m_table_level(dma_pte_addr(*pte), next_level, 
                                      address, indent + 1);
+        else if ( next_level >= 1 )
+            printk("%*sgfn: %08lx mfn: %08lx order: %d\n",
+                   indent, "",
+                   (unsigned long)(address >> PAGE_SHIFT_4K),
+                   (unsigned long)(dma_pte_addr(*pte) >> PAGE_SHIFT_4K),
+                   next_level * LEVEL_STRIDE);
         else
             printk("%*sgfn: %08lx mfn: %08lx\n",
                    indent, "",
@@ -2461,6 +2747,45 @@ static void vtd_dump_p2m_table(struct domain *d)
     vtd_dump_p2m_table_level(hd->arch.pgd_maddr, agaw_to_level(hd->arch.agaw), 0, 0);
 }
 
+static void vtd_pgtable_stats_level(paddr_t pt_maddr, int level,
+                                    struct iommu_pgtable_stats *stats)
+{
+    struct dma_pte *pt_vaddr, *pte;
+    int i;
+
+    pt_vaddr = map_vtd_domain_page(pt_maddr);
+    if ( pt_vaddr == NULL )
+        return;
+
+    stats->tables++;
+    for ( i = 0; i < PTE_NUM; i++ )
+    {
+        if ( !(i % 64) )
+            process_pending_softirqs();
+
+        pte = &pt_vaddr[i];
+        if ( !dma_pte_present(*pte) )
+            continue;
+
+        if ( level > 1 && !dma_pte_superpage(*pte) )
+            vtd_pgtable_stats_level(dma_pte_addr(*pte), level - 1, stats);
+        else if ( level <= IOMMU_STATS_LEVELS )
+            stats->leaves[level - 1]++;
+    }
+
+    unmap_vtd_domain_page(pt_vaddr);
+}
+
+static void vtd_pgtable_stats(struct domain *d,
+                              struct iommu_pgtable_stats *stats)
+{
+    struct hvm_iommu *hd = domain_hvm_iommu(d);
+
+    if ( hd->arch.pgd_maddr )
+        vtd_pgtable_stats_level(hd->arch.pgd_maddr,
+                                agaw_to_level(hd->arch.agaw), stats);
+}
+
 const struct iommu_ops intel_iommu_ops = {
     .init = intel_iommu_domain_init,
     .hwdom_init = intel_iommu_hwdom_init,
@@ -2471,6 +2796,8 @@ const struct iommu_ops intel_iommu_ops = {
     .teardown = iommu_domain_teardown,
     .map_page = intel_iommu_map_page,
     .unmap_page = intel_iommu_unmap_page,
+    .map_pages = intel_iommu_map_pages,
+    .unmap_pages = intel_iommu_unmap_pages,
     .free_page_table = iommu_free_page_table,
     .reassign_device = reassign_device_ownership,
     .get_device_group_id = intel_iommu_group_id,
@@ -2486,6 +2813,7 @@ const struct iommu_ops intel_iommu_ops = {
     .iotlb_flush = intel_iommu_iotlb_flush,
     .iotlb_flush_all = intel_iommu_iotlb_flush_all,
     .dump_p2m_table = vtd_dump_p2m_table,
+    .pgtable_stats = vtd_pgtable_stats,
 };
 
 /*
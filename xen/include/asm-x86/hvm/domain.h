@@ -68,6 +68,8 @@ struct hvm_ioreq_server {
     /* Lock to serialize access to buffered ioreq ring */
     spinlock_t             bufioreq_lock;
     evtchn_port_t          bufioreq_evtchn;
+    /* Emulator masks bufioreq_evtchn only while draining the ring. */
+    bool_t                 bufioreq_polled;
     struct rangeset        *range[NR_IO_RANGE_TYPES];
     bool_t                 enabled;
 };
@@ -99,6 +101,7 @@ struct hvm_domain {
     struct hvm_irq         irq;
     struct hvm_hw_vpic     vpic[2]; /* 0=master; 1=slave */
     struct hvm_vioapic    *vioapic;
+    struct vlapic_dest_map *vlapic_dest_map;
     struct hvm_hw_stdvga   stdvga;
 
     /* VCPU which is current target for 8259 interrupts. */
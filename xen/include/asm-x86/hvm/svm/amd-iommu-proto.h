@@ -55,6 +55,14 @@ int amd_iommu_update_ivrs_mapping_acpi(void);
 int amd_iommu_map_page(struct domain *d, unsigned long gfn, unsigned long mfn,
                        unsigned int flags);
 int amd_iommu_unmap_page(struct domain *d, unsigned long gfn);
+int amd_iommu_map_pages(struct domain *d, unsigned long gfn, unsigned long mfn,
+                        unsigned int order, unsigned int flags);
+int amd_iommu_unmap_pages(struct domain *d, unsigned long gfn,
+                          unsigned int order);
+void deallocate_next_page_table(struct page_info *pg, int level);
+void amd_iommu_iotlb_flush(struct domain *d, unsigned long gfn,
+                           unsigned int page_count);
+void amd_iommu_iotlb_flush_all(struct domain *d);
 u64 amd_iommu_get_next_table_from_pte(u32 *entry);
 int amd_iommu_reserve_domain_unity_map(struct domain *domain,
                                        u64 phys_addr, unsigned long size,
@@ -286,4 +294,18 @@ static inline unsigned int iommu_next_level(const u32 *entry)
                                   IOMMU_PDE_NEXT_LEVEL_SHIFT);
 }
 
+static inline bool_t iommu_pte_writable(const u32 *entry)
+{
+    return get_field_from_reg_u32(entry[1],
+                                  IOMMU_PDE_IO_WRITE_PERMISSION_MASK,
+                                  IOMMU_PDE_IO_WRITE_PERMISSION_SHIFT);
+}
+
+static inline bool_t iommu_pte_readable(const u32 *entry)
+{
+    return get_field_from_reg_u32(entry[1],
+                                  IOMMU_PDE_IO_READ_PERMISSION_MASK,
+                                  IOMMU_PDE_IO_READ_PERMISSION_SHIFT);
+}
+
 #endif /* _ASM_X86_64_AMD_IOMMU_PROTO_H */
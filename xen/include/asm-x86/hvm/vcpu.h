@@ -29,6 +29,7 @@
 #include <asm/hvm/svm/vmcb.h>
 #include <asm/hvm/svm/nestedsvm.h>
 #include <asm/mtrr.h>
+#include <asm/x86_emulate.h>
 
 enum hvm_io_state {
     HVMIO_none = 0,
@@ -75,6 +76,19 @@ struct hvm_vcpu_io {
      */
     bool_t mmio_retry, mmio_retrying;
 
+    /*
+     * Recently emulated simple MOVs, indexed by RIP and validated against
+     * the fetched instruction bytes, so that repeated accesses from the
+     * same site skip the full x86_emulate() decode.
+     */
+#define HVM_MMIO_INSN_CACHE_SIZE 4
+    struct hvm_mmio_insn_cache {
+        unsigned long eip;
+        uint8_t addr_size;
+        uint8_t insn[15];
+        struct x86_emulate_mov mov;
+    } mmio_insn_cache[HVM_MMIO_INSN_CACHE_SIZE];
+
     unsigned long msix_unmask_address;
 };
 
@@ -104,6 +104,9 @@ int vlapic_ack_pending_irq(struct vcpu *v, int vector, bool_t force_ack);
 int  vlapic_init(struct vcpu *v);
 void vlapic_destroy(struct vcpu *v);
 
+int  vlapic_domain_init(struct domain *d);
+void vlapic_domain_destroy(struct domain *d);
+
 void vlapic_reset(struct vlapic *vlapic);
 
 void vlapic_msr_set(struct vlapic *vlapic, uint64_t value);
@@ -232,6 +232,14 @@ struct p2m_domain {
      * host p2m's lock. */
     int                defer_nested_flush;
 
+    /* Host p2m: when this flag is set, TLB flushes the p2m implementation
+     * would issue are only recorded in @need_flush, so that a batch of
+     * changes gets a single flush.  The setter of this flag is responsible
+     * for clearing it and calling p2m_tlb_flush_sync() before releasing
+     * the host p2m's lock. */
+    bool_t             defer_flush;
+    bool_t             need_flush;
+
     /* Pages used to construct the p2m */
     struct page_list_head pages;
 
@@ -254,6 +262,7 @@ struct p2m_domain {
                                                   unsigned long first_gfn,
                                                   unsigned long last_gfn);
     void               (*memory_type_changed)(struct p2m_domain *p2m);
+    void               (*tlb_flush)(struct p2m_domain *p2m);
     
     void               (*write_p2m_entry)(struct p2m_domain *p2m,
                                           unsigned long gfn, l1_pgentry_t *p,
@@ -294,6 +303,12 @@ struct p2m_domain {
         /* gpfn of last guest superpage demand-populated */
         unsigned long    last_populated[POD_HISTORY_MAX]; 
         unsigned int     last_populated_index;
+        /* Zero-page hints: one bit per 2M region populated from the cache
+         * and not yet seen to be dirty, summarised one bit per 1G. */
+        unsigned long   *zero_hint;
+        unsigned long   *zero_hint_1g;
+        unsigned long    zero_hint_nr;   /* # of 2M regions covered */
+        unsigned long    zero_hint_next; /* 2M region to resume sweep at */
         mm_lock_t        lock;         /* Locking of private pod structs,   *
                                         * not relying on the p2m lock.      */
     } pod;
@@ -529,6 +544,9 @@ int p2m_change_type_one(struct domain *d, unsigned long gfn,
 /* Report a change affecting memory types. */
 void p2m_memory_type_changed(struct domain *d);
 
+/* Issue a TLB flush recorded while p2m->defer_flush was set. */
+void p2m_tlb_flush_sync(struct p2m_domain *p2m);
+
 int p2m_is_logdirty_range(struct p2m_domain *, unsigned long start,
                           unsigned long end);
 
@@ -74,6 +74,7 @@
 #define EVTCHNOP_init_control    11
 #define EVTCHNOP_expand_array    12
 #define EVTCHNOP_set_priority    13
+#define EVTCHNOP_send_multi      14
 /* ` } */
 
 typedef uint32_t evtchn_port_t;
@@ -308,6 +309,23 @@ struct evtchn_set_priority {
 };
 typedef struct evtchn_set_priority evtchn_set_priority_t;
 
+/*
+ * EVTCHNOP_send_multi: Send an event to the remote end of each of the <nr>
+ * local endpoints in <port>, as if by EVTCHNOP_send.
+ * NOTES:
+ *  1. All ports are checked before any event is sent.  If any port is
+ *     invalid, no event is sent.
+ *  2. At most one upcall is raised per target VCPU, after all of the
+ *     events have been made pending.
+ */
+#define EVTCHN_SEND_MULTI_MAX 32
+struct evtchn_send_multi {
+    /* IN parameters. */
+    uint32_t nr;
+    evtchn_port_t port[EVTCHN_SEND_MULTI_MAX];
+};
+typedef struct evtchn_send_multi evtchn_send_multi_t;
+
 /*
  * ` enum neg_errnoval
  * ` HYPERVISOR_event_channel_op_compat(struct evtchn_op *op)
@@ -261,10 +261,19 @@ typedef uint16_t ioservid_t;
  * The <id> handed back is unique for <domid>. If <handle_bufioreq> is zero
  * the buffered ioreq ring will not be allocated and hence all emulation
  * requestes to this server will be synchronous.
+ *
+ * With HVM_IOREQSRV_BUFIOREQ_POLLED the emulator additionally promises to
+ * keep the buffered ioreq event channel masked only while it is draining
+ * the ring, and to re-scan the ring after unmasking it. Xen then does not
+ * send notifications while the port is masked.
  */
 #define HVMOP_create_ioreq_server 17
 struct xen_hvm_create_ioreq_server {
     domid_t domid;           /* IN - domain to be serviced */
+#define HVM_IOREQSRV_BUFIOREQ_OFF    0
+#define HVM_IOREQSRV_BUFIOREQ_LEGACY 1
+/* Values 2-0x7f are reserved for further ring layouts (e.g. ATOMIC = 2). */
+#define HVM_IOREQSRV_BUFIOREQ_POLLED 0x80
     uint8_t handle_bufioreq; /* IN - should server handle buffered ioreqs */
     ioservid_t id;           /* OUT - server id */
 };
@@ -151,6 +151,13 @@
 /* Location of the VM Generation ID in guest physical address space. */
 #define HVM_PARAM_VM_GENERATION_ID_ADDR 34
 
-#define HVM_NR_PARAMS          35
+/*
+ * Boolean: Coalesce periodic vpt ticks (no_missed_ticks_pending mode only).
+ * Ticks are aligned across VCPUs and may be delivered slightly late so that
+ * they can be batched, and preempted VCPUs get their tick when next run.
+ */
+#define HVM_PARAM_VPT_COALESCE 35
+
+#define HVM_NR_PARAMS          36
 
 #endif /* __XEN_PUBLIC_HVM_PARAMS_H__ */
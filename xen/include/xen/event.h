@@ -69,6 +69,12 @@ int guest_enabled_event(struct vcpu *v, uint32_t virq);
 /* Notify remote end of a Xen-attached event channel.*/
 void notify_via_xen_event_channel(struct domain *ld, int lport);
 
+/*
+ * As above, but don't notify if the remote end has the port masked.
+ * Returns whether a notification was sent.
+ */
+bool_t notify_via_xen_event_channel_unmasked(struct domain *ld, int lport);
+
 /*
  * Internal event channel object storage.
  *
@@ -128,12 +134,68 @@ void evtchn_check_pollers(struct domain *d, unsigned int port);
 
 void evtchn_2l_init(struct domain *d);
 
+/*
+ * A batch of events raised together (EVTCHNOP_send_multi).  Upcalls are
+ * collected in upcall[] rather than sent as each event is made pending, so
+ * that each target VCPU is notified at most once per batch.
+ */
+#define EVTCHN_BATCH_MAX EVTCHN_SEND_MULTI_MAX
+
+struct evtchn_batch {
+    unsigned int nr;
+    struct vcpu *vcpu[EVTCHN_BATCH_MAX];
+    struct evtchn *evtchn[EVTCHN_BATCH_MAX];
+    unsigned int nr_upcalls;
+    struct vcpu *upcall[EVTCHN_BATCH_MAX];
+};
+
+/* Record an upcall for @v, or send it immediately if @b is NULL. */
+static inline void evtchn_batch_upcall(struct evtchn_batch *b, struct vcpu *v)
+{
+    if ( !b )
+    {
+        vcpu_mark_events_pending(v);
+        return;
+    }
+
+    /* The batch is sorted by VCPU, so any duplicate is the last entry. */
+    if ( b->nr_upcalls && b->upcall[b->nr_upcalls - 1] == v )
+        return;
+
+    ASSERT(b->nr_upcalls < ARRAY_SIZE(b->upcall));
+    b->upcall[b->nr_upcalls++] = v;
+}
+
+/*
+ * Add an event for @v to @b.  The batch is kept sorted by VCPU, so that
+ * events for the same queue are adjacent.  The sort is stable: events for
+ * one queue are linked in the order they were added.
+ */
+static inline void evtchn_batch_add(struct evtchn_batch *b, struct vcpu *v,
+                                    struct evtchn *evtchn)
+{
+    unsigned int i;
+
+    ASSERT(b->nr < ARRAY_SIZE(b->vcpu));
+    for ( i = b->nr; i > 0 && b->vcpu[i - 1] > v; i-- )
+    {
+        b->vcpu[i] = b->vcpu[i - 1];
+        b->evtchn[i] = b->evtchn[i - 1];
+    }
+    b->vcpu[i] = v;
+    b->evtchn[i] = evtchn;
+    b->nr++;
+}
+
 /*
  * Low-level event channel port ops.
  */
 struct evtchn_port_ops {
     void (*init)(struct domain *d, struct evtchn *evtchn);
     void (*set_pending)(struct vcpu *v, struct evtchn *evtchn);
+    /* Raise events [first, first + nr) of @b, all in the same domain. */
+    void (*set_pending_batch)(struct evtchn_batch *b, unsigned int first,
+                              unsigned int nr);
     void (*clear_pending)(struct domain *d, struct evtchn *evtchn);
     void (*unmask)(struct domain *d, struct evtchn *evtchn);
     bool_t (*is_pending)(struct domain *d, const struct evtchn *evtchn);
@@ -155,6 +217,23 @@ static inline void evtchn_port_set_pending(struct vcpu *v,
     v->domain->evtchn_port_ops->set_pending(v, evtchn);
 }
 
+static inline void evtchn_port_set_pending_batch(struct evtchn_batch *b,
+                                                 unsigned int first,
+                                                 unsigned int nr)
+{
+    struct domain *d = b->vcpu[first]->domain;
+    unsigned int i;
+
+    if ( d->evtchn_port_ops->set_pending_batch )
+    {
+        d->evtchn_port_ops->set_pending_batch(b, first, nr);
+        return;
+    }
+
+    for ( i = first; i < first + nr; i++ )
+        d->evtchn_port_ops->set_pending(b->vcpu[i], b->evtchn[i]);
+}
+
 static inline void evtchn_port_clear_pending(struct domain *d,
                                              struct evtchn *evtchn)
 {
@@ -194,4 +273,24 @@ static inline void evtchn_port_print_state(struct domain *d,
     d->evtchn_port_ops->print_state(d, evtchn);
 }
 
+/*
+ * Raise every event in @b, with one set_pending_batch call per run of
+ * events in the same domain, then send the upcalls collected on the way.
+ */
+static inline void evtchn_batch_send(struct evtchn_batch *b)
+{
+    unsigned int i, j;
+
+    for ( i = 0; i < b->nr; i = j )
+    {
+        for ( j = i + 1; j < b->nr; j++ )
+            if ( b->vcpu[j]->domain != b->vcpu[i]->domain )
+                break;
+        evtchn_port_set_pending_batch(b, i, j - i);
+    }
+
+    for ( i = 0; i < b->nr_upcalls; i++ )
+        vcpu_mark_events_pending(b->upcall[i]);
+}
+
 #endif /* __XEN_EVENT_H__ */
@@ -31,7 +31,7 @@ extern bool_t iommu_enable, iommu_enabled;
 extern bool_t force_iommu, iommu_verbose;
 extern bool_t iommu_workaround_bios_bug, iommu_passthrough;
 extern bool_t iommu_snoop, iommu_qinval, iommu_intremap;
-extern bool_t iommu_hap_pt_share;
+extern bool_t iommu_hap_pt_share, iommu_superpages;
 extern bool_t iommu_debug;
 extern bool_t amd_iommu_perdev_intremap;
 
@@ -75,6 +75,16 @@ void iommu_teardown(struct domain *d);
 int iommu_map_page(struct domain *d, unsigned long gfn, unsigned long mfn,
                    unsigned int flags);
 int iommu_unmap_page(struct domain *d, unsigned long gfn);
+int iommu_map_pages(struct domain *d, unsigned long gfn, unsigned long mfn,
+                    unsigned int order, unsigned int flags);
+int iommu_unmap_pages(struct domain *d, unsigned long gfn, unsigned int order);
+
+/* Page-table footprint of a domain, as gathered by iommu_ops.pgtable_stats. */
+#define IOMMU_STATS_LEVELS 3                /* 4k, 2M and 1G leaves */
+struct iommu_pgtable_stats {
+    unsigned long tables;                   /* page-table pages */
+    unsigned long leaves[IOMMU_STATS_LEVELS];
+};
 
 enum iommu_feature
 {
@@ -144,6 +154,13 @@ struct iommu_ops {
     int (*map_page)(struct domain *d, unsigned long gfn, unsigned long mfn,
                     unsigned int flags);
     int (*unmap_page)(struct domain *d, unsigned long gfn);
+    /*
+     * Optional: install/remove a single leaf covering 2^order naturally
+     * aligned pages, returning -EOPNOTSUPP for orders not handled.
+     */
+    int (*map_pages)(struct domain *d, unsigned long gfn, unsigned long mfn,
+                     unsigned int order, unsigned int flags);
+    int (*unmap_pages)(struct domain *d, unsigned long gfn, unsigned int order);
     void (*free_page_table)(struct page_info *);
 #ifdef CONFIG_X86
     void (*update_ire_from_apic)(unsigned int apic, unsigned int reg, unsigned int value);
@@ -157,6 +174,7 @@ struct iommu_ops {
     void (*iotlb_flush)(struct domain *d, unsigned long gfn, unsigned int page_count);
     void (*iotlb_flush_all)(struct domain *d);
     void (*dump_p2m_table)(struct domain *d);
+    void (*pgtable_stats)(struct domain *d, struct iommu_pgtable_stats *stats);
 };
 
 void iommu_suspend(void);
@@ -188,7 +206,19 @@ void iommu_iotlb_flush_all(struct domain *d);
  */
 DECLARE_PER_CPU(bool_t, iommu_dont_flush_iotlb);
 
+/*
+ * iommu_map_page/iommu_unmap_page calls between iommu_batch_begin and
+ * iommu_batch_end don't flush the iotlb individually; instead the span of
+ * gfns touched is flushed once (ranged, or domain-wide if wide) by
+ * iommu_batch_end. The section must not be left for the scheduler, and
+ * must end before anything relying on a mapping having gone (e.g. the
+ * release of a page reference) happens.
+ */
+void iommu_batch_begin(struct domain *d);
+void iommu_batch_end(struct domain *d);
+
 extern struct spinlock iommu_pt_cleanup_lock;
 extern struct page_list_head iommu_pt_cleanup_list;
+void iommu_pt_cleanup_schedule(void);
 
 #endif /* _IOMMU_H_ */
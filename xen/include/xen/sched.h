@@ -249,6 +249,11 @@ struct vcpu
 
     struct evtchn_fifo_vcpu *evtchn_fifo;
 
+    /* Grant table maptrack free list (see common/grant_table.c). */
+    spinlock_t       maptrack_freelist_lock;
+    unsigned int     maptrack_head;
+    unsigned int     maptrack_tail;
+
     struct arch_vcpu arch;
 };
 
@@ -26,12 +26,17 @@ struct timer {
         struct timer *list_next;
         /* Linked list of inactive timers (TIMER_STATUS_inactive). */
         struct list_head inactive;
+        /* Timer-wheel bucket (TIMER_STATUS_in_wheel). */
+        struct list_head wheel;
     };
 
     /* On expiry, '(*function)(data)' will be executed in softirq context. */
     void (*function)(void *);
     void *data;
 
+    /* Nanoseconds this timer may fire late by, to coalesce with others. */
+    uint32_t slack;
+
     /* CPU on which this timer will be installed and executed. */
 #define TIMER_CPU_status_killed 0xffffu /* Timer is TIMER_STATUS_killed */
     uint16_t cpu;
@@ -42,7 +47,11 @@ struct timer {
 #define TIMER_STATUS_killed   2 /* Not in use; cannot be activated. */
 #define TIMER_STATUS_in_heap  3 /* In use; on timer heap.           */
 #define TIMER_STATUS_in_list  4 /* In use; on overflow linked list. */
+#define TIMER_STATUS_in_wheel 5 /* In use; on timer wheel.          */
     uint8_t status;
+
+    /* Timer-wheel bucket index (TIMER_STATUS_in_wheel). */
+    uint16_t wheel_slot;
 };
 
 /*
@@ -61,6 +70,20 @@ void init_timer(
     void         *data,
     unsigned int  cpu);
 
+/*
+ * Allow a timer to fire up to @slack nanoseconds after its expiry time.
+ * Timers tolerating enough slack are kept on a per-CPU timer wheel, where
+ * set_timer() and stop_timer() are O(1) and expiries falling close together
+ * are handled in one go. The wheel uses the slack to round the expiry up to
+ * a tick shared with other timers, so such a timer may really fire up to
+ * @slack (plus one ~33us wheel bucket) late. Takes effect from the next
+ * set_timer().
+ */
+static inline void set_timer_slack(struct timer *timer, uint32_t slack)
+{
+    timer->slack = slack;
+}
+
 /* Set the expiry time and activate a timer. */
 void set_timer(struct timer *timer, s_time_t expires);
 